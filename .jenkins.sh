@@ -29,15 +29,41 @@ run_test ./autogen.sh
 run_test ./configure --enable-debug
 make clean
 run_test make
+run_test make -C bench bench-stub
+run_test make check
 
 run_test src/chinadns -h
 run_test src/chinadns -V
+printf 'taobao.com\n' > /tmp/chinadns-chn.conf
+printf 'server=/google.com/twitter.com/127.0.0.1#5353\n' > /tmp/chinadns-foreign.conf
+run_test src/chinadns-compile -c chnroute.txt -l iplist.txt -o /tmp/chinadns-routes.img
+run_test src/chinadns-compile -c chnroute.txt -D /tmp/chinadns-chn.conf -O /tmp/chinadns-foreign.conf -o /tmp/chinadns-domains.img
 
 run_test tests/test.py -a '-c chnroute.txt -l iplist.txt' -t tests/google.com
 run_test tests/test.py -a '-c chnroute.txt -l iplist.txt' -t tests/facebook.com
 run_test tests/test.py -a '-c chnroute.txt -s 114.114.114.114,8.8.8.8 -l iplist.txt' -t tests/google.com
 run_test tests/test.py -a '-c chnroute.txt -y 0.5 -l iplist.txt' -t tests/google.com
 run_test tests/test.py -a '-c chnroute.txt -b 0.0.0.0 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -b :: -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -C 0 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -F 0.5 -X 0 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -P 4 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -M 16 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -v -S 2 -R 100 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -H -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -e 127.0.0.1:9153 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -T 16 -l iplist.txt' -t tests/google.com-tcp
+run_test tests/test.py -a '-c chnroute.txt -E 4096 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -s 114.114.114.114,tcp://8.8.8.8 -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -s 114.114.114.114,tls://8.8.8.8#dns.google -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c /tmp/chinadns-routes.img -l /tmp/chinadns-routes.img' -t tests/google.com
+run_test tests/test.py -a '-c chnroute.txt -D /tmp/chinadns-chn.conf -O /tmp/chinadns-foreign.conf -l iplist.txt' -t tests/google.com
+run_test tests/test.py -a '-c /tmp/chinadns-domains.img -D /tmp/chinadns-domains.img -O /tmp/chinadns-domains.img' -t tests/google.com
+
+run_test tests/tls.py
+run_test tests/workers.py
+run_test tests/reload.py
+run_test tests/coalesce.py
 
 run_test tests/test.py -a '-c chnroute.txt -l iplist.txt' -t tests/twitter.com
 run_test tests/test.py -a '-d -c chnroute.txt -l iplist.txt' -t tests/twitter.com
@@ -47,6 +73,8 @@ run_test tests/test.py -a '-m -c chnroute.txt' -t tests/twitter.com
 run_test tests/test.py -a '-c chnroute.txt -l iplist.txt' -t tests/taobao.com
 run_test tests/test.py -a '-d -c chnroute.txt -l iplist.txt' -t tests/taobao.com
 run_test tests/test.py -a '-c chnroute.txt' -t tests/taobao.com
+run_test tests/test.py -a '-H -c chnroute.txt' -t tests/taobao.com
+run_test tests/test.py -a '-c chnroute.txt -D /tmp/chinadns-chn.conf' -t tests/taobao.com
 run_test tests/test.py -a '-m -c chnroute.txt' -t tests/taobao.com
 
 run_test tests/test.py -a '-c chnroute.txt -l iplist.txt' -t tests/x_8888
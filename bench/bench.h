@@ -0,0 +1,44 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* names are c<n>.bench for Chinese domains and f<n>.bench for foreign
+   ones. the right answer follows from the name: a Chinese domain resolves
+   into BENCH_CHN_NET, which is what the bench chnroute holds, and a
+   foreign one into BENCH_FOREIGN_NET */
+#define BENCH_DOMAIN "bench"
+#define BENCH_CHN_NET 0x0a000000
+#define BENCH_FOREIGN_NET 0x0b000000
+#define BENCH_CHNROUTE "10.0.0.0/8"
+
+static inline uint32_t bench_addr(int foreign, uint32_t n) {
+  return (foreign ? BENCH_FOREIGN_NET : BENCH_CHN_NET) | (n & 0xffffff);
+}
+
+static inline uint64_t bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the offset after the name at off, following nothing; 0 if it runs past
+   len. *compressed is set if it ends in a pointer */
+static inline size_t bench_skip_name(const unsigned char *msg, size_t len,
+                                     size_t off, int *compressed) {
+  *compressed = 0;
+  while (off < len) {
+    if ((msg[off] & 0xc0) == 0xc0) {
+      *compressed = 1;
+      return off + 2 <= len ? off + 2 : 0;
+    }
+    if (msg[off] == 0)
+      return off + 1;
+    off += 1 + msg[off];
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+
+/* sends c<n>.bench and f<n>.bench queries at a fixed rate, or as fast as
+   the window allows, and reports throughput, latency and how many
+   answers were right */
+
+#define BUF_SIZE 512
+#define MAX_WINDOW 60000
+// datagrams read or sent before looking at the other side
+#define ROUNDS 64
+
+typedef struct {
+  uint64_t sent_at;
+  uint32_t n;
+  uint8_t foreign;
+  uint8_t used;
+} query_t;
+
+static query_t queries[65536];
+// ids in the order they were sent, oldest first
+static uint16_t order[65536];
+static int order_head = 0;
+static int order_len = 0;
+static uint16_t next_id = 0;
+
+// microseconds of every answer
+static uint32_t *latencies;
+static size_t latencies_len = 0;
+static size_t latencies_cap = 0;
+
+static unsigned long sent, answered, dropped, late, right, wrong, poisoned,
+                     empty;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+  size_t i;
+  if (latencies_len == 0)
+    return 0;
+  i = (size_t)(p / 100 * latencies_len);
+  if (i >= latencies_len)
+    i = latencies_len - 1;
+  return latencies[i] / 1000.0;
+}
+
+static size_t build_query(unsigned char *buf, uint16_t id, int foreign,
+                          uint32_t n) {
+  int len = sprintf((char *)buf + 13, "%c%u", foreign ? 'f' : 'c', n);
+  size_t off = 13 + len;
+  buf[0] = id >> 8;
+  buf[1] = id & 0xff;
+  // RD, one question
+  memcpy(buf + 2, "\1\0\0\1\0\0\0\0\0\0", 10);
+  buf[12] = len;
+  buf[off++] = sizeof(BENCH_DOMAIN) - 1;
+  memcpy(buf + off, BENCH_DOMAIN, sizeof(BENCH_DOMAIN));
+  off += sizeof(BENCH_DOMAIN);
+  // A, IN
+  memcpy(buf + off, "\0\1\0\1", 4);
+  return off + 4;
+}
+
+static void record_latency(uint64_t ns) {
+  if (latencies_len == latencies_cap) {
+    size_t cap = latencies_cap ? latencies_cap * 2 : 65536;
+    uint32_t *l = realloc(latencies, cap * sizeof(uint32_t));
+    if (l == NULL)
+      return;
+    latencies = l;
+    latencies_cap = cap;
+  }
+  latencies[latencies_len++] = ns / 1000;
+}
+
+// the first A record decides
+static void judge(const unsigned char *buf, size_t len, query_t *q) {
+  int compressed;
+  size_t off = bench_skip_name(buf, len, 12, &compressed);
+  int an = buf[6] << 8 | buf[7];
+  if (off == 0 || (buf[4] << 8 | buf[5]) != 1) {
+    empty++;
+    return;
+  }
+  off += 4;
+  while (an-- > 0) {
+    uint16_t type, rdlength;
+    off = bench_skip_name(buf, len, off, &compressed);
+    if (off == 0 || off + 10 > len)
+      break;
+    type = buf[off] << 8 | buf[off + 1];
+    rdlength = buf[off + 8] << 8 | buf[off + 9];
+    off += 10;
+    if (off + rdlength > len)
+      break;
+    if (type == 1 && rdlength == 4) {
+      uint32_t addr = (uint32_t)buf[off] << 24 | buf[off + 1] << 16 |
+                      buf[off + 2] << 8 | buf[off + 3];
+      if (addr == bench_addr(q->foreign, q->n))
+        right++;
+      else if (addr == bench_addr(!q->foreign, q->n))
+        wrong++;
+      else
+        poisoned++;
+      return;
+    }
+    off += rdlength;
+  }
+  empty++;
+}
+
+static void receive(int sock, uint64_t now) {
+  unsigned char buf[BUF_SIZE];
+  int i;
+  for (i = 0; i < ROUNDS; i++) {
+    ssize_t len = recv(sock, buf, sizeof(buf), 0);
+    query_t *q;
+    if (len == -1)
+      return;
+    if (len < 12)
+      continue;
+    q = &queries[buf[0] << 8 | buf[1]];
+    // an answer after the first, or after the timeout
+    if (!q->used) {
+      late++;
+      continue;
+    }
+    q->used = 0;
+    answered++;
+    record_latency(now - q->sent_at);
+    judge(buf, len, q);
+  }
+}
+
+static void expire(uint64_t now, uint64_t timeout) {
+  while (order_len) {
+    query_t *q = &queries[order[order_head]];
+    if (q->used) {
+      if (now - q->sent_at < timeout)
+        return;
+      q->used = 0;
+      dropped++;
+    }
+    order_head = (order_head + 1) & 0xffff;
+    order_len--;
+  }
+}
+
+static void usage() {
+  printf("%s\n", "\
+usage: bench-load [-h] -s ADDR -p PORT [-t SECONDS] [-q QPS] [-w WINDOW]\n\
+       [-n NAMES] [-f FOREIGN] [-T TIMEOUT_MS] [-l LABEL] [-H]\n\
+Drive a DNS forwarder with c<n>.bench and f<n>.bench queries.\n\
+\n\
+  -s ADDR               forwarder address, default: 127.0.0.1\n\
+  -p PORT               forwarder port, default: 53\n\
+  -t SECONDS            how long to send, default: 5\n\
+  -q QPS                queries a second, 0 to keep the window full,\n\
+                        default: 0\n\
+  -w WINDOW             most queries waiting at once, default: 1000\n\
+  -n NAMES              distinct names of each kind, default: 1000000\n\
+  -f FOREIGN            percent of foreign names, default: 50\n\
+  -T TIMEOUT_MS         a query unanswered by then is dropped,\n\
+                        default: 2000\n\
+  -l LABEL              name of this run in the report\n\
+  -H                    print the report header first\n");
+}
+
+int main(int argc, char **argv) {
+  const char *addr = "127.0.0.1";
+  const char *port = "53";
+  const char *label = "-";
+  double seconds = 5, qps = 0, foreign_pct = 50;
+  int window = 1000, header = 0;
+  uint32_t names = 1000000;
+  uint64_t timeout = 2000;
+  struct addrinfo hints, *ai;
+  uint64_t started, stop_at, now;
+  unsigned char buf[BUF_SIZE];
+  int sock, ch, r;
+  double elapsed;
+
+  while ((ch = getopt(argc, argv, "hs:p:t:q:w:n:f:T:l:H")) != -1) {
+    switch (ch) {
+      case 'h':
+        usage();
+        exit(0);
+      case 's':
+        addr = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 't':
+        seconds = atof(optarg);
+        break;
+      case 'q':
+        qps = atof(optarg);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 'n':
+        names = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        foreign_pct = atof(optarg);
+        break;
+      case 'T':
+        timeout = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      case 'H':
+        header = 1;
+        break;
+      default:
+        usage();
+        exit(1);
+    }
+  }
+  if (window < 1 || window > MAX_WINDOW || names == 0) {
+    fprintf(stderr, "WINDOW must be 1 to %d, NAMES more than 0\n",
+            MAX_WINDOW);
+    return EXIT_FAILURE;
+  }
+  timeout *= 1000000;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (0 != (r = getaddrinfo(addr, port, &hints, &ai))) {
+    fprintf(stderr, "%s:%s: %s\n", addr, port, gai_strerror(r));
+    return EXIT_FAILURE;
+  }
+  sock = socket(ai->ai_family, SOCK_DGRAM, 0);
+  if (sock == -1 || 0 != connect(sock, ai->ai_addr, ai->ai_addrlen)) {
+    perror("connect");
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(ai);
+  r = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &r, sizeof(r));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &r, sizeof(r));
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  started = bench_now();
+  stop_at = started + (uint64_t)(seconds * 1e9);
+  while (1) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    struct timespec ts = {0, 1000000};
+    int i, outstanding, more = 0;
+    now = bench_now();
+    expire(now, timeout);
+    outstanding = sent - answered - dropped;
+    if (now >= stop_at && outstanding == 0)
+      break;
+    for (i = 0; now < stop_at && outstanding < window; i++) {
+      query_t *q;
+      size_t len;
+      if (qps > 0 && sent >= (now - started) / 1e9 * qps) {
+        // sleep until the next one is due
+        uint64_t due = started + (uint64_t)((sent + 1) / qps * 1e9);
+        if (due > now && due - now < 1000000)
+          ts.tv_nsec = due - now;
+        break;
+      }
+      if (i == ROUNDS) {
+        more = 1;
+        break;
+      }
+      // skip ids still waiting from long ago
+      while (queries[next_id].used)
+        next_id++;
+      q = &queries[next_id];
+      q->foreign = rng() % 10000 < foreign_pct * 100;
+      q->n = rng() % names;
+      len = build_query(buf, next_id, q->foreign, q->n);
+      if (-1 == send(sock, buf, len, 0)) {
+        if (errno != EAGAIN && errno != ECONNREFUSED)
+          perror("send");
+        break;
+      }
+      q->sent_at = now;
+      q->used = 1;
+      order[(order_head + order_len) & 0xffff] = next_id++;
+      order_len++;
+      sent++;
+      outstanding++;
+    }
+    if (more)
+      ts.tv_nsec = 0;
+    ppoll(&pfd, 1, &ts, NULL);
+    receive(sock, bench_now());
+  }
+  elapsed = (bench_now() - started) / 1e9;
+  if (elapsed > seconds)
+    elapsed = seconds;
+
+  qsort(latencies, latencies_len, sizeof(uint32_t), cmp_u32);
+  if (header)
+    printf("%-14s %9s %9s %7s %8s %8s %8s %8s %8s %8s\n", "mode", "qps",
+           "sent", "drop%", "p50ms", "p99ms", "p999ms", "right%",
+           "poison%", "wrong%");
+  printf("%-14s %9.0f %9lu %7.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+         label, answered / elapsed, sent,
+         sent ? 100.0 * dropped / sent : 0,
+         percentile(50), percentile(99), percentile(99.9),
+         answered ? 100.0 * right / answered : 0,
+         answered ? 100.0 * poisoned / answered : 0,
+         answered ? 100.0 * (wrong + empty) / answered : 0);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,481 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
+
+#include "bench.h"
+#include "domains.h"
+#include "filter.h"
+#include "local_ns_parser.h"
+#include "routes.h"
+
+/* times what is done for every query and answer, in isolation: chnroute
+   lookups, the ip list search, parsing, the filter verdict and domain
+   list matching, each over a synthetic corpus */
+
+// both corpora are cycled through, so they are sized to outgrow the
+// caches a little, and are powers of two
+#define ADDRS (1 << 18)
+#define PACKETS (1 << 14)
+#define PACKET_SIZE 512
+#define MAX_ANSWERS 20
+#define MAX_CNAMES 3
+// how many of the skewed addresses are Chinese, in percent
+#define SKEW 80
+// answers are more work than an address, so fewer are timed
+#define PACKET_OPS_DIVISOR 20
+// as large as the lists of Chinese domains people use, and names to match
+// against it, half of them under a listed domain
+#define DOMAINS (1 << 17)
+#define NAMES (1 << 16)
+#define NAME_SIZE 64
+
+enum { CTR_CYCLES, CTR_INSNS, CTR_MISSES, CTR_MAX };
+
+typedef struct {
+  unsigned char buf[PACKET_SIZE];
+  int len;
+} packet_t;
+
+typedef struct {
+  const char *name;
+  void (*run)(long ops);
+  int packets;
+} kernel_t;
+
+int verbose = 0;
+
+static routes_t *routes;
+static uint32_t rand_state = 2463534242u;
+
+static struct in_addr *random_addrs;
+static struct in_addr *skewed_addrs;
+// half of these are on the ip list
+static struct in_addr *listed_addrs;
+static packet_t *packets;
+static local_ns_msg msg;
+static domains_t domains;
+static unsigned char (*names)[NAME_SIZE];
+
+// results land here so the loops can't be optimized away
+static volatile unsigned long sink;
+
+// group leader first, -1 when counters are unavailable
+static int perf_fds[CTR_MAX] = {-1, -1, -1};
+
+static void usage();
+static uint32_t rnd();
+static struct in_addr skewed_addr();
+static void put_name(packet_t *p, const char *name, int ptr);
+static void put_rr(packet_t *p, int owner, uint16_t type, uint16_t rdlength);
+static void make_packet(packet_t *p);
+static int make_corpora();
+static void perf_open();
+static int perf_read(uint64_t *values);
+static void measure(const kernel_t *k, long ops);
+
+static void run_chnroute_random(long ops);
+static void run_chnroute_skewed(long ops);
+static void run_ip_list(long ops);
+static void run_parse(long ops);
+static void run_filter(long ops, int kind);
+static void run_filter_chn(long ops);
+static void run_filter_foreign(long ops);
+static void run_domains(long ops);
+
+static const kernel_t kernels[] = {
+  {"chnroute random", run_chnroute_random, 0},
+  {"chnroute skewed", run_chnroute_skewed, 0},
+  {"ip list bsearch", run_ip_list, 0},
+  {"parse", run_parse, 1},
+  {"parse+filter chn", run_filter_chn, 1},
+  {"parse+filter foreign", run_filter_foreign, 1},
+  {"domain list match", run_domains, 0},
+};
+
+int main(int argc, char **argv) {
+  const char *chnroute_file = "chnroute.txt";
+  const char *ip_list_file = "iplist.txt";
+  long ops = 10000000;
+  size_t i;
+  int ch;
+  while ((ch = getopt(argc, argv, "hc:l:n:s:")) != -1) {
+    switch (ch) {
+      case 'c':
+        chnroute_file = optarg;
+        break;
+      case 'l':
+        ip_list_file = optarg;
+        break;
+      case 'n':
+        ops = atol(optarg);
+        break;
+      case 's':
+        rand_state = strtoul(optarg, NULL, 10) | 1;
+        break;
+      case 'h':
+        usage();
+        return 0;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (ops <= 0) {
+    usage();
+    return 1;
+  }
+  routes = routes_load(chnroute_file, ip_list_file, NULL, NULL);
+  if (routes == NULL)
+    return 1;
+  if (routes->chnroute.ranges == NULL)
+    fprintf(stderr, "%s is an image, skewed addresses are uniform\n",
+            chnroute_file);
+  if (0 != make_corpora()) {
+    perror("malloc");
+    return 1;
+  }
+  perf_open();
+
+  printf("%d chnroute networks, %d ips, %d addresses, %d answers, "
+         "%d domains\n", routes->chnroute.entries, routes->ip_list.entries,
+         ADDRS, PACKETS, domains.entries);
+  printf("%-22s %10s %8s %10s %10s %10s\n", "kernel", "ops", "ns/op",
+         "cycles/op", "insns/op", "misses/op");
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    long n = kernels[i].packets ? ops / PACKET_OPS_DIVISOR : ops;
+    if (n == 0)
+      n = 1;
+    // a lap to warm up the caches and the branch predictor
+    kernels[i].run(kernels[i].packets ? PACKETS : ADDRS);
+    measure(&kernels[i], n);
+  }
+  routes_free(routes);
+  domains_free(&domains);
+  return 0;
+}
+
+static void usage() {
+  printf("%s\n", "\
+usage: bench-micro [-h] [-c CHNROUTE_FILE] [-l IPLIST_FILE] [-n OPS]\n\
+                   [-s SEED]\n\
+Times chnroute lookups, the ip list search, parsing, filtering and\n\
+domain list matching.\n\
+\n\
+  -c CHNROUTE_FILE      path to china route file or image,\n\
+                        default: chnroute.txt\n\
+  -l IPLIST_FILE        path to ip blacklist file or image,\n\
+                        default: iplist.txt\n\
+  -n OPS                lookups per kernel, answers are a twentieth,\n\
+                        default: 10000000\n\
+  -s SEED               seed for the corpora\n\
+\n\
+Cycles, instructions and cache misses are read with perf_event_open(2)\n\
+where the kernel allows it.\n");
+}
+
+// xorshift32, for corpora that are the same on every run
+static uint32_t rnd() {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+// Chinese addresses are drawn evenly from the networks, not the address
+// space, so small networks are as likely as large ones
+static struct in_addr skewed_addr() {
+  const lpm_t *chnroute = &routes->chnroute;
+  struct in_addr addr;
+  uint32_t ip = rnd();
+  if (chnroute->ranges && chnroute->entries && rnd() % 100 < SKEW) {
+    const lpm_range_t *range = &chnroute->ranges[rnd() % chnroute->entries];
+    uint32_t size = range->end - range->start + 1;
+    ip = range->start + (size ? ip % size : ip);
+  }
+  addr.s_addr = htonl(ip);
+  return addr;
+}
+
+// a dotted name, ending in a pointer to ptr, or in the root if 0
+static void put_name(packet_t *p, const char *name, int ptr) {
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    size_t len = dot ? (size_t)(dot - name) : strlen(name);
+    p->buf[p->len++] = len;
+    memcpy(p->buf + p->len, name, len);
+    p->len += len;
+    name += len + (dot != NULL);
+  }
+  if (ptr) {
+    p->buf[p->len++] = 0xc0 | (ptr >> 8);
+    p->buf[p->len++] = ptr & 0xff;
+  } else {
+    p->buf[p->len++] = 0;
+  }
+}
+
+// everything but the rdata, with the owner compressed to owner
+static void put_rr(packet_t *p, int owner, uint16_t type, uint16_t rdlength) {
+  unsigned char *rr = p->buf + p->len;
+  rr[0] = 0xc0 | (owner >> 8);
+  rr[1] = owner & 0xff;
+  rr[2] = type >> 8;
+  rr[3] = type & 0xff;
+  rr[4] = 0;
+  rr[5] = ns_c_in;
+  // a TTL of 300
+  rr[6] = 0;
+  rr[7] = 0;
+  rr[8] = 300 >> 8;
+  rr[9] = 300 & 0xff;
+  rr[10] = rdlength >> 8;
+  rr[11] = rdlength & 0xff;
+  p->len += 12;
+}
+
+// an answer as a CDN would give it: a chain of up to MAX_CNAMES, each
+// target compressed against the question, and 1 to MAX_ANSWERS A records
+// for the last name
+static void make_packet(packet_t *p) {
+  int cnames = rnd() % (MAX_CNAMES + 1);
+  int answers = 1 + rnd() % MAX_ANSWERS;
+  int owner = NS_HFIXEDSZ;
+  char label[32];
+  uint16_t id = rnd();
+  int i;
+  memset(p->buf, 0, NS_HFIXEDSZ);
+  p->buf[0] = id >> 8;
+  p->buf[1] = id & 0xff;
+  p->buf[2] = 0x81;
+  p->buf[3] = 0x80;
+  p->buf[5] = 1;
+  p->buf[7] = cnames + answers;
+  p->len = NS_HFIXEDSZ;
+  snprintf(label, sizeof(label), "www.d%u.com", rnd() % 100000);
+  put_name(p, label, 0);
+  p->buf[p->len++] = 0;
+  p->buf[p->len++] = ns_t_a;
+  p->buf[p->len++] = 0;
+  p->buf[p->len++] = ns_c_in;
+  for (i = 0; i < cnames; i++) {
+    int start;
+    snprintf(label, sizeof(label), "e%u", rnd() % 10000);
+    put_rr(p, owner, ns_t_cname, strlen(label) + 3);
+    start = p->len;
+    put_name(p, label, NS_HFIXEDSZ);
+    owner = start;
+  }
+  for (i = 0; i < answers; i++) {
+    struct in_addr addr = skewed_addr();
+    put_rr(p, owner, ns_t_a, sizeof(addr));
+    memcpy(p->buf + p->len, &addr, sizeof(addr));
+    p->len += sizeof(addr);
+  }
+}
+
+static int make_corpora() {
+  char name[NAME_SIZE];
+  packet_t p;
+  int i;
+  random_addrs = calloc(ADDRS, sizeof(struct in_addr));
+  skewed_addrs = calloc(ADDRS, sizeof(struct in_addr));
+  listed_addrs = calloc(ADDRS, sizeof(struct in_addr));
+  packets = calloc(PACKETS, sizeof(packet_t));
+  names = calloc(NAMES, NAME_SIZE);
+  if (!random_addrs || !skewed_addrs || !listed_addrs || !packets || !names)
+    return -1;
+  for (i = 0; i < ADDRS; i++) {
+    random_addrs[i].s_addr = rnd();
+    skewed_addrs[i] = skewed_addr();
+    if (routes->ip_list.entries && (rnd() & 1))
+      listed_addrs[i] = routes->ip_list.ips[rnd() % routes->ip_list.entries];
+    else
+      listed_addrs[i].s_addr = rnd();
+  }
+  for (i = 0; i < PACKETS; i++)
+    make_packet(&packets[i]);
+  domains_init(&domains);
+  for (i = 0; i < DOMAINS; i++) {
+    snprintf(name, sizeof(name), "d%d.cn", i);
+    if (0 != domains_add(&domains, name, DOMAINS_CHN + (i & 1)))
+      return -1;
+  }
+  if (0 != domains_build(&domains))
+    return -1;
+  for (i = 0; i < NAMES; i++) {
+    if (rnd() & 1)
+      snprintf(name, sizeof(name), "www.d%u.cn", rnd() % DOMAINS);
+    else
+      snprintf(name, sizeof(name), "img%u.cdn.e%u.com", rnd() % 10,
+               rnd() % DOMAINS);
+    p.len = 0;
+    put_name(&p, name, 0);
+    memcpy(names[i], p.buf, p.len);
+  }
+  return 0;
+}
+
+static void perf_open() {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  static const uint64_t configs[CTR_MAX] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;
+  int i;
+  for (i = 0; i < CTR_MAX; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    // the group is started and stopped through its leader
+    attr.disabled = i == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    perf_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, perf_fds[0], 0);
+    if (perf_fds[i] == -1) {
+      fprintf(stderr, "perf counters unavailable: %s\n", strerror(errno));
+      while (i-- > 0) {
+        close(perf_fds[i]);
+        perf_fds[i] = -1;
+      }
+      return;
+    }
+  }
+#else
+  fprintf(stderr, "perf counters unavailable: not built for Linux\n");
+#endif
+}
+
+static int perf_read(uint64_t *values) {
+  uint64_t buf[1 + CTR_MAX];
+  if (perf_fds[0] == -1)
+    return -1;
+  if (read(perf_fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+      buf[0] != CTR_MAX)
+    return -1;
+  memcpy(values, buf + 1, sizeof(uint64_t) * CTR_MAX);
+  return 0;
+}
+
+static void measure(const kernel_t *k, long ops) {
+  uint64_t values[CTR_MAX];
+  uint64_t start, elapsed;
+  int counted;
+  int i;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (perf_fds[0] != -1) {
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+  start = bench_now();
+  k->run(ops);
+  elapsed = bench_now() - start;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (perf_fds[0] != -1)
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  counted = perf_read(values) == 0;
+  printf("%-22s %10ld %8.2f", k->name, ops, (double)elapsed / ops);
+  for (i = 0; i < CTR_MAX; i++) {
+    if (counted)
+      printf(" %10.2f", (double)values[i] / ops);
+    else
+      printf(" %10s", "n/a");
+  }
+  printf("\n");
+}
+
+static void run_chnroute_random(long ops) {
+  unsigned long hits = 0;
+  long i;
+  for (i = 0; i < ops; i++)
+    hits += test_ip_in_list(random_addrs[i & (ADDRS - 1)], &routes->chnroute);
+  sink += hits;
+}
+
+static void run_chnroute_skewed(long ops) {
+  unsigned long hits = 0;
+  long i;
+  for (i = 0; i < ops; i++)
+    hits += test_ip_in_list(skewed_addrs[i & (ADDRS - 1)], &routes->chnroute);
+  sink += hits;
+}
+
+static void run_ip_list(long ops) {
+  unsigned long hits = 0;
+  long i;
+  for (i = 0; i < ops; i++)
+    hits += NULL != bsearch(&listed_addrs[i & (ADDRS - 1)], routes->ip_list.ips,
+                            routes->ip_list.entries, sizeof(struct in_addr),
+                            cmp_in_addr);
+  sink += hits;
+}
+
+static void run_parse(long ops) {
+  unsigned long rrs = 0;
+  long i;
+  for (i = 0; i < ops; i++) {
+    const packet_t *p = &packets[i & (PACKETS - 1)];
+    if (0 == local_ns_parse(p->buf, p->len, &msg))
+      rrs += msg.counts[ns_s_an];
+  }
+  sink += rrs;
+}
+
+static void run_filter(long ops, int kind) {
+  unsigned long dropped = 0;
+  long i;
+  for (i = 0; i < ops; i++) {
+    const packet_t *p = &packets[i & (PACKETS - 1)];
+    if (0 == local_ns_parse(p->buf, p->len, &msg))
+      dropped += filter_answer(routes, &msg, kind, 0, NULL) != 0;
+  }
+  sink += dropped;
+}
+
+static void run_filter_chn(long ops) {
+  run_filter(ops, FILTER_CHN);
+}
+
+static void run_filter_foreign(long ops) {
+  run_filter(ops, FILTER_FOREIGN);
+}
+
+static void run_domains(long ops) {
+  long i;
+  for (i = 0; i < ops; i++)
+    sink += domains_lookup(&domains, names[i & (NAMES - 1)]);
+}
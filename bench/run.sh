@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# runs ChinaDNS between two local stub upstreams in each filtering mode,
+# and reports what the load generator saw. everything can be overridden
+# from the environment, e.g. POISON=50 make bench
+
+CHINADNS=${CHINADNS:-../src/chinadns}
+BENCH_STUB=${BENCH_STUB:-./bench-stub}
+BENCH_LOAD=${BENCH_LOAD:-./bench-load}
+IPLIST=${IPLIST:-../iplist.txt}
+
+BENCH_SECONDS=${BENCH_SECONDS:-5}
+# 0 keeps BENCH_WINDOW queries waiting instead
+BENCH_QPS=${BENCH_QPS:-5000}
+BENCH_WINDOW=${BENCH_WINDOW:-1000}
+BENCH_FOREIGN=${BENCH_FOREIGN:-50}
+BENCH_PORT=${BENCH_PORT:-15353}
+STUB_PORT=${STUB_PORT:-25353}
+# milliseconds
+CHN_DELAY=${CHN_DELAY:-5}
+FOREIGN_DELAY=${FOREIGN_DELAY:-40}
+JITTER=${JITTER:-5}
+# percent
+LOSS=${LOSS:-0}
+POISON=${POISON:-20}
+RECORDS=${RECORDS:-2}
+# more options for every run, such as -C 1024 to measure with the cache
+CHINADNS_ARGS=${CHINADNS_ARGS:--C 0}
+
+chnroute=$(mktemp)
+trap 'kill $pids 2>/dev/null; rm -f $chnroute' EXIT
+# the chn stub must be in chnroute to count as a Chinese DNS
+printf '10.0.0.0/8\n127.0.0.1/32\n' > $chnroute
+
+$BENCH_STUB -b 127.0.0.1 -p $STUB_PORT -k chn -d $CHN_DELAY -j $JITTER \
+    -L $LOSS -P $POISON -l $IPLIST -n $RECORDS &
+pids="$!"
+$BENCH_STUB -b 127.0.0.2 -p $STUB_PORT -k foreign -d $FOREIGN_DELAY \
+    -j $JITTER -L $LOSS -P $POISON -l $IPLIST -n $RECORDS &
+pids="$pids $!"
+
+echo "chn DNS ${CHN_DELAY}ms, foreign DNS ${FOREIGN_DELAY}ms, jitter" \
+     "${JITTER}ms, loss ${LOSS}%, poison ${POISON}%, ${BENCH_FOREIGN}%" \
+     "foreign names"
+header=-H
+run_mode() {
+    local label="$1"
+    shift
+    $CHINADNS -p $BENCH_PORT -b 127.0.0.1 \
+        -s 127.0.0.1:$STUB_PORT,127.0.0.2:$STUB_PORT $CHINADNS_ARGS "$@" \
+        > /dev/null 2>&1 &
+    local pid=$!
+    sleep 0.5
+    $BENCH_LOAD -s 127.0.0.1 -p $BENCH_PORT -t $BENCH_SECONDS -q $BENCH_QPS \
+        -w $BENCH_WINDOW -f $BENCH_FOREIGN -l "$label" $header
+    header=
+    kill $pid
+    wait $pid 2>/dev/null || true
+}
+
+run_mode "-c" -c $chnroute
+run_mode "-c -l" -c $chnroute -l $IPLIST
+run_mode "-d -c -l" -d -c $chnroute -l $IPLIST
+run_mode "-m -c" -m -c $chnroute
@@ -0,0 +1,665 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "bench.h"
+
+/* a stub resolver that plays either the Chinese or the foreign upstream,
+   with latency, loss and poisoned answers like the real ones see, and
+   optionally a DNS over TLS one with a certificate of its own */
+
+#define BUF_SIZE 512
+// answers waiting for their latency to pass
+#define MAX_DELAYED 65536
+#define MAX_POISON 4096
+// datagrams read before sending what's due
+#define RECV_ROUNDS 64
+// TLS clients served at once
+#define MAX_TLS_CONNS 64
+// a query and its length prefix
+#define TLS_IN_SIZE (2 + BUF_SIZE)
+
+typedef struct {
+  uint64_t due;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  size_t len;
+  unsigned char buf[BUF_SIZE];
+} delayed_t;
+
+static int foreign = 0;
+static double delay_ms = 0;
+static double jitter_ms = 0;
+static double loss = 0;
+static double poison = 0;
+static int records = 2;
+
+static uint32_t poison_addrs[MAX_POISON];
+static int poison_len = 0;
+
+// a min-heap on due, and the free entries
+static delayed_t *delayed;
+static delayed_t **heap;
+static int heap_len = 0;
+static delayed_t **free_list;
+static int free_len = 0;
+
+static unsigned long received, answered, lost, poisoned, overflowed;
+static volatile sig_atomic_t stopping = 0;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+#ifdef HAVE_TLS
+typedef struct {
+  int fd;
+  SSL *ssl;
+  int handshaken;
+  unsigned char in[TLS_IN_SIZE];
+  size_t in_len;
+  unsigned long answered;
+} tls_conn_t;
+
+// NULL unless answering over TLS too
+static const char *tls_name = NULL;
+static const char *ca_file = NULL;
+// 0 keeps connections open
+static unsigned long close_after = 0;
+static SSL_CTX *tls_ctx;
+static tls_conn_t tls_conns[MAX_TLS_CONNS];
+static unsigned long handshakes, resumed;
+#endif
+
+static double rng_percent() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (rng_state >> 11) * (100.0 / 9007199254740992.0);
+}
+
+static void heap_push(delayed_t *d) {
+  int i = heap_len++;
+  while (i > 0 && heap[(i - 1) / 2]->due > d->due) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = d;
+}
+
+static delayed_t *heap_pop() {
+  delayed_t *top = heap[0];
+  delayed_t *last = heap[--heap_len];
+  int i = 0;
+  while (1) {
+    int c = i * 2 + 1;
+    if (c >= heap_len)
+      break;
+    if (c + 1 < heap_len && heap[c + 1]->due < heap[c]->due)
+      c++;
+    if (heap[c]->due >= last->due)
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  if (heap_len)
+    heap[i] = last;
+  return top;
+}
+
+static int load_poison(const char *path) {
+  char line[64];
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (poison_len < MAX_POISON && fgets(line, sizeof(line), fp)) {
+    struct in_addr addr;
+    uint32_t a;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!inet_aton(line, &addr))
+      continue;
+    a = ntohl(addr.s_addr);
+    // nothing that could pass for a right answer, or for loopback
+    if ((a >> 24) == 127 || (a & 0xff000000) == BENCH_CHN_NET ||
+        (a & 0xff000000) == BENCH_FOREIGN_NET)
+      continue;
+    poison_addrs[poison_len++] = a;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// the header and question of the query, then an A record for each addr
+static size_t build_answer(const unsigned char *query, size_t qend,
+                           unsigned char *out, uint32_t first, int n,
+                           int step) {
+  size_t off = qend;
+  int i;
+  memcpy(out, query, qend);
+  out[2] = 0x81 | (query[2] & 0x01);
+  out[3] = 0x80;
+  // the question only, whatever else the query had
+  memcpy(out + 4, "\0\1\0\0\0\0\0\0", 8);
+  out[7] = n;
+  for (i = 0; i < n; i++) {
+    uint32_t addr = htonl(first + i * step);
+    // the name is the question's, TTL 300
+    memcpy(out + off, "\xc0\x0c\0\1\0\1\0\0\1\x2c\0\4", 12);
+    memcpy(out + off + 12, &addr, 4);
+    off += 16;
+  }
+  return off;
+}
+
+static void queue_answer(const unsigned char *buf, size_t len,
+                         struct sockaddr *addr, socklen_t addrlen,
+                         double after_ms, int sock) {
+  delayed_t *d;
+  if (after_ms <= 0) {
+    sendto(sock, buf, len, 0, addr, addrlen);
+    return;
+  }
+  if (free_len == 0) {
+    overflowed++;
+    return;
+  }
+  d = free_list[--free_len];
+  d->due = bench_now() + (uint64_t)(after_ms * 1000000);
+  memcpy(&d->addr, addr, addrlen);
+  d->addrlen = addrlen;
+  memcpy(d->buf, buf, len);
+  d->len = len;
+  heap_push(d);
+}
+
+// the end of the question of a c<n> or f<n> query with room for its
+// answer, and what it asks for; 0 if it's anything else
+static size_t parse_query(const unsigned char *query, size_t len,
+                          int *compressed, int *foreign_name, uint32_t *n) {
+  size_t qend;
+  char *end;
+  char label[64];
+  if (len < 12 || query[12] == 0 || query[12] >= sizeof(label))
+    return 0;
+  qend = bench_skip_name(query, len, 12, compressed);
+  if (qend == 0 || qend + 4 > len ||
+      qend + 4 + records * 16 > BUF_SIZE)
+    return 0;
+  memcpy(label, query + 13, query[12]);
+  label[query[12]] = 0;
+  if (label[0] != 'c' && label[0] != 'f')
+    return 0;
+  *foreign_name = label[0] == 'f';
+  *n = strtoul(label + 1, &end, 10);
+  return qend + 4;
+}
+
+static void handle_query(int sock, const unsigned char *query, size_t len,
+                         struct sockaddr *addr, socklen_t addrlen) {
+  unsigned char out[BUF_SIZE];
+  size_t qend, out_len;
+  int compressed, foreign_name;
+  uint32_t n;
+  double after = delay_ms;
+
+  received++;
+  if (0 == (qend = parse_query(query, len, &compressed, &foreign_name, &n)))
+    return;
+  if (jitter_ms > 0)
+    after += (rng_percent() / 50 - 1) * jitter_ms;
+
+  if (foreign_name && poison_len && rng_percent() < poison) {
+    uint32_t fake = poison_addrs[(uint32_t)(rng_percent() * poison_len / 100) %
+                                 poison_len];
+    if (foreign) {
+      // injected on the way, which only works if the name can be read,
+      // and always wins the race
+      if (!compressed) {
+        out_len = build_answer(query, qend, out, fake, 1, 0);
+        sendto(sock, out, out_len, 0, addr, addrlen);
+        poisoned++;
+      }
+    } else {
+      // the resolver itself was poisoned, and answers as usual
+      if (rng_percent() < loss) {
+        lost++;
+        return;
+      }
+      out_len = build_answer(query, qend, out, fake, 1, 0);
+      queue_answer(out, out_len, addr, addrlen, after, sock);
+      poisoned++;
+      return;
+    }
+  }
+  if (rng_percent() < loss) {
+    lost++;
+    return;
+  }
+  // a Chinese domain resolves into China from a Chinese resolver only,
+  // while a foreign one resolves abroad from both
+  out_len = build_answer(query, qend, out,
+                         bench_addr(foreign || foreign_name, n), records, 1);
+  queue_answer(out, out_len, addr, addrlen, after, sock);
+  answered++;
+}
+
+#ifdef HAVE_TLS
+// a key and a certificate for tls_name signed by itself, which is written
+// to ca_file for clients to trust
+static int tls_init() {
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  EVP_PKEY *key = NULL;
+  X509 *cert = X509_new();
+  X509_NAME *subject;
+  X509_EXTENSION *san;
+  X509V3_CTX v3;
+  struct in6_addr ip;
+  char alt_name[300];
+  FILE *fp;
+  int ok = pctx && cert && EVP_PKEY_keygen_init(pctx) == 1 &&
+           EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+               pctx, NID_X9_62_prime256v1) == 1 &&
+           EVP_PKEY_keygen(pctx, &key) == 1;
+  if (ok) {
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    subject = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+                               (const unsigned char *)tls_name, -1, -1, 0);
+    X509_set_issuer_name(cert, subject);
+    // clients check the name against the subject alternative names only
+    snprintf(alt_name, sizeof(alt_name), "%s:%s",
+             1 == inet_pton(AF_INET, tls_name, &ip) ||
+             1 == inet_pton(AF_INET6, tls_name, &ip) ? "IP" : "DNS",
+             tls_name);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    san = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, alt_name);
+    ok = san && X509_add_ext(cert, san, -1) == 1 &&
+         X509_sign(cert, key, EVP_sha256()) > 0;
+    X509_EXTENSION_free(san);
+  }
+  if (ok && ca_file) {
+    ok = NULL != (fp = fopen(ca_file, "w")) && PEM_write_X509(fp, cert) == 1;
+    if (fp)
+      ok = 0 == fclose(fp) && ok;
+  }
+  // sessions are resumed from the tickets the context hands out
+  ok = ok && NULL != (tls_ctx = SSL_CTX_new(TLS_server_method())) &&
+       SSL_CTX_use_certificate(tls_ctx, cert) == 1 &&
+       SSL_CTX_use_PrivateKey(tls_ctx, key) == 1;
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(pctx);
+  if (!ok)
+    ERR_print_errors_fp(stderr);
+  return ok ? 0 : -1;
+}
+
+static void tls_accept(int listen_sock) {
+  int sock, i;
+  while (-1 != (sock = accept(listen_sock, NULL, NULL))) {
+    tls_conn_t *conn = NULL;
+    for (i = 0; i < MAX_TLS_CONNS && conn == NULL; i++) {
+      if (tls_conns[i].fd == -1)
+        conn = &tls_conns[i];
+    }
+    if (conn == NULL ||
+        NULL == (conn->ssl = SSL_new(tls_ctx)) ||
+        1 != SSL_set_fd(conn->ssl, sock)) {
+      if (conn)
+        SSL_free(conn->ssl);
+      close(sock);
+      continue;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    SSL_set_accept_state(conn->ssl);
+    conn->fd = sock;
+    conn->handshaken = 0;
+    conn->in_len = 0;
+    conn->answered = 0;
+  }
+}
+
+static void tls_close(tls_conn_t *conn) {
+  SSL_shutdown(conn->ssl);
+  SSL_free(conn->ssl);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->ssl = NULL;
+}
+
+// answers are small, so waiting for the socket to take one is brief
+static int tls_write(tls_conn_t *conn, const unsigned char *buf, size_t len) {
+  while (len) {
+    struct pollfd pfd = {conn->fd, POLLOUT, 0};
+    int r = SSL_write(conn->ssl, buf, len);
+    if (r > 0) {
+      buf += r;
+      len -= r;
+      continue;
+    }
+    r = SSL_get_error(conn->ssl, r);
+    if (r == SSL_ERROR_WANT_READ)
+      pfd.events = POLLIN;
+    else if (r != SSL_ERROR_WANT_WRITE)
+      return -1;
+    poll(&pfd, 1, 1000);
+  }
+  return 0;
+}
+
+// nothing on the way can read these, so they are never poisoned or lost,
+// and they go out right away. -1 once the connection is done with
+static int tls_serve(tls_conn_t *conn) {
+  unsigned char out[2 + BUF_SIZE];
+  int compressed, foreign_name, r;
+  uint32_t n;
+  if (!conn->handshaken) {
+    if (1 != (r = SSL_do_handshake(conn->ssl)))
+      return SSL_get_error(conn->ssl, r) == SSL_ERROR_WANT_READ ? 0 : -1;
+    conn->handshaken = 1;
+    handshakes++;
+    if (SSL_session_reused(conn->ssl))
+      resumed++;
+  }
+  while (0 < (r = SSL_read(conn->ssl, conn->in + conn->in_len,
+                           TLS_IN_SIZE - conn->in_len))) {
+    size_t off = 0;
+    conn->in_len += r;
+    while (conn->in_len - off >= 2) {
+      size_t len = conn->in[off] << 8 | conn->in[off + 1];
+      size_t qend, out_len;
+      if (len > BUF_SIZE)
+        return -1;
+      if (conn->in_len - off < 2 + len)
+        break;
+      received++;
+      qend = parse_query(conn->in + off + 2, len, &compressed,
+                         &foreign_name, &n);
+      off += 2 + len;
+      if (qend == 0)
+        continue;
+      out_len = build_answer(conn->in + off - len, qend, out + 2,
+                             bench_addr(foreign || foreign_name, n), records,
+                             1);
+      out[0] = out_len >> 8;
+      out[1] = out_len & 0xff;
+      if (0 != tls_write(conn, out, 2 + out_len))
+        return -1;
+      answered++;
+      if (close_after && ++conn->answered >= close_after)
+        return -1;
+    }
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+  }
+  return SSL_get_error(conn->ssl, r) == SSL_ERROR_WANT_READ ? 0 : -1;
+}
+#endif
+
+static void stop(int signum) {
+  stopping = 1;
+}
+
+static void usage() {
+  printf("%s\n", "\
+usage: bench-stub [-h] [-b BIND_ADDR] [-p BIND_PORT] [-k chn|foreign]\n\
+       [-d DELAY_MS] [-j JITTER_MS] [-L LOSS] [-P POISON] [-l POISON_FILE]\n\
+       [-n RECORDS] [-T TLS_NAME] [-A CA_FILE] [-C QUERIES]\n\
+Answer c<n>.bench and f<n>.bench like a Chinese or foreign DNS would.\n\
+\n\
+  -b BIND_ADDR          address that listens, default: 127.0.0.1\n\
+  -p BIND_PORT          port that listens, default: 5353\n\
+  -k chn|foreign        which upstream to play, default: chn\n\
+  -d DELAY_MS           latency of every answer, default: 0\n\
+  -j JITTER_MS          latency varies by up to this much either way\n\
+  -L LOSS               percent of queries never answered\n\
+  -P POISON             percent of foreign names poisoned; a Chinese DNS\n\
+                        answers with a poisoned address, a foreign one\n\
+                        gets one injected right away, unless the name is\n\
+                        compressed, and answers as well\n\
+  -l POISON_FILE        poisoned addresses to use, such as iplist.txt\n\
+  -n RECORDS            A records in an answer, default: 2\n\
+  -T TLS_NAME           answer DNS over TLS on the same port too, with a\n\
+                        certificate for TLS_NAME signed by itself; such\n\
+                        answers are never delayed, lost or poisoned\n\
+  -A CA_FILE            write the certificate there, for clients to\n\
+                        trust\n\
+  -C QUERIES            close a TLS connection after answering this\n\
+                        many queries on it, default: never\n");
+}
+
+int main(int argc, char **argv) {
+  const char *bind_addr = "127.0.0.1";
+  const char *bind_port = "5353";
+  struct addrinfo hints, *ai;
+  struct sigaction sa;
+  unsigned char buf[BUF_SIZE];
+  struct pollfd pfds[2 + MAX_TLS_CONNS];
+  int sock, ch, i, r;
+  int listen_sock = -1;
+
+  while ((ch = getopt(argc, argv, "hb:p:k:d:j:L:P:l:n:T:A:C:")) != -1) {
+    switch (ch) {
+      case 'h':
+        usage();
+        exit(0);
+      case 'b':
+        bind_addr = optarg;
+        break;
+      case 'p':
+        bind_port = optarg;
+        break;
+      case 'k':
+        foreign = 0 == strcmp(optarg, "foreign");
+        break;
+      case 'd':
+        delay_ms = atof(optarg);
+        break;
+      case 'j':
+        jitter_ms = atof(optarg);
+        break;
+      case 'L':
+        loss = atof(optarg);
+        break;
+      case 'P':
+        poison = atof(optarg);
+        break;
+      case 'l':
+        if (0 != load_poison(optarg))
+          return EXIT_FAILURE;
+        break;
+      case 'n':
+        records = atoi(optarg);
+        break;
+#ifdef HAVE_TLS
+      case 'T':
+        tls_name = optarg;
+        break;
+      case 'A':
+        ca_file = optarg;
+        break;
+      case 'C':
+        close_after = strtoul(optarg, NULL, 10);
+        break;
+#else
+      case 'T':
+      case 'A':
+      case 'C':
+        fprintf(stderr, "built without TLS support\n");
+        return EXIT_FAILURE;
+#endif
+      default:
+        usage();
+        exit(1);
+    }
+  }
+  if (records < 1 || records > 16) {
+    fprintf(stderr, "RECORDS must be 1 to 16\n");
+    return EXIT_FAILURE;
+  }
+  if (poison_len == 0) {
+    // a well known one
+    poison_addrs[0] = 0xf3b9bb27;
+    poison_len = 1;
+  }
+
+  delayed = calloc(MAX_DELAYED, sizeof(delayed_t));
+  heap = calloc(MAX_DELAYED, sizeof(delayed_t *));
+  free_list = calloc(MAX_DELAYED, sizeof(delayed_t *));
+  if (!delayed || !heap || !free_list) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < MAX_DELAYED; i++)
+    free_list[free_len++] = &delayed[i];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (0 != (r = getaddrinfo(bind_addr, bind_port, &hints, &ai))) {
+    fprintf(stderr, "%s:%s: %s\n", bind_addr, bind_port, gai_strerror(r));
+    return EXIT_FAILURE;
+  }
+  sock = socket(ai->ai_family, SOCK_DGRAM, 0);
+  if (sock == -1 || 0 != bind(sock, ai->ai_addr, ai->ai_addrlen)) {
+    perror("bind");
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo(ai);
+  i = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &i, sizeof(i));
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  pfds[0].fd = sock;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = -1;
+#ifdef HAVE_TLS
+  for (i = 0; i < MAX_TLS_CONNS; i++)
+    tls_conns[i].fd = -1;
+  if (tls_name) {
+    i = 1;
+    if (0 != tls_init())
+      return EXIT_FAILURE;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != (r = getaddrinfo(bind_addr, bind_port, &hints, &ai))) {
+      fprintf(stderr, "%s:%s: %s\n", bind_addr, bind_port, gai_strerror(r));
+      return EXIT_FAILURE;
+    }
+    listen_sock = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (listen_sock == -1 ||
+        0 != setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &i,
+                        sizeof(i)) ||
+        0 != bind(listen_sock, ai->ai_addr, ai->ai_addrlen) ||
+        0 != listen(listen_sock, SOMAXCONN)) {
+      perror("bind");
+      return EXIT_FAILURE;
+    }
+    freeaddrinfo(ai);
+    fcntl(listen_sock, F_SETFL,
+          fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
+    pfds[1].fd = listen_sock;
+    pfds[1].events = POLLIN;
+  }
+#endif
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  while (!stopping) {
+    struct timespec ts, *timeout = NULL;
+    uint64_t now = bench_now();
+    while (heap_len && heap[0]->due <= now) {
+      delayed_t *d = heap_pop();
+      sendto(sock, d->buf, d->len, 0, (struct sockaddr *)&d->addr,
+             d->addrlen);
+      free_list[free_len++] = d;
+    }
+    if (heap_len) {
+      uint64_t wait = heap[0]->due - now;
+      ts.tv_sec = wait / 1000000000;
+      ts.tv_nsec = wait % 1000000000;
+      timeout = &ts;
+    }
+#ifdef HAVE_TLS
+    for (i = 0; i < MAX_TLS_CONNS; i++) {
+      pfds[2 + i].fd = tls_conns[i].fd;
+      pfds[2 + i].events = POLLIN;
+      pfds[2 + i].revents = 0;
+    }
+#endif
+    if (-1 == ppoll(pfds, listen_sock == -1 ? 1 : 2 + MAX_TLS_CONNS,
+                    timeout, NULL) && errno != EINTR) {
+      perror("ppoll");
+      return EXIT_FAILURE;
+    }
+#ifdef HAVE_TLS
+    if (listen_sock != -1) {
+      for (i = 0; i < MAX_TLS_CONNS; i++) {
+        if (pfds[2 + i].revents && 0 != tls_serve(&tls_conns[i]))
+          tls_close(&tls_conns[i]);
+      }
+      if (pfds[1].revents)
+        tls_accept(listen_sock);
+    }
+#endif
+    for (i = 0; i < RECV_ROUNDS; i++) {
+      struct sockaddr_storage addr;
+      socklen_t addrlen = sizeof(addr);
+      ssize_t len = recvfrom(sock, buf, sizeof(buf), 0,
+                             (struct sockaddr *)&addr, &addrlen);
+      if (len == -1)
+        break;
+      handle_query(sock, buf, len, (struct sockaddr *)&addr, addrlen);
+    }
+  }
+  fprintf(stderr, "%s stub: %lu queries, %lu answered, %lu lost, "
+          "%lu poisoned, %lu over the queue\n",
+          foreign ? "foreign" : "chn", received, answered, lost, poisoned,
+          overflowed);
+#ifdef HAVE_TLS
+  if (tls_name)
+    fprintf(stderr, "%s stub: %lu TLS handshakes, %lu resumed\n",
+            foreign ? "foreign" : "chn", handshakes, resumed);
+#endif
+  return EXIT_SUCCESS;
+}
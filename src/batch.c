@@ -0,0 +1,344 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "log.h"
+#include "batch.h"
+
+// batches read per wakeup, so one busy socket can't starve the others
+#define BATCH_ROUNDS 4
+#define GRO_BUF_SIZE 65535
+
+#ifdef HAVE_SENDMMSG
+typedef struct mmsghdr out_msg_t;
+#define OUT_HDR(m) (&(m)->msg_hdr)
+#else
+typedef struct msghdr out_msg_t;
+#define OUT_HDR(m) (m)
+#endif
+
+#ifdef HAVE_RECVMMSG
+typedef struct mmsghdr in_msg_t;
+#define IN_HDR(m) (&(m)->msg_hdr)
+#else
+typedef struct msghdr in_msg_t;
+#define IN_HDR(m) (m)
+#endif
+
+typedef struct sendq_s {
+  int sock;
+  int len;
+  out_msg_t *msgs;
+  struct iovec *iovs;
+  struct sockaddr_storage *addrs;
+  // on the list of queues to flush
+  int queued;
+  struct sendq_s *next;
+} sendq_t;
+
+static int batch_size;
+static size_t buf_size;
+static int queue_len;
+static int gro;
+
+static size_t recv_size;
+static char *recv_bufs;
+static struct sockaddr_storage *recv_addrs;
+static struct iovec *recv_iovs;
+static in_msg_t *recv_msgs;
+static size_t *recv_lens;
+static size_t ctrl_size;
+static char *recv_ctrls;
+
+// indexed by fd, allocated on first use since every upstream socket
+// has its own queue
+static sendq_t **sendqs = NULL;
+static int sendqs_len = 0;
+static sendq_t *queued = NULL;
+
+// scratch buffers come in chunks of queue_len, and more chunks are added
+// rather than reusing a buffer before the flush, when whatever took it
+// may still be using it
+static char **scratch = NULL;
+static int scratch_chunks = 0;
+static int scratch_used = 0;
+
+static int recv_some(int sock);
+static size_t segment_size(in_msg_t *m);
+static sendq_t *get_sendq(int sock);
+static void flush_sendq(sendq_t *q);
+
+int batch_init(int size, size_t bufsize, int qlen, int use_gro) {
+  batch_size = size;
+  buf_size = bufsize;
+  queue_len = qlen;
+  gro = use_gro;
+  recv_size = gro ? GRO_BUF_SIZE : buf_size;
+#ifdef UDP_GRO
+  ctrl_size = gro ? CMSG_SPACE(sizeof(int)) : 0;
+#else
+  ctrl_size = 0;
+#endif
+  recv_bufs = malloc(batch_size * recv_size);
+  recv_addrs = calloc(batch_size, sizeof(struct sockaddr_storage));
+  recv_iovs = calloc(batch_size, sizeof(struct iovec));
+  recv_msgs = calloc(batch_size, sizeof(in_msg_t));
+  recv_lens = calloc(batch_size, sizeof(size_t));
+  recv_ctrls = ctrl_size ? malloc(batch_size * ctrl_size) : NULL;
+  if (!recv_bufs || !recv_addrs || !recv_iovs || !recv_msgs || !recv_lens ||
+      (ctrl_size && !recv_ctrls))
+    return -1;
+  // one chunk is enough for most batches, and the first is made up front
+  if (batch_buf() == NULL)
+    return -1;
+  scratch_used = 0;
+  return 0;
+}
+
+int batch_enable_gro(int sock) {
+#ifdef UDP_GRO
+  int on = 1;
+  return setsockopt(sock, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+int batch_recv(int sock, batch_handler handler, void *data) {
+  int round, i, n;
+  for (round = 0; round < BATCH_ROUNDS; round++) {
+    n = recv_some(sock);
+    if (n == -1)
+      return -1;
+    for (i = 0; i < n; i++) {
+      struct msghdr *hdr = IN_HDR(&recv_msgs[i]);
+      size_t len = recv_lens[i];
+      size_t seg = segment_size(&recv_msgs[i]);
+      char *buf = hdr->msg_iov->iov_base;
+      // cut off by a buffer smaller than the payload size advertised
+      if (hdr->msg_flags & MSG_TRUNC)
+        continue;
+      // a coalesced datagram carries several equally sized segments
+      while (len > 0) {
+        size_t l = len < seg ? len : seg;
+        handler(buf, l, (struct sockaddr *)hdr->msg_name, hdr->msg_namelen,
+                data);
+        buf += l;
+        len -= l;
+      }
+    }
+    batch_flush();
+    if (n < batch_size)
+      break;
+  }
+  return 0;
+}
+
+void batch_send(int sock, const char *buf, size_t len,
+                const struct sockaddr *addr, socklen_t addrlen) {
+  sendq_t *q = get_sendq(sock);
+  struct msghdr *hdr;
+  int i;
+  if (q == NULL) {
+    if (-1 == sendto(sock, buf, len, 0, addr, addrlen))
+      ERR("sendto");
+    return;
+  }
+  if (!q->queued) {
+    q->queued = 1;
+    q->next = queued;
+    queued = q;
+  }
+  if (q->len == queue_len)
+    flush_sendq(q);
+  i = q->len++;
+  q->iovs[i].iov_base = (void *)buf;
+  q->iovs[i].iov_len = len;
+  hdr = OUT_HDR(&q->msgs[i]);
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->msg_iov = &q->iovs[i];
+  hdr->msg_iovlen = 1;
+  if (addr) {
+    memcpy(&q->addrs[i], addr, addrlen);
+    hdr->msg_name = &q->addrs[i];
+    hdr->msg_namelen = addrlen;
+  }
+}
+
+char *batch_buf() {
+  int chunk = scratch_used / queue_len;
+  if (chunk == scratch_chunks) {
+    char **chunks = realloc(scratch, (chunk + 1) * sizeof(char *));
+    if (chunks == NULL) {
+      ERR("realloc");
+      return NULL;
+    }
+    scratch = chunks;
+    if ((scratch[chunk] = malloc(queue_len * buf_size)) == NULL) {
+      ERR("malloc");
+      return NULL;
+    }
+    scratch_chunks++;
+  }
+  return scratch[chunk] + buf_size * (scratch_used++ % queue_len);
+}
+
+void batch_flush() {
+  sendq_t *q;
+  for (q = queued; q; q = q->next) {
+    flush_sendq(q);
+    q->queued = 0;
+  }
+  queued = NULL;
+  scratch_used = 0;
+}
+
+static int recv_some(int sock) {
+  int i, n;
+  for (i = 0; i < batch_size; i++) {
+    struct msghdr *hdr = IN_HDR(&recv_msgs[i]);
+    recv_iovs[i].iov_base = recv_bufs + recv_size * i;
+    recv_iovs[i].iov_len = recv_size;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &recv_addrs[i];
+    hdr->msg_namelen = sizeof(struct sockaddr_storage);
+    hdr->msg_iov = &recv_iovs[i];
+    hdr->msg_iovlen = 1;
+    if (ctrl_size) {
+      hdr->msg_control = recv_ctrls + ctrl_size * i;
+      hdr->msg_controllen = ctrl_size;
+    }
+  }
+#ifdef HAVE_RECVMMSG
+  n = recvmmsg(sock, recv_msgs, batch_size, MSG_DONTWAIT, NULL);
+  if (n == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  for (i = 0; i < n; i++)
+    recv_lens[i] = recv_msgs[i].msg_len;
+  return n;
+#else
+  for (n = 0; n < batch_size; n++) {
+    ssize_t r = recvmsg(sock, IN_HDR(&recv_msgs[n]), MSG_DONTWAIT);
+    if (r == -1) {
+      if (n == 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      break;
+    }
+    recv_lens[n] = r;
+  }
+  return n;
+#endif
+}
+
+static size_t segment_size(in_msg_t *m) {
+#ifdef UDP_GRO
+  struct msghdr *hdr = IN_HDR(m);
+  struct cmsghdr *cmsg;
+  if (ctrl_size) {
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int seg;
+        memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+        if (seg > 0)
+          return seg;
+      }
+    }
+  }
+#endif
+  return recv_size;
+}
+
+static sendq_t *get_sendq(int sock) {
+  sendq_t *q;
+  if (sock >= sendqs_len) {
+    int new_len = sendqs_len ? sendqs_len : 64;
+    sendq_t **new_sendqs;
+    while (new_len <= sock)
+      new_len *= 2;
+    new_sendqs = realloc(sendqs, new_len * sizeof(sendq_t *));
+    if (new_sendqs == NULL)
+      return NULL;
+    memset(new_sendqs + sendqs_len, 0,
+           (new_len - sendqs_len) * sizeof(sendq_t *));
+    sendqs = new_sendqs;
+    sendqs_len = new_len;
+  }
+  if (sendqs[sock])
+    return sendqs[sock];
+  q = calloc(1, sizeof(sendq_t));
+  if (q == NULL)
+    return NULL;
+  q->msgs = calloc(queue_len, sizeof(out_msg_t));
+  q->iovs = calloc(queue_len, sizeof(struct iovec));
+  q->addrs = calloc(queue_len, sizeof(struct sockaddr_storage));
+  if (!q->msgs || !q->iovs || !q->addrs) {
+    free(q->msgs);
+    free(q->iovs);
+    free(q->addrs);
+    free(q);
+    return NULL;
+  }
+  q->sock = sock;
+  sendqs[sock] = q;
+  return q;
+}
+
+static void flush_sendq(sendq_t *q) {
+  int i = 0;
+  int retried = 0;
+  while (i < q->len) {
+#ifdef HAVE_SENDMMSG
+    int n = sendmmsg(q->sock, q->msgs + i, q->len - i, 0);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      // a connected socket reports an earlier ICMP error once, on
+      // whatever is sent next
+      if (errno == ECONNREFUSED && !retried) {
+        retried = 1;
+        continue;
+      }
+      ERR("sendmmsg");
+      // skip the datagram that failed
+      n = 1;
+    }
+    retried = 0;
+    i += n;
+#else
+    if (-1 == sendmsg(q->sock, OUT_HDR(&q->msgs[i]), 0)) {
+      if (errno == ECONNREFUSED && !retried) {
+        retried = 1;
+        continue;
+      }
+      ERR("sendmsg");
+    }
+    retried = 0;
+    i++;
+#endif
+  }
+  q->len = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+typedef void (*batch_handler)(char *buf, size_t len, struct sockaddr *addr,
+                              socklen_t addrlen, void *data);
+
+/* batch_size datagrams of at most buf_size bytes are read per syscall.
+   each send queue holds up to queue_len datagrams.
+   with gro, receive buffers are sized for coalesced datagrams */
+int batch_init(int batch_size, size_t buf_size, int queue_len, int gro);
+
+/* let the kernel coalesce datagrams on sock, -1 if unsupported */
+int batch_enable_gro(int sock);
+
+/* read what's available on sock and call handler for every datagram,
+   passing data along.
+   buf may be modified within len, and stays valid until the queued sends
+   are flushed, which happens between batches */
+int batch_recv(int sock, batch_handler handler, void *data);
+
+/* queue a datagram. buf must stay valid until the next flush; addr is
+   copied, and may be NULL on a connected socket */
+void batch_send(int sock, const char *buf, size_t len,
+                const struct sockaddr *addr, socklen_t addrlen);
+
+/* a buf_size scratch buffer that lives until the next flush, and is never
+   handed out again before it. NULL if no more can be allocated */
+char *batch_buf();
+
+void batch_flush();
+
+#endif
@@ -0,0 +1,518 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <resolv.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+
+#include "local_ns_parser.h"
+#include "cache.h"
+#include "edns.h"
+
+// responses with more RRs than this are not cached
+#define CACHE_MAX_RRS 512
+// lowercased wire name + type + class + CD and DO
+#define CACHE_KEY_LEN (NS_MAXCDNAME + 5)
+// where the question name starts, right after the header
+#define QNAME_OFF 12
+// entries are carved out of pages of the arena; larger ones aren't cached
+#define SLAB_PAGE_SIZE 4096
+// evictions tried to make room for one entry before emptying a page for
+// it, as the room they make may all be in other classes
+#define MAX_EVICTIONS 64
+// entries from the hand on that an eviction looks through for an expired
+// one, before the clock picks one that may still be fresh
+#define EXPIRED_SCAN 16
+// lookups an entry must have had to be refreshed ahead of expiry
+#define PREFETCH_HITS 4
+// a refresh that brought nothing usable is tried again after this long
+#define PREFETCH_RETRY 10
+
+static const size_t slab_classes[] = {
+  64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+#define SLAB_CLASSES (sizeof(slab_classes) / sizeof(slab_classes[0]))
+
+/* a page holds objects of one class, or is free. a class keeps its pages
+   until every object on them is freed, or the page is emptied for
+   another class by evict_page() */
+typedef struct slab_page {
+  void *free_list;
+  int live;
+  size_t cls;
+  // a bit per object in use, as a page has at most 64
+  uint64_t used;
+  // on the partial list of its class, or the list of free pages
+  struct slab_page *prev;
+  struct slab_page *next;
+  int listed;
+} slab_page_t;
+
+typedef struct cache_entry {
+  // hash chain
+  struct cache_entry *hnext;
+  // CLOCK ring
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  uint32_t hash;
+  time_t stored;
+  time_t expire;
+  int referenced;
+  uint32_t hits;
+  // when a refresh was asked for, 0 if it wasn't
+  time_t refreshing;
+  uint16_t keylen;
+  uint16_t msglen;
+  uint16_t nttl;
+  // uint16_t ttl_offsets[nttl], char key[keylen], u_char msg[msglen]
+  unsigned char data[];
+} cache_entry_t;
+
+#define ENTRY_TTL_OFFSETS(e) ((uint16_t *)(e)->data)
+#define ENTRY_KEY(e) ((e)->data + (e)->nttl * sizeof(uint16_t))
+#define ENTRY_MSG(e) (ENTRY_KEY(e) + (e)->keylen)
+#define ENTRY_SIZE(e) (sizeof(cache_entry_t) + (e)->nttl * sizeof(uint16_t) + \
+                       (e)->keylen + (e)->msglen)
+
+static size_t cache_size = 0;
+static float prefetch_fraction;
+static int max_stale;
+static cache_entry_t **buckets = NULL;
+static uint32_t bucket_mask;
+// CLOCK hand, also the oldest position in the ring
+static cache_entry_t *hand = NULL;
+// entries that found no room, and entries evicted to make room
+static unsigned long skipped = 0;
+static unsigned long evicted = 0;
+
+static char *arena = NULL;
+static slab_page_t *pages = NULL;
+static slab_page_t *free_pages = NULL;
+// pages with at least one free object, per class
+static slab_page_t *partial[SLAB_CLASSES];
+
+static time_t cache_now();
+static uint32_t hash_key(const unsigned char *key, size_t keylen);
+static size_t make_key(const local_ns_msg *msg, int query_bits,
+                       unsigned char *key);
+static void copy_qname(char *buf, size_t len, const unsigned char *name,
+                       int namelen);
+static cache_entry_t *find(const unsigned char *key, size_t keylen,
+                           uint32_t hash);
+static void remove_entry(cache_entry_t *e);
+static void evict_one(time_t now);
+static unsigned long evict_page(slab_page_t *page);
+static void *slab_alloc(size_t size);
+static void slab_free(void *obj);
+static void list_push(slab_page_t **list, slab_page_t *page);
+static void list_unlink(slab_page_t **list, slab_page_t *page);
+
+int cache_init(size_t size, float prefetch, int stale) {
+  size_t nbuckets = 64;
+  size_t npages, i;
+  cache_size = size;
+  prefetch_fraction = prefetch;
+  max_stale = stale;
+  if (size == 0)
+    return 0;
+  // assume ~256 bytes per entry
+  while (nbuckets < size / 256)
+    nbuckets <<= 1;
+  buckets = calloc(nbuckets, sizeof(cache_entry_t *));
+  if (buckets == NULL)
+    return -1;
+  bucket_mask = nbuckets - 1;
+
+  // the buckets count towards the cap, the rest is the arena
+  size -= MIN(size, nbuckets * sizeof(cache_entry_t *));
+  npages = size / (SLAB_PAGE_SIZE + sizeof(slab_page_t));
+  if (npages == 0)
+    return 0;
+  arena = malloc(npages * SLAB_PAGE_SIZE);
+  pages = calloc(npages, sizeof(slab_page_t));
+  if (arena == NULL || pages == NULL)
+    return -1;
+  for (i = npages; i > 0; i--)
+    list_push(&free_pages, &pages[i - 1]);
+  return 0;
+}
+
+unsigned long cache_skipped() {
+  return skipped;
+}
+
+unsigned long cache_evicted() {
+  return evicted;
+}
+
+size_t cache_lookup(const local_ns_msg *query, char *buf, size_t buflen,
+                    int *flags) {
+  unsigned char key[CACHE_KEY_LEN];
+  unsigned char qname[NS_MAXCDNAME];
+  const local_ns_rr *question = local_ns_section(query, ns_s_qd);
+  size_t keylen;
+  cache_entry_t *e;
+  time_t now, elapsed;
+  uint16_t *ttl_offsets;
+  uint16_t id;
+  int i, qnamelen;
+
+  *flags = 0;
+  if (buckets == NULL)
+    return 0;
+  if (0 == (keylen = make_key(query, cache_query_bits(query), key)))
+    return 0;
+  e = find(key, keylen, hash_key(key, keylen));
+  if (e == NULL)
+    return 0;
+  now = cache_now();
+  if (now - e->expire >= max_stale) {
+    remove_entry(e);
+    return 0;
+  }
+  if (e->msglen > buflen)
+    return 0;
+  e->referenced = 1;
+  if (now >= e->expire) {
+    *flags = CACHE_STALE;
+  } else if (++e->hits >= PREFETCH_HITS &&
+             e->expire - now <= prefetch_fraction * (e->expire - e->stored) &&
+             (e->refreshing == 0 || now - e->refreshing >= PREFETCH_RETRY)) {
+    e->refreshing = now;
+    *flags = CACHE_PREFETCH;
+  }
+
+  // buf may hold the query itself
+  memcpy(&id, query->msg, 2);
+  qnamelen = local_ns_name_unpack(query, question->name, qname);
+  memcpy(buf, ENTRY_MSG(e), e->msglen);
+  // reply with the id of the query, and its question as it was spelled,
+  // not as whoever asked first did. some clients check its case, as in
+  // 0x20
+  memcpy(buf, &id, 2);
+  copy_qname(buf, e->msglen, qname, qnamelen);
+  // count TTLs down
+  elapsed = now - e->stored;
+  ttl_offsets = ENTRY_TTL_OFFSETS(e);
+  for (i = 0; i < e->nttl; i++) {
+    const u_char *src = ENTRY_MSG(e) + ttl_offsets[i];
+    u_char *dst = (u_char *)buf + ttl_offsets[i];
+    uint32_t ttl;
+    NS_GET32(ttl, src);
+    if (*flags & CACHE_STALE)
+      ttl = CACHE_STALE_TTL;
+    else
+      ttl = ttl > elapsed ? ttl - elapsed : 0;
+    NS_PUT32(ttl, dst);
+  }
+  return e->msglen;
+}
+
+int cache_query_bits(const local_ns_msg *query) {
+  // CD from the header, DO from the OPT record
+  return (query->flags & 0x0010 ? 1 : 0) | edns_dnssec_ok(query) << 1;
+}
+
+void cache_put(const local_ns_msg *response, int query_bits) {
+  static uint16_t ttl_offsets[CACHE_MAX_RRS];
+  unsigned char key[CACHE_KEY_LEN];
+  size_t keylen, size, msglen;
+  const u_char *base = response->msg;
+  uint32_t hash, min_ttl = UINT32_MAX;
+  int nttl = 0;
+  int has_soa = 0;
+  int i;
+  cache_entry_t *e;
+  time_t now;
+  ns_sect sect;
+  int rrnum;
+
+  if (buckets == NULL)
+    return;
+  msglen = response->msglen;
+  if (msglen > UINT16_MAX)
+    return;
+  // only NOERROR and NXDOMAIN, and never a truncated response
+  if ((base[3] & 0x0f) != ns_r_noerror && (base[3] & 0x0f) != ns_r_nxdomain)
+    return;
+  if (base[2] & 0x02)
+    return;
+  if (0 == (keylen = make_key(response, query_bits, key)))
+    return;
+
+  for (sect = ns_s_an; sect < ns_s_max; sect++) {
+    const local_ns_rr *rrs = local_ns_section(response, sect);
+    for (rrnum = 0; rrnum < response->counts[sect]; rrnum++) {
+      const local_ns_rr *rr = &rrs[rrnum];
+      uint32_t ttl;
+      if (rr->type == ns_t_opt)
+        continue;
+      if (nttl == CACHE_MAX_RRS)
+        return;
+      // the TTL field is right before RDLENGTH and RDATA
+      ttl_offsets[nttl++] = rr->rdata - NS_INT16SZ - NS_INT32SZ - base;
+      if (sect == ns_s_ar)
+        continue;
+      ttl = rr->ttl;
+      if (sect == ns_s_ns && rr->type == ns_t_soa &&
+          rr->rdlength >= NS_INT32SZ) {
+        // negative answers live for the SOA MINIMUM at most, RFC 2308
+        const u_char *minimum = rr->rdata + rr->rdlength - NS_INT32SZ;
+        uint32_t soa_min;
+        NS_GET32(soa_min, minimum);
+        ttl = MIN(ttl, soa_min);
+        has_soa = 1;
+      }
+      min_ttl = MIN(min_ttl, ttl);
+    }
+  }
+  if (response->counts[ns_s_an] == 0 && !has_soa)
+    return;
+  if (min_ttl == 0 || min_ttl == UINT32_MAX)
+    return;
+
+  hash = hash_key(key, keylen);
+  now = cache_now();
+  if ((e = find(key, keylen, hash))) {
+    // keep the answer clients have already got, unless it's being
+    // refreshed
+    if (now < e->expire && !e->refreshing)
+      return;
+    remove_entry(e);
+  }
+  size = sizeof(cache_entry_t) + nttl * sizeof(uint16_t) + keylen + msglen;
+  if (size > SLAB_PAGE_SIZE || arena == NULL) {
+    skipped++;
+    return;
+  }
+  for (i = 0; (e = slab_alloc(size)) == NULL; i++) {
+    if (hand == NULL) {
+      skipped++;
+      return;
+    }
+    // the oldest entry's page, whichever class it's in, goes back to the
+    // free pages with everything on it
+    if (i == MAX_EVICTIONS) {
+      evicted += evict_page(&pages[((char *)hand - arena) / SLAB_PAGE_SIZE]);
+      continue;
+    }
+    evict_one(now);
+    evicted++;
+  }
+  e->hash = hash;
+  e->stored = now;
+  e->expire = now + min_ttl;
+  e->referenced = 0;
+  e->hits = 0;
+  e->refreshing = 0;
+  e->keylen = keylen;
+  e->msglen = msglen;
+  e->nttl = nttl;
+  memcpy(ENTRY_TTL_OFFSETS(e), ttl_offsets, nttl * sizeof(uint16_t));
+  memcpy(ENTRY_KEY(e), key, keylen);
+  memcpy(ENTRY_MSG(e), base, msglen);
+
+  e->hnext = buckets[hash & bucket_mask];
+  buckets[hash & bucket_mask] = e;
+  // insert right behind the hand, so it's the last one to be visited
+  if (hand == NULL) {
+    e->prev = e->next = e;
+    hand = e;
+  } else {
+    e->next = hand;
+    e->prev = hand->prev;
+    hand->prev->next = e;
+    hand->prev = e;
+  }
+}
+
+static time_t cache_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static uint32_t hash_key(const unsigned char *key, size_t keylen) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < keylen; i++) {
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t make_key(const local_ns_msg *msg, int query_bits,
+                       unsigned char *key) {
+  const local_ns_rr *rr = local_ns_section(msg, ns_s_qd);
+  int len;
+  if (msg->counts[ns_s_qd] != 1)
+    return 0;
+  if (-1 == (len = local_ns_name_key(msg, rr->name, key)))
+    return 0;
+  memcpy(key + len, &rr->type, 2);
+  memcpy(key + len + 2, &rr->rr_class, 2);
+  key[len + 4] = query_bits;
+  return len + 5;
+}
+
+// name, as unpacked from a query, over the question name of the answer in
+// buf, which is the same but for case. left alone unless it's spelled out
+// label by label there too
+static void copy_qname(char *buf, size_t len, const unsigned char *name,
+                       int namelen) {
+  int off;
+  if (namelen <= 0 || QNAME_OFF + namelen > len)
+    return;
+  for (off = 0; off < namelen; off += 1 + name[off]) {
+    if ((unsigned char)buf[QNAME_OFF + off] != name[off])
+      return;
+  }
+  memcpy(buf + QNAME_OFF, name, namelen);
+}
+
+static cache_entry_t *find(const unsigned char *key, size_t keylen,
+                           uint32_t hash) {
+  cache_entry_t *e;
+  for (e = buckets[hash & bucket_mask]; e; e = e->hnext) {
+    if (e->hash == hash && e->keylen == keylen &&
+        0 == memcmp(ENTRY_KEY(e), key, keylen))
+      return e;
+  }
+  return NULL;
+}
+
+static void remove_entry(cache_entry_t *e) {
+  cache_entry_t **pp = &buckets[e->hash & bucket_mask];
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  if (e->next == e) {
+    hand = NULL;
+  } else {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    if (hand == e)
+      hand = e->next;
+  }
+  slab_free(e);
+}
+
+static void evict_one(time_t now) {
+  cache_entry_t *e = hand;
+  int i;
+  for (i = 0; i < EXPIRED_SCAN; i++, e = e->next) {
+    if (now >= e->expire) {
+      remove_entry(e);
+      return;
+    }
+    if (e->next == hand)
+      break;
+  }
+  // CLOCK: give referenced entries a second chance
+  while (hand->referenced && now < hand->expire) {
+    hand->referenced = 0;
+    hand = hand->next;
+  }
+  remove_entry(hand);
+}
+
+// every entry on page, which then is free. the number evicted
+static unsigned long evict_page(slab_page_t *page) {
+  char *mem = arena + (page - pages) * SLAB_PAGE_SIZE;
+  uint64_t used = page->used;
+  unsigned long n = 0;
+  for (; used; used &= used - 1, n++)
+    remove_entry((cache_entry_t *)(mem + __builtin_ctzll(used) *
+                                         slab_classes[page->cls]));
+  return n;
+}
+
+static void *slab_alloc(size_t size) {
+  slab_page_t *page;
+  void *obj;
+  size_t c = 0, off;
+  while (slab_classes[c] < size)
+    c++;
+  page = partial[c];
+  if (page == NULL) {
+    // carve a free page into objects of this class
+    char *mem;
+    if ((page = free_pages) == NULL)
+      return NULL;
+    list_unlink(&free_pages, page);
+    mem = arena + (page - pages) * SLAB_PAGE_SIZE;
+    page->free_list = NULL;
+    for (off = SLAB_PAGE_SIZE / slab_classes[c] * slab_classes[c]; off > 0;
+         off -= slab_classes[c]) {
+      *(void **)(mem + off - slab_classes[c]) = page->free_list;
+      page->free_list = mem + off - slab_classes[c];
+    }
+    page->live = 0;
+    page->cls = c;
+    page->used = 0;
+    list_push(&partial[c], page);
+  }
+  obj = page->free_list;
+  page->free_list = *(void **)obj;
+  page->live++;
+  off = (char *)obj - arena;
+  page->used |= (uint64_t)1 << off % SLAB_PAGE_SIZE / slab_classes[c];
+  if (page->free_list == NULL)
+    list_unlink(&partial[c], page);
+  return obj;
+}
+
+static void slab_free(void *obj) {
+  size_t off = (char *)obj - arena;
+  slab_page_t *page = &pages[off / SLAB_PAGE_SIZE];
+  size_t c = page->cls;
+  page->used &= ~((uint64_t)1 << off % SLAB_PAGE_SIZE / slab_classes[c]);
+  *(void **)obj = page->free_list;
+  page->free_list = obj;
+  if (--page->live == 0) {
+    // an empty page can go to any class
+    if (page->listed)
+      list_unlink(&partial[c], page);
+    list_push(&free_pages, page);
+  } else if (!page->listed) {
+    list_push(&partial[c], page);
+  }
+}
+
+static void list_push(slab_page_t **list, slab_page_t *page) {
+  page->prev = NULL;
+  page->next = *list;
+  if (*list)
+    (*list)->prev = page;
+  *list = page;
+  page->listed = 1;
+}
+
+static void list_unlink(slab_page_t **list, slab_page_t *page) {
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    *list = page->next;
+  if (page->next)
+    page->next->prev = page->prev;
+  page->listed = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#include "local_ns_parser.h"
+
+// the entry is asked for often and about to expire, refresh it now
+#define CACHE_PREFETCH 1
+// the entry has expired, and is only to be served if nothing fresh comes
+#define CACHE_STALE 2
+
+// TTL of stale answers, as RFC 8767 suggests
+#define CACHE_STALE_TTL 30
+
+/* size is the memory cap in bytes, preallocated here; 0 disables the
+   cache. entries asked for often are due for a refresh once a prefetch
+   fraction of their TTL is left, 0 for never. expired ones are kept for
+   max_stale seconds */
+int cache_init(size_t size, float prefetch, int max_stale);
+
+/* look up the question of query; on hit, copy the cached response into buf
+   with the id of query and TTLs counted down, and return its length.
+   *flags is set to CACHE_PREFETCH or CACHE_STALE, or 0. a stale response
+   has every TTL set to CACHE_STALE_TTL. return 0 on miss */
+size_t cache_lookup(const local_ns_msg *query, char *buf, size_t buflen,
+                    int *flags);
+
+/* what an answer to query is cached under besides its question: whether
+   DNSSEC records were asked for and whether they were checked. taken from
+   the query, since upstreams don't always copy them into the answer */
+int cache_query_bits(const local_ns_msg *query);
+
+/* store a response that has passed the filter, under the bits of the
+   query it answers, unless an unexpired one for the same question is
+   already there and isn't being refreshed */
+void cache_put(const local_ns_msg *response, int query_bits);
+
+/* responses cache_put() found no room for */
+unsigned long cache_skipped();
+
+/* entries evicted by cache_put() to make room */
+unsigned long cache_evicted();
+
+#endif
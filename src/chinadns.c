@@ -15,6 +15,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <resolv.h>
@@ -23,55 +25,51 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <sys/param.h>
+#include <sys/wait.h>
 
 #include "local_ns_parser.h"
+#include "batch.h"
+#include "cache.h"
+#include "edns.h"
+#include "filter.h"
+#include "log.h"
+#include "loop.h"
+#include "lpm.h"
+#include "metrics.h"
+#include "pending.h"
+#include "pool.h"
+#include "routes.h"
+#include "stream.h"
+#include "tcp.h"
+#include "upstream.h"
 
 #include "config.h"
 
-typedef struct {
-  uint16_t id;
-  struct timeval ts;
-  char *buf;
-  size_t buflen;
-  struct sockaddr *addr;
-  socklen_t addrlen;
-} delay_buf_t;
-
-typedef struct {
-  uint16_t id;
-  uint16_t old_id;
-  struct sockaddr *addr;
-  socklen_t addrlen;
-} id_addr_t;
-
-typedef struct {
-  int entries;
-  struct in_addr *ips;
-} ip_list_t;
-
-typedef struct {
-  struct in_addr net;
-  in_addr_t mask;
-} net_mask_t;
-
-typedef struct {
-  int entries;
-  net_mask_t *nets;
-} net_list_t;
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+
 
 
 // avoid malloc and free
 #define BUF_SIZE 512
 static char global_buf[BUF_SIZE];
-static char compression_buf[BUF_SIZE];
-static int verbose = 0;
+
+// EDNS0 payload size offered to upstreams, which every message buffer is
+// sized to. 1232 fits an IPv6 packet without fragments
+#define PAYLOAD_SIZE 1232
+static int payload_size = PAYLOAD_SIZE;
+
+int verbose = 0;
 static int compression = 0;
 static int bidirectional = 0;
 
@@ -80,11 +78,35 @@ static const char *default_dns_servers =
 static char *dns_servers = NULL;
 static int dns_servers_len;
 static int has_chn_dns;
-static id_addr_t *dns_server_addrs;
+// chn upstreams first when using compression pointer mutation
+static upstream_t *upstreams;
+// upstreams by the side chnroute puts them on
+static uint64_t chn_mask, foreign_mask;
+// pending queries track upstreams in 64-bit masks
+#define MAX_DNS_SERVERS 64
+#define UPSTREAM_BIT(i) ((uint64_t)1 << (i))
+
+// send to the best chn and the best foreign upstream first, and to the
+// rest only if nothing usable arrived by the time HEDGE_PERCENTILE of
+// their answers usually have
+static int hedge = 0;
+#define HEDGE_PERCENTILE 95
+// milliseconds, when there are no samples yet
+#define HEDGE_DEFAULT 100
+#define HEDGE_MIN 10
+static uint64_t select_upstreams(int group, uint64_t now, uint64_t *later);
+static uint64_t group_mask(int group);
+static int query_group(const local_ns_msg *msg);
+static int hedge_delay(uint64_t mask);
+static void forward_query(pending_t *pending, uint64_t mask, char *buf,
+                          size_t len);
+static size_t mutate_query(const char *buf, size_t len, char *out);
+static void send_hedge(void *data);
 
 static int parse_args(int argc, char **argv);
 
 static int setnonblock(int sock);
+static void split_host_port(char *s, char **host, char **port);
 static int resolve_dns_servers();
 
 static const char *default_listen_addr = "0.0.0.0";
@@ -94,137 +116,563 @@ static char *listen_addr = NULL;
 static char *listen_port = NULL;
 
 static char *ip_list_file = NULL;
-static ip_list_t ip_list;
-static int parse_ip_list();
-
+static char *chn_domains_file = NULL;
+static char *foreign_domains_file = NULL;
 static char *chnroute_file = NULL;
-static net_list_t chnroute_list;
-static int parse_chnroute();
-static int test_ip_in_list(struct in_addr ip, const net_list_t *netlist);
+// certificates tls:// upstreams are checked against, NULL for the
+// system's
+static char *tls_ca_file = NULL;
+
+// lookups go through this pointer only, so a reload swaps the ip list
+// and chnroute together
+static routes_t *routes;
+// SIGHUP, which the parent forwards to the workers
+static volatile sig_atomic_t reload_requested = 0;
+// lists are loaded by a thread of their own, which hands the new routes
+// to the loop through this pipe
+static int reload_pipe[2] = {-1, -1};
+static int reloading = 0;
+// SIGHUP came while loading, so the files may have changed again
+static int reload_again = 0;
+static uint64_t reload_started;
+static int init_reload_pipe();
+static void reload_routes();
+static void *load_routes(void *arg);
+static void swap_routes(int fd, int events, void *data);
+static void update_route_metrics();
+static int test_addr_in_chnroute(const struct sockaddr *addr);
+
+// datagrams read or written per syscall
+#define BATCH_SIZE 32
+static int batch_size = BATCH_SIZE;
+static int gro = 0;
 
 static int dns_init_sockets();
-static void dns_handle_local();
-static void dns_handle_remote();
-
-static const char *hostname_from_question(ns_msg msg);
-static int should_filter_query(ns_msg msg, struct in_addr dns_addr);
-
-static void queue_add(id_addr_t id_addr);
-static id_addr_t *queue_lookup(uint16_t id);
-
-#define ID_ADDR_QUEUE_LEN 128
-// use a queue instead of hash here since it's not long
-static id_addr_t id_addr_queue[ID_ADDR_QUEUE_LEN];
-static int id_addr_queue_pos = 0;
-
+static void dns_local_cb(int fd, int events, void *data);
+static void dns_remote_cb(int fd, int events, void *data);
+static void dns_handle_local(char *buf, size_t len, struct sockaddr *src_addr,
+                             socklen_t src_addrlen, void *data);
+static void dns_handle_query(char *buf, size_t len, struct sockaddr *src_addr,
+                             socklen_t src_addrlen, uint32_t conn);
+static int send_query(pending_t *pending, char *buf, size_t len,
+                       const local_ns_msg *msg);
+static void prefetch_query(char *buf, size_t len, const local_ns_msg *msg,
+                           struct sockaddr *src_addr, socklen_t src_addrlen);
+static void send_reply(uint32_t conn, int edns, char *buf, size_t len,
+                       const local_ns_msg *msg, const struct sockaddr *addr,
+                       socklen_t addrlen);
+static size_t fit_reply(uint32_t conn, int edns, char *buf, size_t len,
+                        const local_ns_msg *msg);
+// clients asking what an earlier one is still waiting for wait on its
+// pending query, and get copies of its answer
+static size_t query_key(const local_ns_msg *msg, unsigned char *key);
+static int join_pending(pending_t *pending, const local_ns_msg *msg,
+                        const struct sockaddr *addr, socklen_t addrlen,
+                        uint32_t conn);
+static void reply_waiters(pending_t *pending, const char *buf, size_t len,
+                          const local_ns_msg *msg);
+// a stable copy of an answer the waiters' copies are made from
+static char *waiter_buf;
+static void dns_handle_remote(char *buf, size_t len, struct sockaddr *src_addr,
+                              socklen_t src_len, void *data);
+static void dns_handle_stream(char *buf, size_t len, void *data);
+static void stream_error(void *data);
+static void stream_lost(uint16_t id, void *data);
+
+static const char *hostname_from_question(const local_ns_msg *msg);
+static int should_filter_query(const local_ns_msg *msg,
+                               const upstream_t *upstream, int group,
+                               log_record_t *rec);
+static log_record_t *begin_query_log(int event, const local_ns_msg *msg,
+                                     uint16_t id);
+
+// with -v, log one in every log_sample queries, and at most log_rate
+// records a second
+#define LOG_SAMPLE 1
+#define LOG_RATE 0
+static int log_sample = LOG_SAMPLE;
+static int log_rate = LOG_RATE;
+
+// seconds to wait for all upstreams before forgetting a query
+#define PENDING_TIMEOUT 10
+
+static void expire_pending(void *data);
+static void finish_pending(pending_t *pending);
+static void remove_pending(pending_t *pending);
+
+// the longest a suspect answer is held; it's released earlier once the
+// upstreams it waits for are past DELAY_PERCENTILE of their usual
+// latency, or have all answered
 #define EMPTY_RESULT_DELAY 0.3f
-#define DELAY_QUEUE_LEN 128
-static delay_buf_t delay_queue[DELAY_QUEUE_LEN];
-static void schedule_delay(uint16_t query_id, const char *buf, size_t buflen,
-                           struct sockaddr *addr, socklen_t addrlen);
-static void check_and_send_delay();
-static void free_delay(int pos);
-// next position for first, not used
-static int delay_queue_first = 0;
-// current position for last, used
-static int delay_queue_last = 0;
+#define DELAY_PERCENTILE 99
+// too few samples say little about the tail
+#define DELAY_MIN_SAMPLES 16
+// suspect answers are held in their pending query, in a buffer from
+// buf_pool
+static void schedule_delay(pending_t *pending, const char *buf,
+                           size_t buflen);
+static void send_delay(void *data);
+static void hold_stale(pending_t *pending, const char *buf, size_t buflen);
+static void send_stale(void *data);
+static uint64_t delay_deadline(pending_t *pending, uint64_t now);
 static float empty_result_delay = EMPTY_RESULT_DELAY;
 
+// in KiB
+#define CACHE_SIZE 1024
+static int cache_size = CACHE_SIZE;
+// popular entries are refreshed when this fraction of their TTL is left
+#define PREFETCH 0.1f
+static float prefetch = PREFETCH;
+// seconds an expired answer may still be served, RFC 8767
+#define MAX_STALE 86400
+static int max_stale = MAX_STALE;
+
+// pending queries per worker, preallocated along with buffers for held
+// answers and hedged queries, so nothing is allocated per query
+#define POOL_SIZE 2048
+#define MIN_POOL_BUFS 16
+static int pool_size = POOL_SIZE;
+static pool_t buf_pool;
+
 static int local_sock;
-static int remote_sock;
 
-static void usage(void);
+// TCP client connections per worker, 0 to listen on UDP only
+#define TCP_CONNS 64
+// seconds a connection may stay idle
+#define TCP_IDLE_TIMEOUT 10
+static int tcp_conns = TCP_CONNS;
+static int tcp_sock = -1;
+static int init_tcp_socket(const struct addrinfo *addr_ip);
+static void dns_handle_tcp(char *buf, size_t len, struct sockaddr *src_addr,
+                           socklen_t src_addrlen, uint32_t conn);
+
+// connected sockets per upstream, each with its own source port
+#define SOURCE_PORTS 1
+static int source_ports = SOURCE_PORTS;
+
+// worker processes, each with its own sockets and tables
+static int workers = 1;
+static int cpu_affinity = 0;
+static pid_t *worker_pids;
+static time_t *worker_started;
+// set once the workers are told to stop, so they aren't restarted
+static volatile sig_atomic_t stopping = 0;
+// a worker that dies sooner than this after starting won't do better
+// if restarted, so the whole service stops
+#define WORKER_MIN_UPTIME 1
+static int run_workers();
+static int start_worker(int worker_id);
+static int run_worker(int worker_id);
+
+// Prometheus text over HTTP, host:port or a UNIX socket path; SIGUSR1
+// dumps the same to stderr
+static char *metrics_addr = NULL;
+static volatile sig_atomic_t dump_requested = 0;
+static int init_metrics_socket();
+static void update_metrics();
+static void catch_dump_signal();
+static void catch_reload_signal();
 
-#define __LOG(o, t, v, s...) do {                                   \
-  time_t now;                                                       \
-  time(&now);                                                       \
-  char *time_str = ctime(&now);                                     \
-  time_str[strlen(time_str) - 1] = '\0';                            \
-  if (t == 0) {                                                     \
-    if (stdout != o || verbose) {                                   \
-      fprintf(o, "%s ", time_str);                                  \
-      fprintf(o, s);                                                \
-      fflush(o);                                                    \
-    }                                                               \
-  } else if (t == 1) {                                              \
-    fprintf(o, "%s %s:%d ", time_str, __FILE__, __LINE__);          \
-    perror(v);                                                      \
-  }                                                                 \
-} while (0)
-
-#define LOG(s...) __LOG(stdout, 0, "_", s)
-#define ERR(s) __LOG(stderr, 1, s, "_")
-#define VERR(s...) __LOG(stderr, 0, "_", s)
+static void usage(void);
 
 #ifdef DEBUG
-#define DLOG(s...) LOG(s)
 void __gcov_flush(void);
 static void gcov_handler(int signum)
 {
   __gcov_flush();
   exit(1);
 }
-#else
-#define DLOG(s...)
 #endif
 
 int main(int argc, char **argv) {
-  fd_set readset, errorset;
-  int max_fd;
 
 #ifdef DEBUG
   signal(SIGTERM, gcov_handler);
 #endif
 
-  memset(&id_addr_queue, 0, sizeof(id_addr_queue));
   if (0 != parse_args(argc, argv))
     return EXIT_FAILURE;
-  if (!compression)
-    memset(&delay_queue, 0, sizeof(delay_queue));
-  if (0 != parse_ip_list())
-    return EXIT_FAILURE;
-  if (0 != parse_chnroute())
+  if (chnroute_file == NULL)
+    VERR("CHNROUTE_FILE not specified, CHNRoute is disabled\n");
+  // loaded before forking, so workers share these pages read-only. a
+  // text file reloaded is private to each worker, an image stays shared
+  if (NULL == (routes = routes_load(chnroute_file, ip_list_file,
+                                    chn_domains_file, foreign_domains_file)))
     return EXIT_FAILURE;
   if (0 != resolve_dns_servers())
     return EXIT_FAILURE;
-  if (0 != dns_init_sockets())
+  if (0 != metrics_init(workers, upstreams, dns_servers_len)) {
+    ERR("metrics_init");
+    return EXIT_FAILURE;
+  }
+  if (workers > 1)
+    return run_workers();
+  return run_worker(0);
+}
+
+static void stop_workers(int signum) {
+  int i;
+  stopping = 1;
+  for (i = 0; i < workers; i++) {
+    if (worker_pids[i] > 0)
+      kill(worker_pids[i], SIGTERM);
+  }
+}
+
+static void forward_reload(int signum) {
+  int i;
+  // reloaded here too, for workers that are restarted later
+  reload_requested = 1;
+  for (i = 0; i < workers; i++) {
+    if (worker_pids[i] > 0)
+      kill(worker_pids[i], SIGHUP);
+  }
+}
+
+static int run_workers() {
+  int i, status, alive = 0;
+  int result = EXIT_SUCCESS;
+  struct sigaction sa;
+  pid_t pid;
+#ifndef SO_REUSEPORT
+  VERR("SO_REUSEPORT is not supported, can't run multiple workers\n");
+  return EXIT_FAILURE;
+#endif
+  worker_pids = calloc(workers, sizeof(pid_t));
+  worker_started = calloc(workers, sizeof(time_t));
+  // only this process dumps metrics, for all workers, and a reload is
+  // forwarded; until a worker catches SIGHUP itself it must not die of it
+  signal(SIGUSR1, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  for (i = 0; i < workers; i++) {
+    if (0 != start_worker(i)) {
+      stop_workers(SIGTERM);
+      result = EXIT_FAILURE;
+      break;
+    }
+    alive++;
+  }
+  signal(SIGTERM, stop_workers);
+  signal(SIGINT, stop_workers);
+  // no SA_RESTART, so wait() returns and the reload is done here too
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = forward_reload;
+  sigaction(SIGHUP, &sa, NULL);
+  catch_dump_signal();
+  while (alive > 0) {
+    pid = wait(&status);
+    if (pid == -1) {
+      if (dump_requested) {
+        dump_requested = 0;
+        metrics_write(stderr);
+      }
+      if (reload_requested) {
+        routes_t *r = routes_load(chnroute_file, ip_list_file,
+                                  chn_domains_file, foreign_domains_file);
+        reload_requested = 0;
+        if (r) {
+          routes_free(routes);
+          routes = r;
+        }
+      }
+      continue;
+    }
+    for (i = 0; i < workers && worker_pids[i] != pid; i++)
+      ;
+    if (i == workers)
+      continue;
+    worker_pids[i] = 0;
+    alive--;
+    if (stopping)
+      continue;
+    // the others go on serving meanwhile, on the same port
+    if (time(NULL) - worker_started[i] >= WORKER_MIN_UPTIME) {
+      VERR("worker %d exited, restarting it\n", pid);
+      if (0 == start_worker(i)) {
+        alive++;
+        continue;
+      }
+    } else {
+      VERR("worker %d exited\n", pid);
+    }
+    result = EXIT_FAILURE;
+    stop_workers(SIGTERM);
+  }
+  return result;
+}
+
+// fork worker worker_id, with the lists as last loaded here
+static int start_worker(int worker_id) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    ERR("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    // as the first workers were forked, before this process took them
+#ifdef DEBUG
+    signal(SIGTERM, gcov_handler);
+#else
+    signal(SIGTERM, SIG_DFL);
+#endif
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    free(worker_pids);
+    free(worker_started);
+    exit(run_worker(worker_id));
+  }
+  worker_pids[worker_id] = pid;
+  worker_started[worker_id] = time(NULL);
+  return 0;
+}
+
+static int run_worker(int worker_id) {
+  metrics_select(worker_id);
+  if (workers == 1)
+    catch_dump_signal();
+  catch_reload_signal();
+#ifdef HAVE_SCHED_SETAFFINITY
+  if (cpu_affinity) {
+    cpu_set_t cpus;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(&cpus);
+    CPU_SET(worker_id % (ncpu > 0 ? ncpu : 1), &cpus);
+    if (0 != sched_setaffinity(0, sizeof(cpus), &cpus))
+      ERR("sched_setaffinity");
+  }
+#endif
+  // a quarter of the queries being held or hedged at once is plenty
+  if (0 != pool_init(&buf_pool, payload_size,
+                     MAX(pool_size / 4, MIN_POOL_BUFS)) ||
+      0 != pending_init(pool_size, &buf_pool, send_delay, expire_pending,
+                        send_hedge, send_stale) ||
+      NULL == (waiter_buf = malloc(payload_size))) {
+    VERR("Can't allocate pending queries\n");
+    return EXIT_FAILURE;
+  }
+  // the cache size is shared by all workers
+  if (0 != cache_init((size_t)cache_size * 1024 / workers, prefetch,
+                      max_stale)) {
+    VERR("Can't allocate cache\n");
     return EXIT_FAILURE;
+  }
+  // a batch of queries fans out to every upstream
+  if (0 != batch_init(batch_size, payload_size, batch_size * dns_servers_len,
+                      gro)) {
+    VERR("Can't allocate batch buffers\n");
+    return EXIT_FAILURE;
+  }
+  if (0 != loop_init()) {
+    ERR("loop_init");
+    return EXIT_FAILURE;
+  }
+  if (0 != log_init(log_sample, log_rate)) {
+    VERR("Can't allocate log queue\n");
+    return EXIT_FAILURE;
+  }
+  if (0 != dns_init_sockets() || 0 != init_reload_pipe())
+    return EXIT_FAILURE;
+  // one worker serves the metrics of all
+  if (worker_id == 0 && metrics_addr && 0 != init_metrics_socket())
+    return EXIT_FAILURE;
+  metrics->pending_size = pool_size;
+  update_route_metrics();
 
-  max_fd = MAX(local_sock, remote_sock) + 1;
   while (1) {
-    FD_ZERO(&readset);
-    FD_ZERO(&errorset);
-    FD_SET(local_sock, &readset);
-    FD_SET(local_sock, &errorset);
-    FD_SET(remote_sock, &readset);
-    FD_SET(remote_sock, &errorset);
-    struct timeval timeout = {
-      .tv_sec = 0,
-      .tv_usec = 50 * 1000,
-    };
-    if (-1 == select(max_fd, &readset, NULL, &errorset, &timeout)) {
-      ERR("select");
+    // sleep until the next delay or expiry is due
+    if (-1 == loop_run_once(timeout_next(timeout_now()))) {
+      ERR("loop_run_once");
       return EXIT_FAILURE;
     }
-    check_and_send_delay();
-    if (FD_ISSET(local_sock, &errorset)) {
-      // TODO getsockopt(..., SO_ERROR, ...);
-      VERR("local_sock error\n");
-      return EXIT_FAILURE;
+    timeout_run(timeout_now());
+    // timers may have queued hedged queries
+    batch_flush();
+    // log lines are written once the packets are out
+    log_flush();
+    update_metrics();
+    if (dump_requested) {
+      dump_requested = 0;
+      metrics_write(stderr);
     }
-    if (FD_ISSET(remote_sock, &errorset)) {
-      // TODO getsockopt(..., SO_ERROR, ...);
-      VERR("remote_sock error\n");
-      return EXIT_FAILURE;
+    if (reload_requested) {
+      reload_requested = 0;
+      reload_routes();
     }
-    if (FD_ISSET(local_sock, &readset))
-      dns_handle_local();
-    if (FD_ISSET(remote_sock, &readset))
-      dns_handle_remote();
   }
   return EXIT_SUCCESS;
 }
 
+static int init_metrics_socket() {
+  struct addrinfo hints;
+  struct addrinfo *addr_ip;
+  char *host, *port;
+  int r;
+  if (strchr(metrics_addr, '/')) {
+    struct sockaddr_un addr;
+    if (strlen(metrics_addr) >= sizeof(addr.sun_path)) {
+      VERR("metrics socket path too long: %s\n", metrics_addr);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, metrics_addr);
+    // left behind by an earlier run
+    unlink(metrics_addr);
+    if (0 != metrics_listen((struct sockaddr *)&addr, sizeof(addr))) {
+      ERR("metrics_listen");
+      return -1;
+    }
+    return 0;
+  }
+  memset(global_buf, 0, BUF_SIZE);
+  strncpy(global_buf, metrics_addr, BUF_SIZE - 1);
+  split_host_port(global_buf, &host, &port);
+  if (port == NULL || *port == '\0') {
+    VERR("metrics address needs a port: %s\n", metrics_addr);
+    return -1;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (0 != (r = getaddrinfo(host, port, &hints, &addr_ip))) {
+    VERR("%s:%s\n", gai_strerror(r), metrics_addr);
+    return -1;
+  }
+  r = metrics_listen(addr_ip->ai_addr, addr_ip->ai_addrlen);
+  freeaddrinfo(addr_ip);
+  if (r != 0) {
+    ERR("metrics_listen");
+    return -1;
+  }
+  return 0;
+}
+
+// what the other modules count, copied once per loop turn
+static void update_metrics() {
+  int i;
+  metrics->pending = pending_count();
+  metrics->pending_dropped = pending_exhausted();
+  metrics->pool_exhausted = buf_pool.exhausted;
+  metrics->cache_evicted = cache_evicted();
+  metrics->cache_skipped = cache_skipped();
+  metrics->log_dropped = log_dropped();
+  metrics->log_limited = log_limited();
+  metrics->truncated = edns_truncated();
+  if (tcp_sock != -1) {
+    metrics->tcp_connections = tcp_count();
+    metrics->tcp_rejected = tcp_rejected();
+    metrics->tcp_dropped = tcp_dropped();
+  }
+  metrics->tls_handshakes = stream_handshakes();
+  metrics->tls_resumed = stream_resumed();
+  for (i = 0; i < dns_servers_len; i++) {
+    metrics->upstreams[i].state = upstreams[i].state;
+    metrics->upstreams[i].srtt = upstreams[i].srtt;
+  }
+}
+
+static void request_dump(int signum) {
+  dump_requested = 1;
+}
+
+static void request_reload(int signum) {
+  reload_requested = 1;
+}
+
+static void catch_dump_signal() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_dump;
+  // no SA_RESTART, so a blocking wait returns and notices
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void catch_reload_signal() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_reload;
+  sigaction(SIGHUP, &sa, NULL);
+}
+
+static int init_reload_pipe() {
+  if (0 != pipe(reload_pipe) || 0 != setnonblock(reload_pipe[0]) ||
+      0 != loop_add(reload_pipe[0], LOOP_READ, swap_routes, NULL)) {
+    ERR("reload pipe");
+    return -1;
+  }
+  return 0;
+}
+
+// parsing and building a large list takes long enough to stall every
+// query, so it's done aside while the loop goes on with the old routes
+static void reload_routes() {
+  pthread_t thread;
+  sigset_t all, old;
+  int r;
+  if (reloading) {
+    reload_again = 1;
+    return;
+  }
+  // signals stay with the loop, whose wait they interrupt
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  reload_started = timeout_now();
+  r = pthread_create(&thread, NULL, load_routes, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    errno = r;
+    ERR("pthread_create");
+    metrics->reload_failures++;
+    return;
+  }
+  pthread_detach(thread);
+  reloading = 1;
+}
+
+static void *load_routes(void *arg) {
+  routes_t *r = routes_load(chnroute_file, ip_list_file, chn_domains_file,
+                            foreign_domains_file);
+  // into an empty pipe, and a pointer is written whole
+  if (sizeof(r) != write(reload_pipe[1], &r, sizeof(r)))
+    ERR("write");
+  return NULL;
+}
+
+// between callbacks, so no lookup is using the old routes and they can be
+// freed right away. on failure the old ones stay
+static void swap_routes(int fd, int events, void *data) {
+  routes_t *r;
+  routes_t *old = routes;
+  if (sizeof(r) != read(fd, &r, sizeof(r)))
+    return;
+  reloading = 0;
+  if (r == NULL) {
+    metrics->reload_failures++;
+    VERR("reload failed, keeping the previous lists\n");
+  } else {
+    routes = r;
+    routes_free(old);
+    metrics->reloads++;
+    update_route_metrics();
+    VERR("reloaded %d chnroute networks, %d IPv6, %d ips, and %d domains in "
+         "%llu ms\n", routes->chnroute.entries, routes->chnroute6.entries,
+         routes->ip_list.entries, routes->domains.entries,
+         (unsigned long long)(timeout_now() - reload_started));
+  }
+  if (reload_again) {
+    reload_again = 0;
+    reload_routes();
+  }
+}
+
+static void update_route_metrics() {
+  metrics->chnroute_entries = routes->chnroute.entries +
+                              routes->chnroute6.entries;
+  metrics->iplist_entries = routes->ip_list.entries;
+  metrics->domains_entries = routes->domains.entries;
+}
+
 static int setnonblock(int sock) {
   int flags;
   flags = fcntl(sock, F_GETFL, 0);
@@ -241,7 +689,7 @@ static int setnonblock(int sock) {
 
 static int parse_args(int argc, char **argv) {
   int ch;
-  while ((ch = getopt(argc, argv, "hb:p:s:l:c:y:dmvV")) != -1) {
+  while ((ch = getopt(argc, argv, "hb:p:s:l:c:D:O:y:A:C:F:X:B:P:M:S:R:E:T:e:w:dmaGHvV")) != -1) {
     switch (ch) {
       case 'h':
         usage();
@@ -261,12 +709,89 @@ static int parse_args(int argc, char **argv) {
       case 'l':
         ip_list_file = strdup(optarg);
         break;
+      case 'D':
+        chn_domains_file = strdup(optarg);
+        break;
+      case 'O':
+        foreign_domains_file = strdup(optarg);
+        break;
       case 'y':
         empty_result_delay = atof(optarg);
         break;
+      case 'A':
+        tls_ca_file = strdup(optarg);
+        break;
+      case 'C':
+        cache_size = atoi(optarg);
+        break;
+      case 'F':
+        prefetch = atof(optarg);
+        break;
+      case 'X':
+        max_stale = atoi(optarg);
+        if (max_stale < 0)
+          max_stale = 0;
+        break;
+      case 'B':
+        batch_size = atoi(optarg);
+        if (batch_size < 1)
+          batch_size = 1;
+        break;
+      case 'P':
+        source_ports = atoi(optarg);
+        if (source_ports < 1)
+          source_ports = 1;
+        break;
+      case 'M':
+        pool_size = atoi(optarg);
+        if (pool_size < 1)
+          pool_size = 1;
+        break;
+      case 'E':
+        payload_size = atoi(optarg);
+        if (payload_size < EDNS_MIN_SIZE)
+          payload_size = EDNS_MIN_SIZE;
+        if (payload_size > UINT16_MAX)
+          payload_size = UINT16_MAX;
+        break;
+      case 'T':
+        tcp_conns = atoi(optarg);
+        if (tcp_conns < 0)
+          tcp_conns = 0;
+        break;
+      case 'e':
+        metrics_addr = strdup(optarg);
+        break;
+      case 'S':
+        log_sample = atoi(optarg);
+        if (log_sample < 1)
+          log_sample = 1;
+        break;
+      case 'R':
+        log_rate = atoi(optarg);
+        if (log_rate < 0)
+          log_rate = 0;
+        break;
+      case 'G':
+        gro = 1;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        if (workers < 1) {
+          // one per CPU
+          long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+          workers = ncpu > 0 ? ncpu : 1;
+        }
+        break;
+      case 'a':
+        cpu_affinity = 1;
+        break;
       case 'd':
         bidirectional = 1;
         break;
+      case 'H':
+        hedge = 1;
+        break;
       case 'm':
         compression = 1;
         break;
@@ -295,11 +820,33 @@ static int parse_args(int argc, char **argv) {
   return 0;
 }
 
+// [2001:db8::1]:53, 8.8.8.8:53, or without the port, in place; port is
+// NULL if there's none
+static void split_host_port(char *s, char **host, char **port) {
+  *host = s;
+  if (s[0] == '[') {
+    (*host)++;
+    *port = strchr(*host, ']');
+    if (*port) {
+      *(*port)++ = '\0';
+      *port = **port == ':' ? *port + 1 : NULL;
+    }
+  } else {
+    *port = strrchr(s, ':');
+    // a bare IPv6 address has more than one colon
+    if (*port && *port != strchr(s, ':'))
+      *port = NULL;
+    else if (*port)
+      *(*port)++ = '\0';
+  }
+}
+
 static int resolve_dns_servers() {
   struct addrinfo hints;
   struct addrinfo *addr_ip;
+  upstream_t *up;
   char* token;
-  int r;
+  int r, chn;
   int i = 0;
   char *pch = strchr(dns_servers, ',');
   has_chn_dns = 0;
@@ -315,53 +862,75 @@ static int resolve_dns_servers() {
     dns_servers_len++;
     pch = strchr(pch + 1, ',');
   }
-  dns_server_addrs = calloc(dns_servers_len, sizeof(id_addr_t));
+  if (dns_servers_len > MAX_DNS_SERVERS) {
+    VERR("At most %d DNS servers are supported\n", MAX_DNS_SERVERS);
+    return -1;
+  }
+  upstreams = calloc(dns_servers_len, sizeof(upstream_t));
 
   memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
+  hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
   token = strtok(dns_servers, ",");
   while (token) {
-    char *port;
+    char *host, *port, *tls_name = NULL;
+    int transport = UPSTREAM_UDP;
+    if (0 == strncmp(token, "tcp://", 6)) {
+      transport = UPSTREAM_TCP;
+      token += 6;
+    } else if (0 == strncmp(token, "tls://", 6)) {
+#ifndef HAVE_TLS
+      VERR("Built without TLS support: %s\n", token);
+      return -1;
+#endif
+      transport = UPSTREAM_TLS;
+      token += 6;
+    }
     memset(global_buf, 0, BUF_SIZE);
     strncpy(global_buf, token, BUF_SIZE - 1);
-    port = (strrchr(global_buf, ':'));
-    if (port) {
-      *port = '\0';
-      port++;
-    } else {
-      port = "53";
+    if (transport == UPSTREAM_TLS) {
+      // the certificate may be for a name other than what's connected to,
+      // as in tls://8.8.8.8#dns.google
+      tls_name = strchr(global_buf, '#');
+      if (tls_name)
+        *tls_name++ = '\0';
     }
-    if (0 != (r = getaddrinfo(global_buf, port, &hints, &addr_ip))) {
+    split_host_port(global_buf, &host, &port);
+    if (port == NULL || *port == '\0')
+      port = transport == UPSTREAM_TLS ? "853" : "53";
+    if (0 != (r = getaddrinfo(host, port, &hints, &addr_ip))) {
       VERR("%s:%s\n", gai_strerror(r), token);
       return -1;
     }
+    chn = chnroute_file && test_addr_in_chnroute(addr_ip->ai_addr);
     if (compression) {
-      if (test_ip_in_list(((struct sockaddr_in *)addr_ip->ai_addr)->sin_addr,
-                          &chnroute_list)) {
-        dns_server_addrs[has_chn_dns].addr = addr_ip->ai_addr;
-        dns_server_addrs[has_chn_dns].addrlen = addr_ip->ai_addrlen;
+      if (chn) {
+        up = &upstreams[has_chn_dns];
         has_chn_dns++;
       } else {
         has_foreign_dns++;
-        dns_server_addrs[dns_servers_len - has_foreign_dns].addr = addr_ip->ai_addr;
-        dns_server_addrs[dns_servers_len - has_foreign_dns].addrlen = addr_ip->ai_addrlen;
+        up = &upstreams[dns_servers_len - has_foreign_dns];
       }
-      token = strtok(0, ",");
     } else {
-      dns_server_addrs[i].addr = addr_ip->ai_addr;
-      dns_server_addrs[i].addrlen = addr_ip->ai_addrlen;
+      up = &upstreams[i];
       i++;
-      token = strtok(0, ",");
       if (chnroute_file) {
-        if (test_ip_in_list(((struct sockaddr_in *)addr_ip->ai_addr)->sin_addr,
-                            &chnroute_list)) {
+        if (chn) {
           has_chn_dns = 1;
         } else {
           has_foreign_dns = 1;
         }
       }
     }
+    upstream_init(up, addr_ip->ai_addr, addr_ip->ai_addrlen, chn, transport);
+    if (chn)
+      chn_mask |= UPSTREAM_BIT(up - upstreams);
+    else
+      foreign_mask |= UPSTREAM_BIT(up - upstreams);
+    if (transport == UPSTREAM_TLS)
+      up->tls_name = strdup(tls_name ? tls_name : host);
+    freeaddrinfo(addr_ip);
+    token = strtok(0, ",");
   }
   if (chnroute_file) {
     if (!(has_chn_dns && has_foreign_dns)) {
@@ -379,536 +948,1023 @@ static int resolve_dns_servers() {
   return 0;
 }
 
-static int cmp_in_addr(const void *a, const void *b) {
-  struct in_addr *ina = (struct in_addr *)a;
-  struct in_addr *inb = (struct in_addr *)b;
-  if (ina->s_addr == inb->s_addr)
-    return 0;
-  if (ina->s_addr > inb->s_addr)
-    return 1;
-  return -1;
-}
-
-static int parse_ip_list() {
-  FILE *fp;
-  char line_buf[32];
-  char *line = NULL;
-  size_t len = sizeof(line_buf);
-  ssize_t read;
-  ip_list.entries = 0;
-  int i = 0;
+static int test_addr_in_chnroute(const struct sockaddr *addr) {
+  if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *ip = &((struct sockaddr_in6 *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(ip)) {
+      struct in_addr ip4;
+      memcpy(&ip4, ip->s6_addr + 12, 4);
+      return test_ip_in_list(ip4, &routes->chnroute);
+    }
+    return test_ip6_in_list(ip, &routes->chnroute6);
+  }
+  return test_ip_in_list(((struct sockaddr_in *)addr)->sin_addr,
+                         &routes->chnroute);
+}
 
-  if (ip_list_file == NULL)
-    return 0;
+static int dns_init_sockets() {
+  struct addrinfo hints;
+  struct addrinfo *addr_ip;
+  int r, i, j;
+  int tls_ready = 0;
 
-  fp = fopen(ip_list_file, "rb");
-  if (fp == NULL) {
-    ERR("fopen");
-    VERR("Can't open ip list: %s\n", ip_list_file);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (0 != (r = getaddrinfo(listen_addr, listen_port, &hints, &addr_ip))) {
+    VERR("%s:%s:%s\n", gai_strerror(r), listen_addr, listen_port);
     return -1;
   }
-  while ((line = fgets(line_buf, len, fp))) {
-    ip_list.entries++;
+  local_sock = socket(addr_ip->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+  if (0 != setnonblock(local_sock))
+    return -1;
+  if (addr_ip->ai_family == AF_INET6) {
+    // :: serves IPv4 clients too, as v4-mapped addresses
+    int off = 0;
+    if (0 != setsockopt(local_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off,
+                        sizeof(off)))
+      ERR("setsockopt");
   }
-
-  ip_list.ips = calloc(ip_list.entries, sizeof(struct in_addr));
-  if (0 != fseek(fp, 0, SEEK_SET)) {
-    VERR("fseek");
+#ifdef SO_REUSEPORT
+  if (workers > 1) {
+    // every worker binds its own socket, the kernel spreads clients
+    int on = 1;
+    if (0 != setsockopt(local_sock, SOL_SOCKET, SO_REUSEPORT, &on,
+                        sizeof(on))) {
+      ERR("setsockopt");
+      return -1;
+    }
+  }
+#endif
+  if (0 != bind(local_sock, addr_ip->ai_addr, addr_ip->ai_addrlen)) {
+    ERR("bind");
+    VERR("Can't bind address %s:%s\n", listen_addr, listen_port);
     return -1;
   }
-  while ((line = fgets(line_buf, len, fp))) {
-    char *sp_pos;
-    sp_pos = strchr(line, '\r');
-    if (sp_pos) *sp_pos = 0;
-    sp_pos = strchr(line, '\n');
-    if (sp_pos) *sp_pos = 0;
-    inet_aton(line, &ip_list.ips[i]);
-    i++;
+  if (tcp_conns && 0 != init_tcp_socket(addr_ip))
+    return -1;
+  freeaddrinfo(addr_ip);
+  if (gro && 0 != batch_enable_gro(local_sock))
+    ERR("UDP_GRO");
+  if (0 != loop_add(local_sock, LOOP_READ, dns_local_cb, NULL)) {
+    ERR("loop_add");
+    return -1;
+  }
+  // the socket a response arrives on tells which upstream sent it, and
+  // the kernel drops datagrams from anyone else
+  for (i = 0; i < dns_servers_len; i++) {
+    upstream_t *up = &upstreams[i];
+    if (up->transport == UPSTREAM_TLS && !tls_ready) {
+      if (0 != stream_tls_init(tls_ca_file)) {
+        VERR("Can't load TLS certificates%s%s\n", tls_ca_file ? " from " : "",
+             tls_ca_file ? tls_ca_file : "");
+        return -1;
+      }
+      tls_ready = 1;
+    }
+    if (up->transport != UPSTREAM_UDP) {
+      // connected on the first query
+      up->stream = stream_new((struct sockaddr *)&up->addr, up->addrlen,
+                              up->tls_name, source_ports, dns_handle_stream,
+                              stream_error, stream_lost, up);
+      if (up->stream == NULL) {
+        VERR("Can't allocate connections to %s\n", up->name);
+        return -1;
+      }
+      continue;
+    }
+    if (0 != upstream_open(up, source_ports)) {
+      ERR("socket");
+      VERR("Can't connect to %s\n", up->name);
+      return -1;
+    }
+    for (j = 0; j < up->socks_len; j++) {
+      if (gro && 0 != batch_enable_gro(up->socks[j]))
+        ERR("UDP_GRO");
+      if (0 != loop_add(up->socks[j], LOOP_READ, dns_remote_cb, up)) {
+        ERR("loop_add");
+        return -1;
+      }
+    }
   }
-
-  qsort(ip_list.ips, ip_list.entries, sizeof(struct in_addr), cmp_in_addr);
-  fclose(fp);
   return 0;
 }
 
-static int cmp_net_mask(const void *a, const void *b) {
-  net_mask_t *neta = (net_mask_t *)a;
-  net_mask_t *netb = (net_mask_t *)b;
-  if (neta->net.s_addr == netb->net.s_addr)
-    return 0;
-  // TODO: pre ntohl
-  if (ntohl(neta->net.s_addr) > ntohl(netb->net.s_addr))
-    return 1;
-  return -1;
-}
-
-static int parse_chnroute() {
-  FILE *fp;
-  char line_buf[32];
-  char *line;
-  size_t len = sizeof(line_buf);
-  ssize_t read;
-  char net[32];
-  chnroute_list.entries = 0;
-  int i = 0;
-
-  if (chnroute_file == NULL) {
-    VERR("CHNROUTE_FILE not specified, CHNRoute is disabled\n");
-    return 0;
+// on the same address as local_sock, for clients retrying truncated
+// answers and those that only speak TCP
+static int init_tcp_socket(const struct addrinfo *addr_ip) {
+  int on = 1;
+  tcp_sock = socket(addr_ip->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  if (tcp_sock == -1) {
+    ERR("socket");
+    return -1;
   }
-
-  fp = fopen(chnroute_file, "rb");
-  if (fp == NULL) {
-    ERR("fopen");
-    VERR("Can't open chnroute: %s\n", chnroute_file);
+  if (0 != setnonblock(tcp_sock))
     return -1;
+  // a restart shouldn't have to wait for old connections to time out
+  if (0 != setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+    ERR("setsockopt");
+  if (addr_ip->ai_family == AF_INET6) {
+    int off = 0;
+    if (0 != setsockopt(tcp_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off,
+                        sizeof(off)))
+      ERR("setsockopt");
   }
-  while ((line = fgets(line_buf, len, fp))) {
-    chnroute_list.entries++;
+#ifdef SO_REUSEPORT
+  if (workers > 1 &&
+      0 != setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+    ERR("setsockopt");
+    return -1;
   }
-
-  chnroute_list.nets = calloc(chnroute_list.entries, sizeof(net_mask_t));
-  if (0 != fseek(fp, 0, SEEK_SET)) {
-    VERR("fseek");
+#endif
+  if (0 != bind(tcp_sock, addr_ip->ai_addr, addr_ip->ai_addrlen) ||
+      0 != listen(tcp_sock, SOMAXCONN)) {
+    ERR("bind");
+    VERR("Can't listen on TCP %s:%s\n", listen_addr, listen_port);
     return -1;
   }
-  while ((line = fgets(line_buf, len, fp))) {
-    char *sp_pos;
-    sp_pos = strchr(line, '\r');
-    if (sp_pos) *sp_pos = 0;
-    sp_pos = strchr(line, '\n');
-    if (sp_pos) *sp_pos = 0;
-    sp_pos = strchr(line, '/');
-    if (sp_pos) {
-      *sp_pos = 0;
-      chnroute_list.nets[i].mask = (1 << (32 - atoi(sp_pos + 1))) - 1;
-    } else {
-      chnroute_list.nets[i].mask = UINT32_MAX;
-    }
-    if (0 == inet_aton(line, &chnroute_list.nets[i].net)) {
-      VERR("invalid addr %s in %s:%d\n", line, chnroute_file, i + 1);
-      return 1;
+  if (0 != tcp_init(tcp_sock, tcp_conns, TCP_IDLE_TIMEOUT * 1000,
+                    dns_handle_tcp)) {
+    ERR("tcp_init");
+    return -1;
+  }
+  return 0;
+}
+
+static void dns_local_cb(int fd, int events, void *data) {
+  if (events & LOOP_ERROR) {
+    // TODO getsockopt(..., SO_ERROR, ...);
+    VERR("local_sock error\n");
+    exit(EXIT_FAILURE);
+  }
+  if (0 != batch_recv(fd, dns_handle_local, NULL))
+    ERR("recvfrom");
+}
+
+static void dns_remote_cb(int fd, int events, void *data) {
+  upstream_t *up = data;
+  if (events & LOOP_ERROR) {
+    // an ICMP error from a connected upstream, reading it clears it
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) && err) {
+      LOG("upstream %s: %s\n", up->name, strerror(err));
+      metrics->upstreams[up - upstreams].errors++;
+      upstream_on_loss(up, timeout_now());
     }
-    i++;
   }
+  if (0 != batch_recv(fd, dns_handle_remote, up) && errno != ECONNREFUSED)
+    ERR("recvfrom");
+}
 
-  qsort(chnroute_list.nets, chnroute_list.entries, sizeof(net_mask_t),
-        cmp_net_mask);
+static void dns_handle_stream(char *buf, size_t len, void *data) {
+  char *answer_buf;
+  // too long to hold, so it can only say the client should retry
+  if (len > payload_size)
+    len = edns_fit(buf, len, NULL, payload_size, payload_size);
+  if (len > payload_size)
+    return;
+  // the answer may be passed on from a buffer that outlives the
+  // connection's
+  if ((answer_buf = batch_buf()) == NULL)
+    return;
+  memcpy(answer_buf, buf, len);
+  dns_handle_remote(answer_buf, len, NULL, 0, data);
+}
 
-  fclose(fp);
-  return 0;
+static void stream_error(void *data) {
+  upstream_t *up = data;
+  LOG("upstream %s: connection failed\n", up->name);
+  metrics->upstreams[up - upstreams].errors++;
+  upstream_on_loss(up, timeout_now());
 }
 
-static int test_ip_in_list(struct in_addr ip, const net_list_t *netlist) {
-  // binary search
-  int l = 0, r = netlist->entries - 1;
-  int m, cmp;
-  if (netlist->entries == 0)
-    return 0;
-  net_mask_t ip_net;
-  ip_net.net = ip;
-  while (l != r) {
-    m = (l + r) / 2;
-    cmp = cmp_net_mask(&ip_net, &netlist->nets[m]);
-    if (cmp == -1) {
-      if (r != m)
-        r = m;
-      else
-        break;
-    } else {
-      if (l != m)
-        l = m;
-      else
-        break;
-    }
-    DLOG("l=%d, r=%d\n", l, r);
-    DLOG("%s, %d\n", inet_ntoa(netlist->nets[m].net),
-         netlist->nets[m].mask);
+// the failed connection was counted by stream_error, so the query only
+// stops waiting for this upstream, as if it had answered
+static void stream_lost(uint16_t id, void *data) {
+  upstream_t *up = data;
+  uint64_t bit = UPSTREAM_BIT(up - upstreams);
+  pending_t *pending = pending_lookup(id);
+  if (pending == NULL || !(pending->sent_mask & bit) ||
+      (pending->answered_mask & bit))
+    return;
+  pending->answered_mask |= bit;
+  metrics->upstreams[up - upstreams].losses++;
+  if (--pending->remaining <= 0 && timeout_pending(&pending->hedge_timeout))
+    send_hedge(pending);
+  if (pending->remaining <= 0)
+    finish_pending(pending);
+}
+
+static void dns_handle_local(char *buf, size_t len, struct sockaddr *src_addr,
+                             socklen_t src_addrlen, void *data) {
+  dns_handle_query(buf, len, src_addr, src_addrlen, 0);
+}
+
+static void dns_handle_tcp(char *buf, size_t len, struct sockaddr *src_addr,
+                           socklen_t src_addrlen, uint32_t conn) {
+  char *query_buf;
+  if (len > payload_size) {
+    metrics->malformed++;
+    tcp_drop(conn);
+    return;
   }
-  DLOG("result: %x\n",
-       (ntohl(netlist->nets[l].net.s_addr) ^ ntohl(ip.s_addr)));
-  DLOG("mask: %x\n", (UINT32_MAX - netlist->nets[l].mask));
-  if ((ntohl(netlist->nets[l].net.s_addr) ^ ntohl(ip.s_addr)) &
-      (UINT32_MAX ^ netlist->nets[l].mask)) {
-    return 0;
+  metrics->tcp_queries++;
+  // the query is forwarded from a buffer that outlives the connection's
+  if ((query_buf = batch_buf()) == NULL) {
+    tcp_drop(conn);
+    return;
   }
-  return 1;
+  memcpy(query_buf, buf, len);
+  dns_handle_query(query_buf, len, src_addr, src_addrlen, conn);
 }
 
-static int dns_init_sockets() {
-  struct addrinfo hints;
-  struct addrinfo *addr_ip;
-  int r;
+// conn is the TCP connection the query came on, 0 for UDP. buf is
+// modified and must stay valid until the sends are flushed
+static void dns_handle_query(char *buf, size_t len, struct sockaddr *src_addr,
+                             socklen_t src_addrlen, uint32_t conn) {
+  pending_t *pending;
+  uint16_t query_id;
+  size_t cached_len, keylen;
+  unsigned char key[PENDING_KEY_LEN];
+  char *reply_buf;
+  int cached;
+  log_record_t *rec;
+  // the handlers don't call each other, so each needs just one
+  static local_ns_msg msg;
+  if (local_ns_parse((const u_char *)buf, len, &msg) < 0) {
+    ERR("local_ns_parse");
+    metrics->malformed++;
+    if (conn)
+      tcp_drop(conn);
+    return;
+  }
+  metrics->queries++;
+  // parse DNS query id
+  query_id = msg.id;
+  if ((rec = begin_query_log(LOG_REQUEST, &msg, query_id)))
+    log_commit(rec);
+
+  // answer from cache without bothering upstreams
+  if ((reply_buf = batch_buf()) == NULL) {
+    if (conn)
+      tcp_drop(conn);
+    return;
+  }
+  cached_len = cache_lookup(&msg, reply_buf, payload_size, &cached);
+  if (cached_len > 0 && !(cached & CACHE_STALE)) {
+    metrics->cache_hits++;
+    if ((rec = begin_query_log(LOG_CACHED, &msg, query_id)))
+      log_commit(rec);
+    send_reply(conn, edns_payload_size(&msg), reply_buf, cached_len, NULL,
+               src_addr, src_addrlen);
+    if (cached & CACHE_PREFETCH)
+      prefetch_query(buf, len, &msg, src_addr, src_addrlen);
+    return;
+  }
 
-  local_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (0 != setnonblock(local_sock))
-    return -1;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  if (0 != (r = getaddrinfo(listen_addr, listen_port, &hints, &addr_ip))) {
-    VERR("%s:%s:%s\n", gai_strerror(r), listen_addr, listen_port);
-    return -1;
+  // the same question is already out
+  keylen = query_key(&msg, key);
+  if (keylen && (pending = pending_find(key, keylen)) &&
+      0 == join_pending(pending, &msg, src_addr, src_addrlen, conn)) {
+    if (cached_len > 0)
+      hold_stale(pending, reply_buf, cached_len);
+    return;
   }
-  if (0 != bind(local_sock, addr_ip->ai_addr, addr_ip->ai_addrlen)) {
-    ERR("bind");
-    VERR("Can't bind address %s:%s\n", listen_addr, listen_port);
-    return -1;
+
+  // assign a new id
+  pending = pending_add(query_id, src_addr, src_addrlen, 0);
+  if (pending == NULL) {
+    static time_t last_warned = 0;
+    // once a second is enough when overloaded
+    if (time(NULL) != last_warned) {
+      last_warned = time(NULL);
+      VERR("too many pending queries, dropping %s (%lu dropped)\n",
+           hostname_from_question(&msg), pending_exhausted());
+    }
+    if (conn)
+      tcp_drop(conn);
+    return;
   }
-  freeaddrinfo(addr_ip);
-  remote_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (0 != setnonblock(remote_sock))
+  pending->conn = conn;
+  pending->edns = edns_payload_size(&msg);
+  pending->cache_bits = cache_query_bits(&msg);
+  if (keylen)
+    pending_set_key(pending, key, keylen);
+  if (0 != send_query(pending, buf, len, &msg))
+    return;
+  // the expired answer is for when no fresh one comes in time
+  if (cached_len > 0)
+    hold_stale(pending, reply_buf, cached_len);
+}
+
+// forward buf, the query of pending parsed as msg, to upstreams. buf is
+// modified and must stay valid until the sends are flushed. -1 if pending
+// had to be removed instead
+static int send_query(pending_t *pending, char *buf, size_t len,
+                       const local_ns_msg *msg) {
+  uint64_t now, mask;
+  pending->group = query_group(msg);
+  if (pending->group == DOMAINS_CHN)
+    metrics->routed_chn++;
+  else if (pending->group == DOMAINS_FOREIGN)
+    metrics->routed_foreign++;
+  now = timeout_now();
+  // a query that could never expire would hold its pending entry forever
+  if (0 != timeout_add(&pending->expire_timeout,
+                       now + PENDING_TIMEOUT * 1000)) {
+    ERR("timeout_add");
+    remove_pending(pending);
     return -1;
+  }
+  uint16_t ns_new_id = htons(pending->id);
+  memcpy(buf, &ns_new_id, 2);
+  // upstreams answer in full whatever the client takes; answers are cut
+  // down for it on the way back. the query buffer is payload_size long
+  if (pending->edns || payload_size > EDNS_MIN_SIZE)
+    len = edns_set_payload_size(buf, len, payload_size, msg, payload_size);
+  mask = select_upstreams(pending->group, now, &pending->hedge_mask);
+  pending->sent_at = now;
+  forward_query(pending, mask, buf, len);
+  if (pending->hedge_mask) {
+    pending->query_buf = pool_get(&buf_pool);
+    if (pending->query_buf == NULL) {
+      // nothing to hedge with, fan out now
+      pending->hedged_at = now;
+      forward_query(pending, pending->hedge_mask, buf, len);
+      return 0;
+    }
+    memcpy(pending->query_buf, buf, len);
+    pending->query_buflen = len;
+    // fanned out now if the hedge can't be timed
+    if (0 != timeout_add(&pending->hedge_timeout, now + hedge_delay(mask)))
+      send_hedge(pending);
+  }
   return 0;
 }
 
-static void dns_handle_local() {
-  struct sockaddr *src_addr = malloc(sizeof(struct sockaddr));
-  socklen_t src_addrlen = sizeof(struct sockaddr);
-  uint16_t query_id;
-  ssize_t len;
+// ask again for a cached answer that is about to expire, so it's replaced
+// before anyone has to wait. the client already has its answer, and buf
+// is the query it sent
+static void prefetch_query(char *buf, size_t len, const local_ns_msg *msg,
+                           struct sockaddr *src_addr, socklen_t src_addrlen) {
+  pending_t *pending;
+  // nothing is lost if there's no room, the entry is just not refreshed
+  if (NULL == (pending = pending_add(msg->id, src_addr, src_addrlen, 0)))
+    return;
+  pending->replied = 1;
+  pending->edns = edns_payload_size(msg);
+  pending->cache_bits = cache_query_bits(msg);
+  metrics->prefetches++;
+  send_query(pending, buf, len, msg);
+}
+
+static uint64_t select_upstreams(int group, uint64_t now, uint64_t *later) {
+  uint64_t allowed = group_mask(group);
+  uint64_t up_mask = 0, mask = 0;
+  int i, best_chn = -1, best_foreign = -1;
+  for (i = 0; i < dns_servers_len; i++) {
+    int state;
+    if (!(allowed & UPSTREAM_BIT(i)))
+      continue;
+    state = upstream_check(&upstreams[i], now);
+    // a probe goes out right away
+    if (state == UPSTREAM_PROBING)
+      mask |= UPSTREAM_BIT(i);
+    else if (state == UPSTREAM_UP)
+      up_mask |= UPSTREAM_BIT(i);
+  }
+  *later = 0;
+  if (hedge) {
+    for (i = 0; i < dns_servers_len; i++) {
+      int *best = upstreams[i].chn ? &best_chn : &best_foreign;
+      if (!(up_mask & UPSTREAM_BIT(i)))
+        continue;
+      if (*best == -1 ||
+          upstream_score(&upstreams[i]) < upstream_score(&upstreams[*best]))
+        *best = i;
+    }
+    if (best_chn != -1)
+      mask |= UPSTREAM_BIT(best_chn);
+    if (best_foreign != -1)
+      mask |= UPSTREAM_BIT(best_foreign);
+    *later = up_mask & ~mask;
+  } else {
+    mask |= up_mask;
+  }
+  // everything is down, keep trying all of them
+  if (mask == 0)
+    mask = allowed;
+  return mask;
+}
+
+// who a name in a domain list of group is asked of; everyone if the list
+// is for a side that has no upstreams
+static uint64_t group_mask(int group) {
+  if (group == DOMAINS_CHN && chn_mask)
+    return chn_mask;
+  if (group == DOMAINS_FOREIGN && foreign_mask)
+    return foreign_mask;
+  return UINT64_MAX >> (64 - dns_servers_len);
+}
+
+static int query_group(const local_ns_msg *msg) {
+  unsigned char name[NS_MAXCDNAME];
+  if (routes->domains.entries == 0 || msg->counts[ns_s_qd] != 1 ||
+      -1 == local_ns_name_unpack(msg, local_ns_section(msg, ns_s_qd)->name,
+                                 name))
+    return DOMAINS_NONE;
+  return domains_lookup(&routes->domains, name);
+}
+
+static int hedge_delay(uint64_t mask) {
+  int i, delay = HEDGE_MIN;
+  for (i = 0; i < dns_servers_len; i++) {
+    int p;
+    if (!(mask & UPSTREAM_BIT(i)))
+      continue;
+    p = upstream_percentile(&upstreams[i], HEDGE_PERCENTILE, 1);
+    if (p == -1)
+      p = HEDGE_DEFAULT;
+    if (p > delay)
+      delay = p;
+  }
+  return delay;
+}
+
+// buf must stay valid until the sends are flushed
+static void forward_query(pending_t *pending, uint64_t mask, char *buf,
+                          size_t len) {
+  char *compression_buf = NULL;
+  size_t compression_len = 0;
   int i;
-  int sended = 0;
-  const char *question_hostname;
-  ns_msg msg;
-  len = recvfrom(local_sock, global_buf, BUF_SIZE, 0, src_addr, &src_addrlen);
-  if (len > 0) {
-    if (local_ns_initparse((const u_char *)global_buf, len, &msg) < 0) {
-      ERR("local_ns_initparse");
-      free(src_addr);
-      return;
+  // sent as it is if there's no buffer to mutate it in
+  if (compression && (compression_buf = batch_buf()))
+    compression_len = mutate_query(buf, len, compression_buf);
+  for (i = 0; i < dns_servers_len; i++) {
+    upstream_t *up = &upstreams[i];
+    char *out = buf;
+    size_t out_len = len;
+    if (!(mask & UPSTREAM_BIT(i)))
+      continue;
+    // nothing reads queries to TLS upstreams on the way to fool
+    if (compression_len && !up->chn && up->transport != UPSTREAM_TLS) {
+      out = compression_buf;
+      out_len = compression_len;
     }
-    // parse DNS query id
-    // TODO generate id for each request to avoid conflicts
-    query_id = ns_msg_id(msg);
-    question_hostname = hostname_from_question(msg);
-    LOG("request %s\n", question_hostname);
-
-    // assign a new id
-    uint16_t new_id;
-    do {
-      struct timeval tv;
-      gettimeofday(&tv, 0);
-      int randombits = (tv.tv_sec << 8) ^ tv.tv_usec;
-      new_id = randombits & 0xffff;
-    } while (queue_lookup(new_id));
-
-    uint16_t ns_new_id = htons(new_id);
-    memcpy(global_buf, &ns_new_id, 2);
-
-    id_addr_t id_addr;
-    id_addr.id = new_id;
-    id_addr.old_id = query_id;
-
-    id_addr.addr = src_addr;
-    id_addr.addrlen = src_addrlen;
-    queue_add(id_addr);
-    if (compression) {
-      if (len > 16) {
-        size_t off = 12;
-        int ended = 0;
-        while (off < len - 4) {
-          if (global_buf[off] & 0xc0)
-            break;
-          if (global_buf[off] == 0) {
-            ended = 1;
-            off ++;
-            break;
-          }
-          off += 1 + global_buf[off];
-        }
-        if (ended) {
-          memcpy(compression_buf, global_buf, off-1);
-          memcpy(compression_buf + off + 1, global_buf + off, len - off);
-          compression_buf[off-1] = '\xc0';
-          compression_buf[off] = '\x04';
-          for (i = 0; i < has_chn_dns; i++) {
-            if (-1 == sendto(remote_sock, global_buf, len, 0,
-                             dns_server_addrs[i].addr,
-                             dns_server_addrs[i].addrlen))
-              ERR("sendto");
-          }
-          for (i =  has_chn_dns; i < dns_servers_len; i++) {
-            if (-1 == sendto(remote_sock, compression_buf, len + 1, 0,
-                             dns_server_addrs[i].addr,
-                             dns_server_addrs[i].addrlen))
-              ERR("sendto");
-            sended = 1;
-          }
-        }
+    if (up->stream) {
+      // while reconnecting backs off there's no one to wait for. a
+      // connection that failed to open is counted by stream_error, which
+      // ends a probe, so only a probe that found none to take it is
+      // counted here, once, to be retried
+      if (0 != stream_send(up->stream, out, out_len)) {
+        mask &= ~UPSTREAM_BIT(i);
+        if (up->state == UPSTREAM_PROBING)
+          upstream_on_loss(up, timeout_now());
       }
+    } else {
+      batch_send(upstream_sock(up), out, out_len, NULL, 0);
     }
-    if (!sended) {
-      for (i = 0; i < dns_servers_len; i++) {
-        if (-1 == sendto(remote_sock, global_buf, len, 0,
-                         dns_server_addrs[i].addr,
-                         dns_server_addrs[i].addrlen))
-          ERR("sendto");
-      }
+  }
+  pending->sent_mask |= mask;
+  pending->remaining += __builtin_popcountll(mask);
+}
+
+// the query with a compression pointer in place of the question's
+// terminator, 0 if it can't be mutated
+static size_t mutate_query(const char *buf, size_t len, char *out) {
+  size_t off = 12;
+  int ended = 0;
+  if (len <= 16 || len >= payload_size)
+    return 0;
+  while (off < len - 4) {
+    if (buf[off] & 0xc0)
+      break;
+    if (buf[off] == 0) {
+      ended = 1;
+      off ++;
+      break;
     }
+    off += 1 + buf[off];
   }
-  else
-    ERR("recvfrom");
+  if (!ended)
+    return 0;
+  memcpy(out, buf, off-1);
+  memcpy(out + off + 1, buf + off, len - off);
+  out[off-1] = '\xc0';
+  out[off] = '\x04';
+  return len + 1;
 }
 
-static void dns_handle_remote() {
-  struct sockaddr *src_addr = malloc(sizeof(struct sockaddr));
-  socklen_t src_len = sizeof(struct sockaddr);
+static void send_hedge(void *data) {
+  pending_t *pending = data;
+  char *buf;
+  // also called directly when the first upstreams are done early
+  timeout_del(&pending->hedge_timeout);
+  if (pending->query_buf == NULL)
+    return;
+  // the pending query may be gone before the sends are flushed
+  if ((buf = batch_buf()) != NULL) {
+    memcpy(buf, pending->query_buf, pending->query_buflen);
+    pending->hedged_at = timeout_now();
+    metrics->hedges++;
+    forward_query(pending, pending->hedge_mask, buf, pending->query_buflen);
+  }
+  pool_put(&buf_pool, pending->query_buf);
+  pending->query_buf = NULL;
+}
+
+static void dns_handle_remote(char *buf, size_t len, struct sockaddr *src_addr,
+                              socklen_t src_len, void *data) {
+  upstream_t *upstream = data;
   uint16_t query_id;
-  ssize_t len;
-  const char *question_hostname;
   int r;
-  ns_msg msg;
-  len = recvfrom(remote_sock, global_buf, BUF_SIZE, 0, src_addr, &src_len);
-  if (len > 0) {
-    if (local_ns_initparse((const u_char *)global_buf, len, &msg) < 0) {
-      ERR("local_ns_initparse");
-      free(src_addr);
-      return;
+  int verdict = LOG_SKIP;
+  log_record_t *rec;
+  static local_ns_msg msg;
+  if (local_ns_parse((const u_char *)buf, len, &msg) < 0) {
+    ERR("local_ns_parse");
+    metrics->malformed++;
+    return;
+  }
+  // parse DNS query id
+  query_id = msg.id;
+  pending_t *pending = pending_lookup(query_id);
+  // sampled by the client's id, like the request
+  rec = begin_query_log(LOG_RESPONSE, &msg,
+                        pending ? pending->old_id : query_id);
+  if (rec)
+    rec->from = upstream->name;
+  uint64_t bit = UPSTREAM_BIT(upstream - upstreams);
+  // each upstream answers a query once, but a filtered or suspect answer
+  // may have been injected on the way, ahead of the upstream's own
+  if (pending && (pending->sent_mask & bit) &&
+      (!(pending->answered_mask & bit) || (pending->suspect_mask & bit))) {
+    struct sockaddr *addr = (struct sockaddr *)&pending->addr;
+    uint16_t ns_old_id = htons(pending->old_id);
+    int first = !(pending->answered_mask & bit);
+    if (first) {
+      uint64_t rtt = timeout_now() -
+                     ((pending->hedge_mask & bit) ? pending->hedged_at :
+                                                    pending->sent_at);
+      pending->answered_mask |= bit;
+      upstream_on_answer(upstream, rtt);
+      metrics_on_answer(upstream - upstreams, rtt);
     }
-    // parse DNS query id
-    query_id = ns_msg_id(msg);
-    question_hostname = hostname_from_question(msg);
-    if (question_hostname) {
-      LOG("response %s from %s:%d - ", question_hostname,
-          inet_ntoa(((struct sockaddr_in *)src_addr)->sin_addr),
-          htons(((struct sockaddr_in *)src_addr)->sin_port));
-    }
-    id_addr_t *id_addr = queue_lookup(query_id);
-    if (id_addr) {
-      id_addr->addr->sa_family = AF_INET;
-      uint16_t ns_old_id = htons(id_addr->old_id);
-      memcpy(global_buf, &ns_old_id, 2);
-      r = should_filter_query(msg, ((struct sockaddr_in *)src_addr)->sin_addr);
-      if (r == 0) {
-        if (verbose)
-          printf("pass\n");
-        if (-1 == sendto(local_sock, global_buf, len, 0, id_addr->addr,
-                         id_addr->addrlen))
-          ERR("sendto");
-      } else if (r == -1) {
-        schedule_delay(query_id, global_buf, len, id_addr->addr,
-                       id_addr->addrlen);
-        if (verbose)
-          printf("delay\n");
-      } else {
-        if (verbose)
-          printf("filter\n");
+    memcpy(buf, &ns_old_id, 2);
+    r = should_filter_query(&msg, upstream, pending->group, rec);
+    if (r == 0)
+      pending->suspect_mask &= ~bit;
+    else
+      pending->suspect_mask |= bit;
+    if (r == 0) {
+      verdict = LOG_PASS;
+      // cached before it's cut down for the client
+      cache_put(&msg, pending->cache_bits);
+      // a client takes the first answer, and on TCP another one with the
+      // same id would be taken for the answer to a later query
+      if (!pending->replied) {
+        // buf is cut down for the client, and may be reused for the
+        // waiters' copies
+        int share = pending->waiters && len <= payload_size;
+        if (share)
+          memcpy(waiter_buf, buf, len);
+        send_reply(pending->conn, pending->edns, buf, len, &msg, addr,
+                   pending->addrlen);
+        if (share)
+          reply_waiters(pending, waiter_buf, len, &msg);
+      }
+      pending->replied = 1;
+      // answered, no need to ask anyone else, and a held suspect
+      // answer would come too late
+      timeout_del(&pending->hedge_timeout);
+      if (pending->query_buf)
+        pool_put(&buf_pool, pending->query_buf);
+      pending->query_buf = NULL;
+      timeout_del(&pending->delay_timeout);
+      if (pending->delay_buf) {
+        pool_put(&buf_pool, pending->delay_buf);
+        pending->delay_buf = NULL;
+        metrics->held--;
       }
+      timeout_del(&pending->stale_timeout);
+      if (pending->stale_buf)
+        pool_put(&buf_pool, pending->stale_buf);
+      pending->stale_buf = NULL;
+    } else if (r == -1) {
+      // nothing to hold once the client has its answer, and a suspect
+      // answer is never cached
+      if (!pending->replied)
+        schedule_delay(pending, buf, len);
+      verdict = LOG_DELAY;
     } else {
-      if (verbose)
-        printf("skip\n");
+      verdict = LOG_FILTER;
     }
-    free(src_addr);
+    // nothing usable from the first upstreams, ask the rest right away
+    if (first && --pending->remaining <= 0 &&
+        timeout_pending(&pending->hedge_timeout))
+      send_hedge(pending);
+    if (pending->remaining <= 0)
+      finish_pending(pending);
   }
+  metrics->verdicts[verdict]++;
+  if (rec) {
+    rec->verdict = verdict;
+    log_commit(rec);
+  }
+}
+
+// buf is modified and must stay valid until the sends are flushed. msg
+// indexes it, or is NULL
+static void send_reply(uint32_t conn, int edns, char *buf, size_t len,
+                       const local_ns_msg *msg, const struct sockaddr *addr,
+                       socklen_t addrlen) {
+  len = fit_reply(conn, edns, buf, len, msg);
+  if (conn)
+    tcp_send(conn, buf, len);
   else
-    ERR("recvfrom");
+    batch_send(local_sock, buf, len, addr, addrlen);
 }
 
-static void queue_add(id_addr_t id_addr) {
-  id_addr_queue_pos = (id_addr_queue_pos + 1) % ID_ADDR_QUEUE_LEN;
-  // free next hole
-  id_addr_t old_id_addr = id_addr_queue[id_addr_queue_pos];
-  free(old_id_addr.addr);
-  id_addr_queue[id_addr_queue_pos] = id_addr;
+// the question and what else the answer depends on, 0 if the query can't
+// be shared
+static size_t query_key(const local_ns_msg *msg, unsigned char *key) {
+  const local_ns_rr *rr = local_ns_section(msg, ns_s_qd);
+  int len, flags;
+  if (msg->counts[ns_s_qd] != 1 || (msg->flags & 0xf800) != 0 ||
+      -1 == (flags = edns_flags(msg)) ||
+      -1 == (len = local_ns_name_unpack(msg, rr->name, key)))
+    return 0;
+  // the name as spelled, since every waiter gets the question back as
+  // the first client asked it, and some check its case, as in 0x20
+  memcpy(key + len, &rr->type, 2);
+  memcpy(key + len + 2, &rr->rr_class, 2);
+  // RD and CD from the header, DO from the OPT record
+  key[len + 4] = (msg->flags & 0x0110) >> 4;
+  key[len + 5] = flags >> 8;
+  return len + 6;
 }
 
-static id_addr_t *queue_lookup(uint16_t id) {
-  int i;
-  for (i = 0; i < ID_ADDR_QUEUE_LEN; i++) {
-    if (id_addr_queue[i].id == id)
-      return id_addr_queue + i;
+// 0 if the client waits for pending's answer, -1 if it has to ask on its
+// own
+static int join_pending(pending_t *pending, const local_ns_msg *msg,
+                        const struct sockaddr *addr, socklen_t addrlen,
+                        uint32_t conn) {
+  waiter_t *w;
+  // a UDP client retrying is already waiting. over TCP, every query is
+  // answered
+  if (!conn && !pending->conn && pending->old_id == msg->id &&
+      pending->addrlen == addrlen && 0 == memcmp(&pending->addr, addr,
+                                                 addrlen))
+    return 0;
+  for (w = pending->waiters; w && !conn; w = w->next) {
+    if (!w->conn && w->old_id == msg->id && w->addrlen == addrlen &&
+        0 == memcmp(&w->addr, addr, addrlen))
+      return 0;
   }
-  return NULL;
+  w = pending_add_waiter(pending, msg->id, addr, addrlen);
+  if (w == NULL)
+    return -1;
+  w->conn = conn;
+  w->edns = edns_payload_size(msg);
+  metrics->coalesced++;
+  return 0;
 }
 
-static char *hostname_buf = NULL;
-static size_t hostname_buflen = 0;
-static const char *hostname_from_question(ns_msg msg) {
-  ns_rr rr;
-  int rrnum, rrmax;
-  const char *result;
-  int result_len;
-  rrmax = ns_msg_count(msg, ns_s_qd);
-  if (rrmax == 0)
-    return NULL;
-  for (rrnum = 0; rrnum < rrmax; rrnum++) {
-    if (local_ns_parserr(&msg, ns_s_qd, rrnum, &rr)) {
-      ERR("local_ns_parserr");
-      return NULL;
-    }
-    result = ns_rr_name(rr);
-    result_len = strlen(result) + 1;
-    if (result_len > hostname_buflen) {
-      hostname_buflen = result_len << 1;
-      hostname_buf = realloc(hostname_buf, hostname_buflen);
-    }
-    memcpy(hostname_buf, result, result_len);
-    return hostname_buf;
+// buf to everyone waiting on pending but its own client, each with their
+// id. buf isn't touched, and must not change until all copies are made
+static void reply_waiters(pending_t *pending, const char *buf, size_t len,
+                          const local_ns_msg *msg) {
+  waiter_t *w;
+  for (w = pending->waiters; w; w = w->next) {
+    char *copy = batch_buf();
+    uint16_t id = htons(w->old_id);
+    if (copy == NULL)
+      break;
+    memcpy(copy, buf, len);
+    memcpy(copy, &id, 2);
+    send_reply(w->conn, w->edns, copy, len, msg, (struct sockaddr *)&w->addr,
+               w->addrlen);
   }
-  return NULL;
 }
 
-static int should_filter_query(ns_msg msg, struct in_addr dns_addr) {
-  ns_rr rr;
-  int rrnum, rrmax;
-  void *r;
-  // TODO cache result for each dns server
-  int dns_is_chn = 0;
-  int dns_is_foreign = 0;
-  if (chnroute_file && (dns_servers_len > 1)) {
-    dns_is_chn = test_ip_in_list(dns_addr, &chnroute_list);
-    dns_is_foreign = !dns_is_chn;
-  }
-  rrmax = ns_msg_count(msg, ns_s_an);
-  if (rrmax == 0) {
-    if (compression) {
-      // Wait for foreign dns
-      if (dns_is_chn) {
-        return 1;
-      } else {
-        return 0;
-      }
-    }
-    return -1;
-  }
-  for (rrnum = 0; rrnum < rrmax; rrnum++) {
-    if (local_ns_parserr(&msg, ns_s_an, rrnum, &rr)) {
-      ERR("local_ns_parserr");
-      return 0;
-    }
-    u_int type;
-    const u_char *rd;
-    type = ns_rr_type(rr);
-    rd = ns_rr_rdata(rr);
-    if (type == ns_t_a) {
-      if (verbose)
-        printf("%s, ", inet_ntoa(*(struct in_addr *)rd));
-      if (!compression) {
-        r = bsearch(rd, ip_list.ips, ip_list.entries, sizeof(struct in_addr),
-                    cmp_in_addr);
-        if (r) {
-          return 1;
-        }
-      }
-      if (test_ip_in_list(*(struct in_addr *)rd, &chnroute_list)) {
-        // result is chn
-        if (dns_is_foreign) {
-          if (bidirectional) {
-            // filter DNS result from foreign dns if result is inside chn
-            return 1;
-          }
-        }
-      } else {
-        // result is foreign
-        if (dns_is_chn) {
-          // filter DNS result from chn dns if result is outside chn
-          return 1;
-        }
-      }
-    } else if (type == ns_t_aaaa || type == ns_t_ptr) {
-      // if we've got an IPv6 result or a PTR result, pass
-      return 0;
+// to what a client that advertised edns takes, over TCP or UDP
+static size_t fit_reply(uint32_t conn, int edns, char *buf, size_t len,
+                        const local_ns_msg *msg) {
+  return edns_fit(buf, len, msg, edns,
+                  conn ? UINT16_MAX : MAX(edns, EDNS_MIN_SIZE));
+}
+
+static const char *hostname_from_question(const local_ns_msg *msg) {
+  static char hostname_buf[NS_MAXDNAME];
+  unsigned char name[NS_MAXCDNAME];
+  if (msg->counts[ns_s_qd] == 0)
+    return NULL;
+  if (-1 == local_ns_name_unpack(msg, local_ns_section(msg, ns_s_qd)->name,
+                                 name) ||
+      -1 == local_ns_name_ntop(name, hostname_buf, sizeof(hostname_buf)))
+    return "<malformed>";
+  return hostname_buf;
+}
+
+static log_record_t *begin_query_log(int event, const local_ns_msg *msg,
+                                     uint16_t id) {
+  log_record_t *rec;
+  if (!log_sampled(id))
+    return NULL;
+  if (NULL == (rec = log_begin(event)))
+    return NULL;
+  // the name is only spelled out when the record is written
+  if (msg->counts[ns_s_qd] == 0 ||
+      -1 == local_ns_name_unpack(msg, local_ns_section(msg, ns_s_qd)->name,
+                                 rec->name))
+    rec->name[0] = 0;
+  return rec;
+}
+
+static int should_filter_query(const local_ns_msg *msg,
+                               const upstream_t *upstream, int group,
+                               log_record_t *rec) {
+  int kind = FILTER_ANY;
+  int flags = 0;
+  // a Chinese name is asked of no one else, so a foreign address is
+  // just a CDN abroad
+  if (chnroute_file && (dns_servers_len > 1) &&
+      !(group == DOMAINS_CHN && chn_mask))
+    kind = upstream->chn ? FILTER_CHN : FILTER_FOREIGN;
+  if (compression)
+    flags |= FILTER_COMPRESSION;
+  if (bidirectional)
+    flags |= FILTER_BIDIRECTIONAL;
+  if (upstream->transport == UPSTREAM_TLS)
+    flags |= FILTER_TRUSTED;
+  return filter_answer(routes, msg, kind, flags, rec);
+}
+
+static void schedule_delay(pending_t *pending, const char *buf,
+                           size_t buflen) {
+  if (buflen > payload_size)
+    return;
+  // replace the answer delayed earlier, if any
+  if (pending->delay_buf == NULL) {
+    pending->delay_buf = pool_get(&buf_pool);
+    if (pending->delay_buf == NULL) {
+      // nowhere to hold it, so the suspect answer is dropped
+      VERR("can't hold suspect answer (%lu pool buffers exhausted)\n",
+           buf_pool.exhausted);
+      return;
     }
+    metrics->held++;
   }
-  if (rrmax == 1) {
-    if (compression) {
-      return 0;
-    } else {
-      return -1;
-    }
+  memcpy(pending->delay_buf, buf, buflen);
+  pending->delay_buflen = buflen;
+  // one that would never be released is dropped like one with no buffer
+  if (0 != timeout_add(&pending->delay_timeout,
+                       delay_deadline(pending, timeout_now()))) {
+    ERR("timeout_add");
+    pool_put(&buf_pool, pending->delay_buf);
+    pending->delay_buf = NULL;
+    metrics->held--;
   }
-  return 0;
 }
 
-static void schedule_delay(uint16_t query_id, const char *buf, size_t buflen,
-                           struct sockaddr *addr, socklen_t addrlen) {
+// when the upstreams that may still answer usually have
+static uint64_t delay_deadline(pending_t *pending, uint64_t now) {
+  uint64_t limit = now + (uint64_t)(empty_result_delay * 1000);
+  uint64_t deadline = now;
+  uint64_t waiting = (pending->sent_mask & ~pending->answered_mask) |
+                     pending->suspect_mask;
   int i;
-  int found = 0;
-  struct timeval now;
-  gettimeofday(&now, 0);
-
-  delay_buf_t *delay_buf = &delay_queue[delay_queue_last];
+  if (timeout_pending(&pending->hedge_timeout))
+    waiting |= pending->hedge_mask;
+  for (i = 0; i < dns_servers_len; i++) {
+    uint64_t sent_at;
+    int p;
+    if (!(waiting & UPSTREAM_BIT(i)))
+      continue;
+    p = upstream_percentile(&upstreams[i], DELAY_PERCENTILE,
+                            DELAY_MIN_SAMPLES);
+    if (p == -1)
+      return limit;
+    // the clock ticks in milliseconds, and the estimate is rough
+    p += p / 8 + 2;
+    if (!(pending->hedge_mask & UPSTREAM_BIT(i)))
+      sent_at = pending->sent_at;
+    else if (timeout_pending(&pending->hedge_timeout))
+      sent_at = pending->hedge_timeout.deadline;
+    else
+      sent_at = pending->hedged_at;
+    if (sent_at + p > deadline)
+      deadline = sent_at + p;
+  }
+  return MIN(deadline, limit);
+}
 
-  // first search for existed item with query_id and replace it
-  for (i = delay_queue_first;
-       i != delay_queue_last;
-       i = (i + 1) % DELAY_QUEUE_LEN) {
-    delay_buf_t *delay_buf2 = &delay_queue[i];
-    if (delay_buf2->id == query_id) {
-      free_delay(i);
-      delay_buf = &delay_queue[i];
-      found = 1;
-    }
+static void send_delay(void *data) {
+  pending_t *pending = data;
+  static local_ns_msg msg;
+  const local_ns_msg *parsed = NULL;
+  size_t len;
+  // an answer that passed once beats a suspect one for the clients
+  if (pending->stale_buf)
+    send_stale(pending);
+  // the suspect answer is accepted once nothing better turned up, but
+  // only for these clients: it isn't cached, so whoever asks next gets
+  // another chance at an answer that passes
+  if (local_ns_parse((const u_char *)pending->delay_buf,
+                     pending->delay_buflen, &msg) == 0)
+    parsed = &msg;
+  if (!pending->replied) {
+    // copied before it's cut down for the client
+    reply_waiters(pending, pending->delay_buf, pending->delay_buflen, parsed);
+    len = fit_reply(pending->conn, pending->edns, pending->delay_buf,
+                    pending->delay_buflen, parsed);
+    // the buffer is released right away, so this can't wait for a batch
+    if (pending->conn)
+      tcp_send(pending->conn, pending->delay_buf, len);
+    else if (-1 == sendto(local_sock, pending->delay_buf, len, 0,
+                          (struct sockaddr *)&pending->addr,
+                          pending->addrlen))
+      ERR("sendto");
   }
+  pending->replied = 1;
+  pool_put(&buf_pool, pending->delay_buf);
+  pending->delay_buf = NULL;
+  metrics->held--;
+  if (pending->remaining <= 0)
+    remove_pending(pending);
+}
 
-  delay_buf->id = query_id;
-  delay_buf->ts = now;
-  delay_buf->buf = malloc(buflen);
-  memcpy(delay_buf->buf, buf, buflen);
-  delay_buf->buflen = buflen;
-  delay_buf->addr = malloc(addrlen);
-  memcpy(delay_buf->addr, addr, addrlen);
-  delay_buf->addrlen = addrlen;
+// keep buf, an expired answer from the cache, for the clients of pending
+// in case nothing usable comes by the time the upstreams usually answer
+static void hold_stale(pending_t *pending, const char *buf, size_t buflen) {
+  if (pending->stale_buf)
+    return;
+  // without a buffer the clients just wait for a fresh answer
+  if (NULL == (pending->stale_buf = pool_get(&buf_pool)))
+    return;
+  memcpy(pending->stale_buf, buf, buflen);
+  pending->stale_buflen = buflen;
+  if (0 != timeout_add(&pending->stale_timeout,
+                       delay_deadline(pending, timeout_now()))) {
+    ERR("timeout_add");
+    pool_put(&buf_pool, pending->stale_buf);
+    pending->stale_buf = NULL;
+  }
+}
 
-  // then append to queue
-  if (!found) {
-    delay_queue_last = (delay_queue_last + 1) % DELAY_QUEUE_LEN;
-    if (delay_queue_last == delay_queue_first) {
-      free_delay(delay_queue_first);
-      delay_queue_first = (delay_queue_first + 1) % DELAY_QUEUE_LEN;
-    }
+static void send_stale(void *data) {
+  pending_t *pending = data;
+  uint16_t ns_old_id = htons(pending->old_id);
+  size_t len;
+  // also called directly when the query ends without a usable answer
+  timeout_del(&pending->stale_timeout);
+  if (!pending->replied) {
+    // it may have come from a waiter's lookup
+    memcpy(pending->stale_buf, &ns_old_id, 2);
+    reply_waiters(pending, pending->stale_buf, pending->stale_buflen, NULL);
+    len = fit_reply(pending->conn, pending->edns, pending->stale_buf,
+                    pending->stale_buflen, NULL);
+    if (pending->conn)
+      tcp_send(pending->conn, pending->stale_buf, len);
+    else if (-1 == sendto(local_sock, pending->stale_buf, len, 0,
+                          (struct sockaddr *)&pending->addr,
+                          pending->addrlen))
+      ERR("sendto");
+    metrics->stale_answers++;
+    // a fresh answer may still come, for the cache
+    pending->replied = 1;
   }
+  pool_put(&buf_pool, pending->stale_buf);
+  pending->stale_buf = NULL;
 }
 
-float time_diff(struct timeval t0, struct timeval t1) {
-  return (t1.tv_sec - t0.tv_sec) +
-      (t1.tv_usec - t0.tv_usec) / 1000000.0f;
+// every upstream has answered. those whose answer was filtered or
+// suspect may still send their own, so the query is kept until their
+// usual latency has passed
+static void finish_pending(pending_t *pending) {
+  uint64_t now = timeout_now();
+  uint64_t deadline = now;
+  if (pending->suspect_mask)
+    deadline = delay_deadline(pending, now);
+  // finished now if it can't be kept
+  if (deadline > now &&
+      0 == timeout_add(timeout_pending(&pending->delay_timeout) ?
+                       &pending->delay_timeout : &pending->expire_timeout,
+                       deadline))
+    return;
+  // nothing better is coming for a held answer, and nothing fresh for a
+  // stale one
+  if (timeout_pending(&pending->delay_timeout)) {
+    send_delay(pending);
+  } else {
+    if (pending->stale_buf)
+      send_stale(pending);
+    remove_pending(pending);
+  }
 }
 
-static void check_and_send_delay() {
-  struct timeval now;
+static void expire_pending(void *data) {
+  pending_t *pending = data;
+  uint64_t lost = pending->sent_mask & ~pending->answered_mask;
+  uint64_t now = timeout_now();
   int i;
-  gettimeofday(&now, 0);
-  for (i = delay_queue_first;
-       i != delay_queue_last;
-       i = (i + 1) % DELAY_QUEUE_LEN) {
-    delay_buf_t *delay_buf = &delay_queue[i];
-    if (time_diff(delay_buf->ts, now) > empty_result_delay) {
-      if (-1 == sendto(local_sock, delay_buf->buf, delay_buf->buflen, 0,
-                       delay_buf->addr, delay_buf->addrlen))
-        ERR("sendto");
-      free_delay(i);
-      delay_queue_first = (delay_queue_first + 1) % DELAY_QUEUE_LEN;
-    } else {
-      break;
+  // upstreams that haven't answered by now never will
+  for (i = 0; i < dns_servers_len; i++) {
+    if (lost & UPSTREAM_BIT(i)) {
+      upstream_on_loss(&upstreams[i], now);
+      metrics->upstreams[i].losses++;
     }
   }
+  pending->remaining = 0;
+  if (timeout_pending(&pending->delay_timeout)) {
+    send_delay(pending);
+  } else {
+    if (pending->stale_buf)
+      send_stale(pending);
+    remove_pending(pending);
+  }
 }
 
-static void free_delay(int pos) {
-  free(delay_queue[pos].buf);
-  free(delay_queue[pos].addr);
+// forget pending, letting TCP clients it never answered know
+static void remove_pending(pending_t *pending) {
+  waiter_t *w;
+  if (!pending->replied) {
+    if (pending->conn)
+      tcp_drop(pending->conn);
+    for (w = pending->waiters; w; w = w->next) {
+      if (w->conn)
+        tcp_drop(w->conn);
+    }
+  }
+  pending_remove(pending);
 }
 
 static void usage() {
   printf("%s\n", "\
 usage: chinadns [-h] [-l IPLIST_FILE] [-b BIND_ADDR] [-p BIND_PORT]\n\
-       [-c CHNROUTE_FILE] [-s DNS] [-m] [-v] [-V]\n\
+       [-c CHNROUTE_FILE] [-D CHN_DOMAINS] [-O FOREIGN_DOMAINS]\n\
+       [-s DNS] [-A CA_FILE] [-C CACHE_SIZE] [-F PREFETCH] [-X MAX_STALE]\n\
+       [-B BATCH_SIZE] [-P SOURCE_PORTS] [-M POOL_SIZE] [-w WORKERS]\n\
+       [-H] [-m] [-a] [-G] [-E PAYLOAD_SIZE] [-T TCP_CONNS]\n\
+       [-e METRICS_ADDR] [-v] [-S LOG_SAMPLE] [-R LOG_RATE] [-V]\n\
 Forward DNS requests.\n\
 \n\
   -l IPLIST_FILE        path to ip blacklist file\n\
-  -c CHNROUTE_FILE      path to china route file\n\
+  -c CHNROUTE_FILE      path to china route file, IPv4 and IPv6\n\
+                        either may be an image from chinadns-compile\n\
                         if not specified, CHNRoute will be turned\n\
   -d                    off enable bi-directional CHNRoute filter\n\
-  -y                    delay time for suspects, default: 0.3\n\
+  -D CHN_DOMAINS        path to list of domains to ask only Chinese DNS,\n\
+                        subdomains included\n\
+  -O FOREIGN_DOMAINS    path to list of domains to ask only foreign DNS\n\
+  -y                    max delay time for suspects, default: 0.3\n\
   -b BIND_ADDR          address that listens, default: 0.0.0.0\n\
+                        :: listens on both IPv4 and IPv6\n\
   -p BIND_PORT          port that listens, default: 53\n\
   -s DNS                DNS servers to use, default:\n\
                         114.114.114.114,208.67.222.222:443,8.8.8.8\n\
+                        IPv6 servers are written as [2001:db8::1]:53\n\
+                        tcp://8.8.8.8 asks over persistent TCP\n\
+                        connections, tls://8.8.8.8#dns.google over\n\
+                        TLS to port 853, checked against the name\n\
+                        after # or else the host\n\
+  -A CA_FILE            certificates to check TLS DNS servers with,\n\
+                        default: the system's\n\
+  -C CACHE_SIZE         answer cache size in KiB, 0 to disable,\n\
+                        default: 1024\n\
+  -F PREFETCH           refresh cached answers asked for often when\n\
+                        this fraction of their TTL is left, 0 to\n\
+                        disable, default: 0.1\n\
+  -X MAX_STALE          seconds an expired answer may still be served\n\
+                        when no fresh one comes in time, 0 to\n\
+                        disable, default: 86400\n\
+  -B BATCH_SIZE         datagrams read or written per syscall,\n\
+                        default: 32\n\
+  -P SOURCE_PORTS       source ports per upstream, queries rotate\n\
+                        through them; connections per TCP upstream,\n\
+                        default: 1\n\
+  -M POOL_SIZE          pending queries per worker, preallocated,\n\
+                        default: 2048\n\
+  -G                    enable UDP GRO on sockets\n\
+  -E PAYLOAD_SIZE       EDNS0 UDP payload size offered to upstreams,\n\
+                        and the largest answer taken, default: 1232\n\
+  -T TCP_CONNS          TCP client connections per worker, 0 to serve\n\
+                        UDP only, default: 64\n\
+  -w WORKERS            worker processes, 0 for one per CPU, default: 1\n\
+  -a                    pin each worker to a CPU\n\
+  -H                    send to the best Chinese and foreign DNS first,\n\
+                        and to the others only when they are slow\n\
   -m                    use DNS compression pointer mutation\n\
                         (backlist and delaying would be disabled)\n\
+  -e METRICS_ADDR       serve Prometheus metrics over HTTP on host:port\n\
+                        or a UNIX socket path; SIGUSR1 prints them\n\
+                        to stderr\n\
   -v                    verbose logging\n\
+  -S LOG_SAMPLE         with -v, log one in every LOG_SAMPLE queries,\n\
+                        default: 1\n\
+  -R LOG_RATE           with -v, log at most LOG_RATE lines a second\n\
+                        per worker, 0 for no limit, default: 0\n\
   -h                    show this help message and exit\n\
   -V                    print version and exit\n\
 \n\
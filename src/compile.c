@@ -0,0 +1,98 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "routes.h"
+
+#include "config.h"
+
+// for log.h
+int verbose = 0;
+
+static void usage() {
+  printf("%s\n", "\
+usage: chinadns-compile [-h] [-c CHNROUTE_FILE] [-l IPLIST_FILE]\n\
+       [-D CHN_DOMAINS] [-O FOREIGN_DOMAINS] -o OUTPUT [-V]\n\
+Compile chnroute, the ip blacklist and the domain lists into an image\n\
+chinadns maps as is.\n\
+\n\
+  -c CHNROUTE_FILE      path to china route file, IPv4 and IPv6\n\
+  -l IPLIST_FILE        path to ip blacklist file\n\
+  -D CHN_DOMAINS        path to list of domains for Chinese DNS only\n\
+  -O FOREIGN_DOMAINS    path to list of domains for foreign DNS only\n\
+  -o OUTPUT             image to write, which can be given to chinadns\n\
+                        as any of -c, -l, -D and -O\n\
+  -V                    print version and exit\n\
+\n\
+Online help: <https://github.com/clowwindy/ChinaDNS>\n");
+}
+
+int main(int argc, char **argv) {
+  char *chnroute_file = NULL;
+  char *ip_list_file = NULL;
+  char *chn_domains_file = NULL;
+  char *foreign_domains_file = NULL;
+  char *output = NULL;
+  routes_t *routes;
+  int ch;
+  while ((ch = getopt(argc, argv, "hc:l:D:O:o:V")) != -1) {
+    switch (ch) {
+      case 'h':
+        usage();
+        exit(0);
+      case 'c':
+        chnroute_file = optarg;
+        break;
+      case 'l':
+        ip_list_file = optarg;
+        break;
+      case 'D':
+        chn_domains_file = optarg;
+        break;
+      case 'O':
+        foreign_domains_file = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'V':
+        printf("ChinaDNS %s\n", PACKAGE_VERSION);
+        exit(0);
+      default:
+        usage();
+        exit(1);
+    }
+  }
+  if (output == NULL || optind != argc) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (NULL == (routes = routes_load(chnroute_file, ip_list_file,
+                                    chn_domains_file, foreign_domains_file)))
+    return EXIT_FAILURE;
+  if (0 != routes_write_image(routes, output))
+    return EXIT_FAILURE;
+  printf("%s: %d chnroute networks, %d IPv6, %d ips, and %d domains\n",
+         output, routes->chnroute.entries, routes->chnroute6.entries,
+         routes->ip_list.entries, routes->domains.entries);
+  routes_free(routes);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/nameser.h>
+
+#include "domains.h"
+
+// the group is kept in the low bits of a hash, so the slot is picked by
+// the ones above
+#define GROUP_BITS 2
+#define GROUP_MASK 3
+// FNV-1a over the labels from the root, each preceded by its length
+#define HASH_SEED 14695981039346656037ull
+#define HASH_PRIME 1099511628211ull
+
+static uint64_t hash_label(uint64_t h, const unsigned char *label, int len);
+static uint64_t finish(uint64_t h);
+static int cmp_key(const void *a, const void *b);
+
+void domains_init(domains_t *d) {
+  memset(d, 0, sizeof(domains_t));
+}
+
+int domains_add(domains_t *d, const char *name, int group) {
+  const char *end = name + strlen(name);
+  uint64_t h = HASH_SEED;
+  int labels = 0;
+  size_t wire_len = 1;
+  if (end > name && end[-1] == '.')
+    end--;
+  if (end == name)
+    return -1;
+  // from the root, so a suffix hashes the same on its own as in a name
+  while (end > name) {
+    const char *dot = end;
+    while (dot > name && dot[-1] != '.')
+      dot--;
+    if (dot == end || end - dot > NS_MAXLABEL)
+      return -1;
+    wire_len += 1 + (end - dot);
+    if (wire_len > NS_MAXCDNAME)
+      return -1;
+    h = hash_label(h, (const unsigned char *)dot, end - dot);
+    labels++;
+    end = dot;
+    if (end > name) {
+      end--;
+      // a trailing dot, as in "a..b" or ".a"
+      if (end == name)
+        return -1;
+    }
+  }
+  if (d->entries == d->cap) {
+    int cap = d->cap ? d->cap * 2 : 64;
+    uint64_t *keys = realloc(d->keys, cap * sizeof(uint64_t));
+    if (keys == NULL)
+      return -1;
+    d->keys = keys;
+    d->cap = cap;
+  }
+  d->keys[d->entries++] = (finish(h) & ~(uint64_t)GROUP_MASK) | group;
+  if (labels > d->depth)
+    d->depth = labels;
+  return 0;
+}
+
+int domains_build(domains_t *d) {
+  uint32_t nslots = 2;
+  int i, n = 0;
+  free(d->slots);
+  d->slots = NULL;
+  if (d->entries == 0)
+    return 0;
+  // a name in several lists is asked of everyone
+  qsort(d->keys, d->entries, sizeof(uint64_t), cmp_key);
+  for (i = 0; i < d->entries; i++) {
+    if (n && (d->keys[n - 1] & ~(uint64_t)GROUP_MASK) ==
+             (d->keys[i] & ~(uint64_t)GROUP_MASK)) {
+      if (d->keys[n - 1] != d->keys[i])
+        d->keys[n - 1] = (d->keys[i] & ~(uint64_t)GROUP_MASK) | DOMAINS_ALL;
+      continue;
+    }
+    d->keys[n++] = d->keys[i];
+  }
+  d->entries = n;
+  // at most three quarters full, so probe runs stay short
+  while (nslots < (uint32_t)n + n / 3 + 1)
+    nslots <<= 1;
+  d->slots = calloc(nslots, sizeof(uint64_t));
+  if (d->slots == NULL)
+    return -1;
+  d->mask = nslots - 1;
+  for (i = 0; i < n; i++) {
+    uint32_t slot = (d->keys[i] >> GROUP_BITS) & d->mask;
+    while (d->slots[slot])
+      slot = (slot + 1) & d->mask;
+    d->slots[slot] = d->keys[i];
+  }
+  free(d->keys);
+  d->keys = NULL;
+  d->cap = 0;
+  return 0;
+}
+
+void domains_free(domains_t *d) {
+  free(d->slots);
+  free(d->keys);
+  domains_init(d);
+}
+
+int domains_lookup(const domains_t *d, const unsigned char *name) {
+  const unsigned char *labels[NS_MAXCDNAME / 2];
+  uint64_t h = HASH_SEED;
+  int n = 0, group = DOMAINS_NONE;
+  int depth;
+  if (d->slots == NULL)
+    return DOMAINS_NONE;
+  while (*name && n < (int)(sizeof(labels) / sizeof(labels[0]))) {
+    labels[n++] = name;
+    name += 1 + *name;
+  }
+  // the longest listed suffix wins, so every level is probed
+  for (depth = 0; n > 0 && depth < d->depth; depth++) {
+    const unsigned char *label = labels[--n];
+    uint64_t key;
+    uint32_t slot;
+    h = hash_label(h, label + 1, *label);
+    key = finish(h);
+    for (slot = (key >> GROUP_BITS) & d->mask; d->slots[slot];
+         slot = (slot + 1) & d->mask) {
+      if (((d->slots[slot] ^ key) & ~(uint64_t)GROUP_MASK) == 0) {
+        group = d->slots[slot] & GROUP_MASK;
+        break;
+      }
+    }
+  }
+  return group;
+}
+
+static uint64_t hash_label(uint64_t h, const unsigned char *label, int len) {
+  int i;
+  h = (h ^ len) * HASH_PRIME;
+  for (i = 0; i < len; i++) {
+    unsigned char c = label[i];
+    // names match in any case, RFC 4343
+    if (c >= 'A' && c <= 'Z')
+      c |= 0x20;
+    h = (h ^ c) * HASH_PRIME;
+  }
+  return h;
+}
+
+// FNV's low bits are poor, and they pick the slot
+static uint64_t finish(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static int cmp_key(const void *a, const void *b) {
+  uint64_t ka = *(const uint64_t *)a;
+  uint64_t kb = *(const uint64_t *)b;
+  if (ka == kb)
+    return 0;
+  return ka > kb ? 1 : -1;
+}
@@ -0,0 +1,51 @@
+#ifndef DOMAINS_H
+#define DOMAINS_H
+
+#include <stdint.h>
+
+/* who a listed name is asked of */
+enum {
+  // not listed
+  DOMAINS_NONE,
+  // every upstream, to except a name from a suffix listed otherwise
+  DOMAINS_ALL,
+  DOMAINS_CHN,
+  DOMAINS_FOREIGN
+};
+
+/* domain suffixes compiled into an open addressed hash set, 8 bytes a
+   name. a slot holds the 64-bit hash of a suffix, which is all that's
+   kept of it, with the group in place of the low 2 bits; 0 is empty. a
+   lookup hashes the name label by label from the root, and probes once
+   per label */
+typedef struct {
+  // a power of two, NULL until domains_build()
+  uint64_t *slots;
+  uint32_t mask;
+  // labels in the longest suffix, deeper ones are never probed
+  int depth;
+  // distinct suffixes
+  int entries;
+
+  // hashes with their group, freed by domains_build()
+  uint64_t *keys;
+  int cap;
+} domains_t;
+
+void domains_init(domains_t *d);
+
+/* name is dotted text, in any case, with or without the final dot. a
+   name listed in several groups is asked of every upstream. return -1 if
+   it isn't a valid name */
+int domains_add(domains_t *d, const char *name, int group);
+
+/* fill the slots, once all names are added */
+int domains_build(domains_t *d);
+
+void domains_free(domains_t *d);
+
+/* the group of the longest listed suffix of name, in wire format as
+   unpacked from a message; DOMAINS_NONE if there's none */
+int domains_lookup(const domains_t *d, const unsigned char *name);
+
+#endif
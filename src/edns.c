@@ -0,0 +1,141 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "edns.h"
+
+#define HDR_ARCOUNT 10
+// root name, type, class, TTL and RDLENGTH
+#define OPT_SIZE 11
+
+static unsigned long truncated = 0;
+
+static const local_ns_rr *find_opt(const local_ns_msg *msg);
+static size_t question_end(const char *buf, size_t len);
+
+int edns_payload_size(const local_ns_msg *msg) {
+  const local_ns_rr *opt = find_opt(msg);
+  if (opt == NULL)
+    return 0;
+  // the class field carries the size
+  return opt->rr_class < EDNS_MIN_SIZE ? EDNS_MIN_SIZE : opt->rr_class;
+}
+
+int edns_flags(const local_ns_msg *msg) {
+  const local_ns_rr *opt = find_opt(msg);
+  if (opt == NULL)
+    return 0;
+  if (opt->rdlength)
+    return -1;
+  // the TTL field carries the extended RCODE, version and flags
+  return opt->ttl & 0xffff;
+}
+
+int edns_dnssec_ok(const local_ns_msg *msg) {
+  const local_ns_rr *opt = find_opt(msg);
+  return opt && (opt->ttl & 0x8000);
+}
+
+size_t edns_set_payload_size(char *buf, size_t len, size_t buflen,
+                             const local_ns_msg *msg, uint16_t size) {
+  const local_ns_rr *opt = find_opt(msg);
+  u_char *cp;
+  uint16_t arcount;
+  if (opt) {
+    // the class is ahead of the TTL and RDLENGTH
+    cp = (u_char *)buf + (opt->rdata - msg->msg) - NS_INT16SZ - NS_INT32SZ -
+         NS_INT16SZ;
+    NS_PUT16(size, cp);
+    return len;
+  }
+  if (len + OPT_SIZE > buflen)
+    return len;
+  // no extended flags, so no DNSSEC records are asked for
+  cp = (u_char *)buf + len;
+  *cp++ = 0;
+  NS_PUT16(ns_t_opt, cp);
+  NS_PUT16(size, cp);
+  NS_PUT32(0, cp);
+  NS_PUT16(0, cp);
+  arcount = msg->counts[ns_s_ar] + 1;
+  cp = (u_char *)buf + HDR_ARCOUNT;
+  NS_PUT16(arcount, cp);
+  return len + OPT_SIZE;
+}
+
+size_t edns_fit(char *buf, size_t len, const local_ns_msg *msg,
+                int client_size, size_t limit) {
+  static local_ns_msg parsed;
+  u_char *cp;
+  if (client_size == 0 && len >= NS_HFIXEDSZ &&
+      (buf[HDR_ARCOUNT] || buf[HDR_ARCOUNT + 1])) {
+    const local_ns_rr *opt;
+    if (msg == NULL && 0 == local_ns_parse((u_char *)buf, len, &parsed))
+      msg = &parsed;
+    if (msg && (opt = find_opt(msg))) {
+      size_t start = opt->name;
+      size_t end = opt->rdata + opt->rdlength - msg->msg;
+      uint16_t arcount = msg->counts[ns_s_ar] - 1;
+      memmove(buf + start, buf + end, len - end);
+      len -= end - start;
+      cp = (u_char *)buf + HDR_ARCOUNT;
+      NS_PUT16(arcount, cp);
+    }
+  }
+  if (len > limit) {
+    size_t end = question_end(buf, len);
+    if (end == 0 || end > limit)
+      return len;
+    buf[2] |= 0x02;
+    // no answer, authority or additional records are left
+    memset(buf + 6, 0, 6);
+    len = end;
+    truncated++;
+  }
+  return len;
+}
+
+unsigned long edns_truncated() {
+  return truncated;
+}
+
+static const local_ns_rr *find_opt(const local_ns_msg *msg) {
+  const local_ns_rr *rr = local_ns_section(msg, ns_s_ar);
+  int i;
+  for (i = 0; i < msg->counts[ns_s_ar]; i++) {
+    if (rr[i].type == ns_t_opt)
+      return &rr[i];
+  }
+  return NULL;
+}
+
+// where the question section ends, 0 if malformed
+static size_t question_end(const char *buf, size_t len) {
+  const u_char *msg = (const u_char *)buf;
+  int qdcount = msg[4] << 8 | msg[5];
+  size_t off = NS_HFIXEDSZ;
+  while (qdcount-- > 0) {
+    while (off < len && msg[off] != 0 &&
+           (msg[off] & NS_CMPRSFLGS) != NS_CMPRSFLGS)
+      off += 1 + msg[off];
+    if (off >= len)
+      return 0;
+    off += (msg[off] == 0 ? 1 : 2) + NS_QFIXEDSZ;
+  }
+  return off <= len ? off : 0;
+}
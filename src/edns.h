@@ -0,0 +1,44 @@
+#ifndef EDNS_H
+#define EDNS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "local_ns_parser.h"
+
+/* EDNS0, RFC 6891 */
+
+// what a client without EDNS0 takes over UDP
+#define EDNS_MIN_SIZE 512
+
+/* the UDP payload size advertised by the OPT record of msg, at least
+   EDNS_MIN_SIZE, or 0 if it has none */
+int edns_payload_size(const local_ns_msg *msg);
+
+/* the extended flags of the OPT record of msg, such as DO, or 0 if it has
+   none. -1 if it carries options, such as a client subnet or a cookie,
+   that the answer may depend on */
+int edns_flags(const local_ns_msg *msg);
+
+/* 1 if msg has the DO bit set, asking for DNSSEC records, whatever
+   options its OPT record carries */
+int edns_dnssec_ok(const local_ns_msg *msg);
+
+/* advertise size in the query in buf, indexed by msg, by rewriting its
+   OPT record or appending one. buf holds buflen bytes. return the new
+   length, or len if there's no room */
+size_t edns_set_payload_size(char *buf, size_t len, size_t buflen,
+                             const local_ns_msg *msg, uint16_t size);
+
+/* make the answer in buf fit a client that advertised client_size, 0
+   without EDNS0, and takes at most limit bytes: its OPT record is removed
+   if the client didn't send one, and if it's still too long it's cut to
+   the question with TC set, so the client retries over TCP. msg indexes
+   buf, or is NULL. return the new length */
+size_t edns_fit(char *buf, size_t len, const local_ns_msg *msg,
+                int client_size, size_t limit);
+
+/* answers edns_fit() cut to the question */
+unsigned long edns_truncated();
+
+#endif
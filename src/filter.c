@@ -0,0 +1,99 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+int filter_answer(const routes_t *routes, const local_ns_msg *msg, int kind,
+                  int flags, log_record_t *rec) {
+  const local_ns_rr *rr = local_ns_section(msg, ns_s_an);
+  int rrnum, rrmax;
+  void *r;
+  int dns_is_chn = kind == FILTER_CHN;
+  int dns_is_foreign = kind == FILTER_FOREIGN;
+  int compression = flags & FILTER_COMPRESSION;
+  int bidirectional = flags & FILTER_BIDIRECTIONAL;
+  int trusted = flags & FILTER_TRUSTED;
+  rrmax = msg->counts[ns_s_an];
+  if (rrmax == 0) {
+    if (compression) {
+      // Wait for foreign dns
+      if (dns_is_chn) {
+        return 1;
+      } else {
+        return 0;
+      }
+    }
+    return trusted ? 0 : -1;
+  }
+  for (rrnum = 0; rrnum < rrmax; rrnum++, rr++) {
+    u_int type;
+    const u_char *rd;
+    int in_chn;
+    type = rr->type;
+    rd = rr->rdata;
+    if (type == ns_t_a && rr->rdlength == 4) {
+      if (rec)
+        log_add_addr(rec, type, rd);
+      if (!compression && !trusted) {
+        r = bsearch(rd, routes->ip_list.ips, routes->ip_list.entries,
+                    sizeof(struct in_addr), cmp_in_addr);
+        if (r) {
+          return 1;
+        }
+      }
+      in_chn = test_ip_in_list(*(struct in_addr *)rd, &routes->chnroute);
+    } else if (type == ns_t_aaaa && routes->chnroute6.entries &&
+               rr->rdlength == 16) {
+      struct in6_addr ip6;
+      memcpy(&ip6, rd, 16);
+      if (rec)
+        log_add_addr(rec, type, rd);
+      in_chn = test_ip6_in_list(&ip6, &routes->chnroute6);
+    } else if (type == ns_t_aaaa || type == ns_t_ptr) {
+      // if we've got an IPv6 result we can't judge or a PTR result, pass
+      return 0;
+    } else {
+      continue;
+    }
+    if (in_chn) {
+      // result is chn
+      if (dns_is_foreign) {
+        if (bidirectional) {
+          // filter DNS result from foreign dns if result is inside chn
+          return 1;
+        }
+      }
+    } else {
+      // result is foreign
+      if (dns_is_chn) {
+        // filter DNS result from chn dns if result is outside chn
+        return 1;
+      }
+    }
+  }
+  if (rrmax == 1) {
+    if (compression || trusted) {
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
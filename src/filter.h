@@ -0,0 +1,31 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "local_ns_parser.h"
+#include "log.h"
+#include "routes.h"
+
+/* the upstream an answer came from */
+enum {
+  // chnroute is off, or there's nothing to tell apart
+  FILTER_ANY,
+  FILTER_CHN,
+  FILTER_FOREIGN
+};
+
+// answers to queries mutated with a compression pointer, which the ip
+// list isn't needed for
+#define FILTER_COMPRESSION 1
+// drop Chinese addresses from foreign upstreams too
+#define FILTER_BIDIRECTIONAL 2
+// from an upstream nothing can be injected on the way from, so neither
+// the ip list nor holding suspect answers is needed
+#define FILTER_TRUSTED 4
+
+/* 0 to pass the answer, 1 to drop it, or -1 to hold it as suspect until
+   something better turns up. the addresses judged are noted in rec, if
+   not NULL */
+int filter_answer(const routes_t *routes, const local_ns_msg *msg, int kind,
+                  int flags, log_record_t *rec);
+
+#endif
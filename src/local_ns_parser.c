@@ -1,249 +1,168 @@
 #include <errno.h>
+#include <stdio.h>
 #include <resolv.h>
-#include <stddef.h>
 #include "local_ns_parser.h"
 
-static void local_ns_setsection(ns_msg *msg, ns_sect sect);
-static int local_ns_skiprr(const unsigned char *ptr, const unsigned char *eom, ns_sect section, int count);
-static int local_ns_dn_skipname(const unsigned char *ptr, const unsigned char *eom);
-static int local_ns_name_skip(const unsigned char **ptrptr, const unsigned char *eom);
-static int local_ns_labellen(const unsigned char *lp);
-#define LOCAL_NS_TYPE_ELT 0x40 /*%< EDNS0 extended label type */
-#define LOCAL_DNS_LABELTYPE_BITSTRING 0x41
-#ifdef __UCLIBC__
-#define LOCAL_NS_MSG_PTR _ptr
-#else
-#define LOCAL_NS_MSG_PTR _msg_ptr
-#endif
-
-int local_ns_initparse(const unsigned char *msg, int msglen, ns_msg *handle)
-{
-	const unsigned char *eom = msg + msglen;
-	int i;
-
-	handle->_msg = msg;
-	handle->_eom = eom;
-	if (msg + NS_INT16SZ > eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-
-	NS_GET16(handle->_id, msg);
-	if (msg + NS_INT16SZ > eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-
-	NS_GET16(handle->_flags, msg);
-	for (i = 0; i < ns_s_max; i++) {
-		if (msg + NS_INT16SZ > eom) {
-			errno = EMSGSIZE;
-			return -1;
-		}
-
-		NS_GET16(handle->_counts[i], msg);
-	}
-	for (i = 0; i < ns_s_max; i++)
-		if (handle->_counts[i] == 0)
-			handle->_sections[i] = NULL;
-		else {
-			int b = local_ns_skiprr(msg, eom, (ns_sect)i,
-					handle->_counts[i]);
-
-			if (b < 0)
-				return -1;
-			handle->_sections[i] = msg;
-			msg += b;
-		}
-
-	if (msg != eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-
-	local_ns_setsection(handle, ns_s_max);
-	return 0;
+static const unsigned char *skip_name(const unsigned char *cp,
+                                      const unsigned char *eom);
+static int unpack_name(const local_ns_msg *handle, int off, unsigned char *buf,
+                       int lower);
+
+int local_ns_parse(const unsigned char *msg, int msglen, local_ns_msg *handle) {
+  const unsigned char *cp = msg;
+  const unsigned char *eom = msg + msglen;
+  int sect, i, n = 0;
+
+  if (msglen < NS_HFIXEDSZ) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  handle->msg = msg;
+  handle->msglen = msglen;
+  NS_GET16(handle->id, cp);
+  NS_GET16(handle->flags, cp);
+  for (sect = 0; sect < ns_s_max; sect++)
+    NS_GET16(handle->counts[sect], cp);
+
+  for (sect = 0; sect < ns_s_max; sect++) {
+    handle->sections[sect] = n;
+    for (i = 0; i < handle->counts[sect]; i++) {
+      local_ns_rr *rr;
+      if (n == LOCAL_NS_MAX_RRS)
+        goto bad;
+      rr = &handle->rrs[n++];
+      rr->name = cp - msg;
+      if (NULL == (cp = skip_name(cp, eom)))
+        goto bad;
+      if (cp + NS_INT16SZ + NS_INT16SZ > eom)
+        goto bad;
+      NS_GET16(rr->type, cp);
+      NS_GET16(rr->rr_class, cp);
+      if (sect == ns_s_qd) {
+        rr->ttl = 0;
+        rr->rdlength = 0;
+        rr->rdata = NULL;
+        continue;
+      }
+      if (cp + NS_INT32SZ + NS_INT16SZ > eom)
+        goto bad;
+      NS_GET32(rr->ttl, cp);
+      NS_GET16(rr->rdlength, cp);
+      if (cp + rr->rdlength > eom)
+        goto bad;
+      rr->rdata = cp;
+      cp += rr->rdlength;
+    }
+  }
+  if (cp != eom)
+    goto bad;
+  return 0;
+
+bad:
+  errno = EMSGSIZE;
+  return -1;
 }
-int local_ns_parserr(ns_msg *handle, ns_sect section, int rrnum, ns_rr *rr)
-{
-	int b;
-	int tmp;
-
-	/* Make section right. */
-	tmp = section;
-	if (tmp < 0 || section >= ns_s_max) {
-		errno = ENODEV;
-		return -1;
-	}
-
-	if (section != handle->_sect)
-		local_ns_setsection(handle, section);
-
-	/* Make rrnum right. */
-	if (rrnum == -1)
-		rrnum = handle->_rrnum;
-	if (rrnum < 0 || rrnum >= handle->_counts[(int)section]) {
-		errno = ENODEV;
-		return -1;
-	}
-	if (rrnum < handle->_rrnum)
-		local_ns_setsection(handle, section);
-	if (rrnum > handle->_rrnum) {
-		b = local_ns_skiprr(handle->LOCAL_NS_MSG_PTR, handle->_eom, section,
-				rrnum - handle->_rrnum);
-
-		if (b < 0)
-			return (-1);
-		handle->LOCAL_NS_MSG_PTR += b;
-		handle->_rrnum = rrnum;
-	}
-
-	/* Do the parse. */
-	b = dn_expand(handle->_msg, handle->_eom,
-			handle->LOCAL_NS_MSG_PTR, rr->name, NS_MAXDNAME);
-	if (b < 0)
-		return (-1);
-	handle->LOCAL_NS_MSG_PTR += b;
-	if (handle->LOCAL_NS_MSG_PTR + NS_INT16SZ + NS_INT16SZ > handle->_eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-	NS_GET16(rr->type, handle->LOCAL_NS_MSG_PTR);
-	NS_GET16(rr->rr_class, handle->LOCAL_NS_MSG_PTR);
-	if (section == ns_s_qd) {
-		rr->ttl = 0;
-		rr->rdlength = 0;
-		rr->rdata = NULL;
-	} else {
-		if (handle->LOCAL_NS_MSG_PTR + NS_INT32SZ + NS_INT16SZ > handle->_eom) {
-			errno = EMSGSIZE;
-			return -1;
-		}
-		NS_GET32(rr->ttl, handle->LOCAL_NS_MSG_PTR);
-		NS_GET16(rr->rdlength, handle->LOCAL_NS_MSG_PTR);
-		if (handle->LOCAL_NS_MSG_PTR + rr->rdlength > handle->_eom) {
-			errno = EMSGSIZE;
-			return -1;
-		}
-		rr->rdata = handle->LOCAL_NS_MSG_PTR;
-		handle->LOCAL_NS_MSG_PTR += rr->rdlength;
-	}
-	if (++handle->_rrnum > handle->_counts[(int)section])
-		local_ns_setsection(handle, (ns_sect)((int)section + 1));
 
-	return 0;
+int local_ns_name_unpack(const local_ns_msg *handle, int off,
+                         unsigned char *buf) {
+  return unpack_name(handle, off, buf, 0);
 }
-static void local_ns_setsection(ns_msg *msg, ns_sect sect)
-{
-	msg->_sect = sect;
-	if (sect == ns_s_max) {
-		msg->_rrnum = -1;
-		msg->LOCAL_NS_MSG_PTR = NULL;
-	} else {
-		msg->_rrnum = 0;
-		msg->LOCAL_NS_MSG_PTR = msg->_sections[(int)sect];
-	}
-}
-static int local_ns_skiprr(const unsigned char *ptr, const unsigned char *eom, ns_sect section, int count)
-{
-	const unsigned char *optr = ptr;
-
-	for (; count > 0; count--) {
-		int b, rdlength;
-
-		b = local_ns_dn_skipname(ptr, eom);
-		if (b < 0) {
-			errno = EMSGSIZE;
-			return -1;
-		}
-		ptr += b/*Name*/ + NS_INT16SZ/*Type*/ + NS_INT16SZ/*Class*/;
-		if (section != ns_s_qd) {
-			if (ptr + NS_INT32SZ + NS_INT16SZ > eom) {
-				errno = EMSGSIZE;
-				return -1;
-			}
-
-			ptr += NS_INT32SZ/*TTL*/;
-			NS_GET16(rdlength, ptr);
-			ptr += rdlength/*RData*/;
-		}
-	}
 
-	if (ptr > eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-
-	return ptr - optr;
+int local_ns_name_key(const local_ns_msg *handle, int off, unsigned char *key) {
+  return unpack_name(handle, off, key, 1);
 }
-static int local_ns_dn_skipname(const unsigned char *ptr, const unsigned char *eom)
-{
-	const unsigned char *saveptr = ptr;
-
-	if (local_ns_name_skip(&ptr, eom) == -1)
-		return -1;
 
-	return ptr - saveptr;
+int local_ns_name_ntop(const unsigned char *name, char *buf, size_t buflen) {
+  size_t len = 0;
+  int i = 0;
+
+  while (name[i]) {
+    int n = name[i++];
+    if (len > 0) {
+      if (len + 1 >= buflen)
+        return -1;
+      buf[len++] = '.';
+    }
+    for (; n > 0; n--, i++) {
+      unsigned char c = name[i];
+      // room for "\DDD" and '\0'
+      if (len + 5 > buflen)
+        return -1;
+      if (c == '.' || c == '\\' || c == '"' || c == ';' || c == '(' ||
+          c == ')' || c == '@' || c == '$') {
+        buf[len++] = '\\';
+        buf[len++] = c;
+      } else if (c > 0x20 && c < 0x7f) {
+        buf[len++] = c;
+      } else {
+        len += sprintf(buf + len, "\\%03u", c);
+      }
+    }
+  }
+  if (len >= buflen)
+    return -1;
+  buf[len] = '\0';
+  return len;
 }
-static int local_ns_name_skip(const unsigned char **ptrptr, const unsigned char *eom)
-{
-	const unsigned char *cp;
-	unsigned int n;
-	int l;
-
-	cp = *ptrptr;
-	while (cp < eom && (n = *cp++) != 0) {
-		/* Check for indirection. */
-		switch (n & NS_CMPRSFLGS) {
-			case 0: /*%< normal case, n == len */
-				cp += n;
-				continue;
-			case LOCAL_NS_TYPE_ELT: /*%< EDNS0 extended label */
-				if ((l = local_ns_labellen(cp - 1)) < 0) {
-					errno = EMSGSIZE; /*%< XXX */
-					return -1;
-				}
-				cp += l;
-				continue;
-			case NS_CMPRSFLGS:      /*%< indirection */
-				cp++;
-				break;
-			default: /*%< illegal type */
-				errno = EMSGSIZE;
-				return -1;
-		}
 
-		break;
-	}
-
-	if (cp > eom) {
-		errno = EMSGSIZE;
-		return -1;
-	}
-
-	*ptrptr = cp;
-
-	return 0;
+// past the name at cp, which may end in a pointer, or NULL
+static const unsigned char *skip_name(const unsigned char *cp,
+                                      const unsigned char *eom) {
+  while (cp < eom) {
+    unsigned int n = *cp++;
+    if (n == 0)
+      return cp;
+    switch (n & NS_CMPRSFLGS) {
+      case 0:
+        cp += n;
+        break;
+      case NS_CMPRSFLGS:
+        return cp < eom ? cp + 1 : NULL;
+      default:
+        // extended label types never made it
+        return NULL;
+    }
+  }
+  return NULL;
 }
-static int local_ns_labellen(const unsigned char *lp)
-{
-	int bitlen;
-	unsigned char l = *lp;
-
-	if ((l & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-		/* should be avoided by the caller */
-		return -1;
-	}
-
-	if ((l & NS_CMPRSFLGS) == LOCAL_NS_TYPE_ELT) {
-		if (l == LOCAL_DNS_LABELTYPE_BITSTRING) {
-			if ((bitlen = *(lp + 1)) == 0)
-				bitlen = 256;
-			return ((bitlen + 7 ) / 8 + 1);
-		}
-
-		return -1;    /*%< unknwon ELT */
-	}
 
-	return l;
+static int unpack_name(const local_ns_msg *handle, int off, unsigned char *buf,
+                       int lower) {
+  const unsigned char *msg = handle->msg;
+  // a name that takes more reads than the message has bytes loops, as in
+  // ns_name_unpack()
+  int checked = 0;
+  int len = 0;
+
+  while (1) {
+    unsigned int n;
+    int i;
+    if (off >= handle->msglen)
+      return -1;
+    n = msg[off];
+    if ((n & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+      if (off + 1 >= handle->msglen)
+        return -1;
+      off = ((n & ~NS_CMPRSFLGS) << 8) | msg[off + 1];
+      checked += 2;
+      if (checked >= handle->msglen)
+        return -1;
+      continue;
+    }
+    if (n & NS_CMPRSFLGS)
+      return -1;
+    if (off + 1 + n > handle->msglen || len + 1 + n > NS_MAXCDNAME)
+      return -1;
+    buf[len++] = n;
+    for (i = 1; i <= n; i++) {
+      unsigned char c = msg[off + i];
+      if (lower && c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+      buf[len++] = c;
+    }
+    off += 1 + n;
+    checked += 1 + n;
+    if (n == 0)
+      return len;
+  }
 }
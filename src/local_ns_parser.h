@@ -1,7 +1,62 @@
 #ifndef LOCAL_NS_PARSER_H
 #define LOCAL_NS_PARSER_H
 
-int local_ns_initparse(const unsigned char *msg, int msglen, ns_msg *handle);
-int local_ns_parserr(ns_msg *handle, ns_sect section, int rrnum, ns_rr *rr);
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/nameser.h>
+
+// as many RRs as the largest message holds, at 11 bytes each for the
+// root name and the fixed fields. only a message of mostly questions, 5
+// bytes each, can have more, and is rejected
+#define LOCAL_NS_MAX_RRS ((UINT16_MAX - NS_HFIXEDSZ) / (1 + NS_RRFIXEDSZ))
+
+/* a question or RR, pointing into the message */
+typedef struct {
+  // offset of the owner name, still compressed
+  uint16_t name;
+  uint16_t type;
+  uint16_t rr_class;
+  uint16_t rdlength;
+  // 0 for questions
+  uint32_t ttl;
+  // NULL for questions
+  const unsigned char *rdata;
+} local_ns_rr;
+
+/* a message indexed by local_ns_parse(), valid as long as msg is. about
+   140 KiB, too much for the stack, so kept in static storage by whoever
+   parses into one */
+typedef struct {
+  const unsigned char *msg;
+  int msglen;
+  uint16_t id;
+  uint16_t flags;
+  uint16_t counts[ns_s_max];
+  // index into rrs of the first entry of each section
+  uint16_t sections[ns_s_max];
+  local_ns_rr rrs[LOCAL_NS_MAX_RRS];
+} local_ns_msg;
+
+/* check the layout of msg and index its sections in one pass, without
+   expanding any name. return -1 with errno EMSGSIZE if malformed */
+int local_ns_parse(const unsigned char *msg, int msglen, local_ns_msg *handle);
+
+/* the count entries of section sect */
+static inline const local_ns_rr *local_ns_section(const local_ns_msg *handle,
+                                                  ns_sect sect) {
+  return &handle->rrs[handle->sections[sect]];
+}
+
+/* copy the name at offset off uncompressed into buf, which holds
+   NS_MAXCDNAME bytes. return its length, or -1 if malformed */
+int local_ns_name_unpack(const local_ns_msg *handle, int off,
+                         unsigned char *buf);
+
+/* the same, lowercased, so equal names compare equal with memcmp() */
+int local_ns_name_key(const local_ns_msg *handle, int off, unsigned char *key);
+
+/* an uncompressed name in presentation format, as dn_expand() would write
+   it, for logging. return -1 if longer than buflen */
+int local_ns_name_ntop(const unsigned char *name, char *buf, size_t buflen);
 
 #endif
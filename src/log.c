@@ -0,0 +1,243 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "local_ns_parser.h"
+#include "log.h"
+
+// records queued between flushes, a power of two
+#define LOG_QUEUE_LEN 2048
+// formatted output written per flush
+#define LOG_OUT_SIZE 65536
+// longest line a record formats to
+#define LOG_LINE_MAX (NS_MAXDNAME + 256 + \
+                      LOG_MAX_ADDRS * (INET6_ADDRSTRLEN + 2))
+
+static const char *verdicts[] = {"pass", "delay", "filter", "skip"};
+
+// single producer, the event loop, and it's also the one that flushes,
+// so head and tail need no synchronization
+static log_record_t *queue = NULL;
+static unsigned int head = 0;
+static unsigned int tail = 0;
+
+static char *out = NULL;
+static size_t out_len = 0;
+static size_t out_off = 0;
+// a pipe only promises PIPE_BUF bytes when it polls writable
+static int out_is_pipe = 0;
+
+static int sample_every = 1;
+static int max_rate = 0;
+static time_t rate_time = 0;
+static int rate_count = 0;
+
+static unsigned long dropped = 0;
+static unsigned long limited = 0;
+static unsigned long reported = 0;
+static time_t reported_time = 0;
+
+#define STAMP_FORMAT "%a %b %e %H:%M:%S %Y"
+static time_t stamp_time = -1;
+static char stamp[32];
+
+static const char *format_time(time_t t);
+static void format_record(const log_record_t *rec);
+static int write_out();
+
+int log_init(int sample, int rate) {
+  struct stat st;
+  sample_every = sample;
+  max_rate = rate;
+  queue = malloc(LOG_QUEUE_LEN * sizeof(log_record_t));
+  out = malloc(LOG_OUT_SIZE);
+  if (queue == NULL || out == NULL)
+    return -1;
+  if (0 == fstat(STDOUT_FILENO, &st))
+    out_is_pipe = S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+  return 0;
+}
+
+int log_sampled(uint16_t id) {
+  return verbose && (sample_every <= 1 || id % sample_every == 0);
+}
+
+log_record_t *log_begin(int event) {
+  log_record_t *rec;
+  time_t now = time(NULL);
+  if (queue == NULL)
+    return NULL;
+  if (max_rate) {
+    if (now != rate_time) {
+      rate_time = now;
+      rate_count = 0;
+    }
+    if (rate_count == max_rate) {
+      limited++;
+      return NULL;
+    }
+    rate_count++;
+  }
+  if (head - tail == LOG_QUEUE_LEN) {
+    dropped++;
+    return NULL;
+  }
+  rec = &queue[head & (LOG_QUEUE_LEN - 1)];
+  rec->time = now;
+  rec->event = event;
+  rec->verdict = LOG_SKIP;
+  rec->naddrs = 0;
+  rec->from = NULL;
+  rec->name[0] = 0;
+  return rec;
+}
+
+void log_commit(log_record_t *rec) {
+  head++;
+}
+
+void log_add_addr(log_record_t *rec, int type, const unsigned char *rdata) {
+  int i = rec->naddrs;
+  if (i < UINT8_MAX)
+    rec->naddrs++;
+  if (i >= LOG_MAX_ADDRS)
+    return;
+  if (type == ns_t_a) {
+    rec->families[i] = AF_INET;
+    memcpy(rec->addrs[i], rdata, 4);
+  } else {
+    rec->families[i] = AF_INET6;
+    memcpy(rec->addrs[i], rdata, 16);
+  }
+}
+
+void log_flush() {
+  if (queue == NULL)
+    return;
+  while (1) {
+    if (out_off == out_len) {
+      out_off = out_len = 0;
+      if (dropped + limited != reported && time(NULL) != reported_time) {
+        reported_time = time(NULL);
+        out_len += snprintf(out, LOG_OUT_SIZE, "%s %lu log records dropped\n",
+                            log_timestamp(), dropped + limited - reported);
+        reported = dropped + limited;
+      }
+      while (tail != head && out_len + LOG_LINE_MAX <= LOG_OUT_SIZE)
+        format_record(&queue[tail++ & (LOG_QUEUE_LEN - 1)]);
+      if (out_len == 0)
+        return;
+    }
+    if (0 != write_out())
+      return;
+  }
+}
+
+// for VERR and ERR, which the thread that reloads the lists calls too, so
+// not the stamp the query log caches
+const char *log_timestamp() {
+  static __thread char buf[32];
+  time_t t = time(NULL);
+  struct tm tm;
+  localtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), STAMP_FORMAT, &tm);
+  return buf;
+}
+
+unsigned long log_dropped() {
+  return dropped;
+}
+
+unsigned long log_limited() {
+  return limited;
+}
+
+// records come in order, so this formats about once a second
+static const char *format_time(time_t t) {
+  if (t != stamp_time) {
+    struct tm tm;
+    stamp_time = t;
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), STAMP_FORMAT, &tm);
+  }
+  return stamp;
+}
+
+static void format_record(const log_record_t *rec) {
+  char name[NS_MAXDNAME];
+  char *line = out + out_len;
+  size_t size = LOG_OUT_SIZE - out_len;
+  const char *time_str = format_time(rec->time);
+  int len, i;
+
+  if (-1 == local_ns_name_ntop(rec->name, name, sizeof(name)))
+    name[0] = '\0';
+  switch (rec->event) {
+    case LOG_REQUEST:
+      len = snprintf(line, size, "%s request %s\n", time_str, name);
+      break;
+    case LOG_CACHED:
+      len = snprintf(line, size, "%s response %s from cache\n", time_str,
+                     name);
+      break;
+    default:
+      len = snprintf(line, size, "%s response %s from %s - ", time_str, name,
+                     rec->from);
+      for (i = 0; i < rec->naddrs && i < LOG_MAX_ADDRS; i++) {
+        char addr[INET6_ADDRSTRLEN];
+        inet_ntop(rec->families[i], rec->addrs[i], addr, sizeof(addr));
+        len += snprintf(line + len, size - len, "%s, ", addr);
+      }
+      if (rec->naddrs > LOG_MAX_ADDRS)
+        len += snprintf(line + len, size - len, "%d more, ",
+                        rec->naddrs - LOG_MAX_ADDRS);
+      len += snprintf(line + len, size - len, "%s\n", verdicts[rec->verdict]);
+      break;
+  }
+  out_len += len;
+}
+
+// -1 when nothing more can be written for now
+static int write_out() {
+  struct pollfd pfd;
+  size_t len = out_len - out_off;
+  ssize_t n;
+  pfd.fd = STDOUT_FILENO;
+  pfd.events = POLLOUT;
+  if (1 != poll(&pfd, 1, 0) || !(pfd.revents & POLLOUT))
+    return -1;
+  if (out_is_pipe && len > PIPE_BUF)
+    len = PIPE_BUF;
+  n = write(STDOUT_FILENO, out + out_off, len);
+  if (n == -1) {
+    if (errno == EINTR || errno == EAGAIN)
+      return -1;
+    // nowhere to write to, throw it away
+    out_off = out_len;
+    return -1;
+  }
+  out_off += n;
+  return 0;
+}
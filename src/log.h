@@ -0,0 +1,98 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/nameser.h>
+
+extern int verbose;
+
+// addresses kept per response record, more are only counted
+#define LOG_MAX_ADDRS 4
+
+enum {
+  LOG_REQUEST,
+  LOG_CACHED,
+  LOG_RESPONSE
+};
+
+enum {
+  LOG_PASS,
+  LOG_DELAY,
+  LOG_FILTER,
+  LOG_SKIP
+};
+
+/* one query log line, queued as is and formatted when flushed */
+typedef struct {
+  time_t time;
+  uint8_t event;
+  uint8_t verdict;
+  // addresses seen, which may be more than are kept
+  uint8_t naddrs;
+  // AF_INET or AF_INET6
+  uint8_t families[LOG_MAX_ADDRS];
+  unsigned char addrs[LOG_MAX_ADDRS][16];
+  // upstream name, which must outlive the record
+  const char *from;
+  // uncompressed wire format, empty for no question
+  unsigned char name[NS_MAXCDNAME];
+} log_record_t;
+
+/* with -v, log queries whose id is a multiple of sample, and at most rate
+   records per second, 0 for no limit */
+int log_init(int sample, int rate);
+
+/* whether the query with this id is logged at all */
+int log_sampled(uint16_t id);
+
+/* a record to fill in and log_commit(), or NULL when it's dropped because
+   the queue is full or over the rate */
+log_record_t *log_begin(int event);
+
+void log_commit(log_record_t *rec);
+
+/* note an address from an answer, type ns_t_a or ns_t_aaaa */
+void log_add_addr(log_record_t *rec, int type, const unsigned char *rdata);
+
+/* format and write queued records without blocking; what can't be
+   written stays queued */
+void log_flush();
+
+/* the current time as ctime() writes it, without the newline; formatted
+   once a second */
+const char *log_timestamp();
+
+/* records dropped because the queue was full, or over the rate */
+unsigned long log_dropped();
+unsigned long log_limited();
+
+#define __LOG(o, t, v, s...) do {                                   \
+  const char *time_str = log_timestamp();                           \
+  if (t == 0) {                                                     \
+    if (stdout != o || verbose) {                                   \
+      if (stdout == o)                                              \
+        log_flush();                                                \
+      fprintf(o, "%s ", time_str);                                  \
+      fprintf(o, s);                                                \
+      fflush(o);                                                    \
+    }                                                               \
+  } else if (t == 1) {                                              \
+    fprintf(o, "%s %s:%d ", time_str, __FILE__, __LINE__);          \
+    perror(v);                                                      \
+  }                                                                 \
+} while (0)
+
+#define LOG(s...) __LOG(stdout, 0, "_", s)
+#define ERR(s) __LOG(stderr, 1, s, "_")
+#define VERR(s...) __LOG(stderr, 0, "_", s)
+
+#ifdef DEBUG
+#define DLOG(s...) LOG(s)
+#else
+#define DLOG(s...)
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
+#endif
+
+#include "loop.h"
+
+typedef struct {
+  loop_cb cb;
+  void *data;
+  int events;
+} watcher_t;
+
+// indexed by fd
+static watcher_t *watchers = NULL;
+static int watchers_len = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+#define MAX_EVENTS 64
+static int epfd = -1;
+
+static uint32_t to_epoll(int events) {
+  uint32_t ev = 0;
+  if (events & LOOP_READ)
+    ev |= EPOLLIN;
+  if (events & LOOP_WRITE)
+    ev |= EPOLLOUT;
+  return ev;
+}
+#else
+static int max_fd = -1;
+#endif
+
+int loop_init() {
+#ifdef HAVE_SYS_EPOLL_H
+  epfd = epoll_create(MAX_EVENTS);
+  if (epfd == -1)
+    return -1;
+#endif
+  return 0;
+}
+
+int loop_add(int fd, int events, loop_cb cb, void *data) {
+  if (fd >= watchers_len) {
+    int new_len = watchers_len ? watchers_len : 64;
+    watcher_t *new_watchers;
+    while (new_len <= fd)
+      new_len *= 2;
+    new_watchers = realloc(watchers, new_len * sizeof(watcher_t));
+    if (new_watchers == NULL)
+      return -1;
+    memset(new_watchers + watchers_len, 0,
+           (new_len - watchers_len) * sizeof(watcher_t));
+    watchers = new_watchers;
+    watchers_len = new_len;
+  }
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(events);
+  ev.data.fd = fd;
+  if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+    return -1;
+#else
+  if (fd >= FD_SETSIZE) {
+    errno = EMFILE;
+    return -1;
+  }
+  if (fd > max_fd)
+    max_fd = fd;
+#endif
+  watchers[fd].cb = cb;
+  watchers[fd].data = data;
+  watchers[fd].events = events;
+  return 0;
+}
+
+int loop_mod(int fd, int events) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(events);
+  ev.data.fd = fd;
+  if (-1 == epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev))
+    return -1;
+#endif
+  watchers[fd].events = events;
+  return 0;
+}
+
+void loop_del(int fd) {
+  if (fd >= watchers_len || watchers[fd].cb == NULL)
+    return;
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+  watchers[fd].cb = NULL;
+}
+
+int loop_run_once(int timeout) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+  n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+  if (n == -1)
+    return errno == EINTR ? 0 : -1;
+  for (i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+    int ev = 0;
+    // an earlier callback may have removed it
+    if (watchers[fd].cb == NULL)
+      continue;
+    if (events[i].events & EPOLLIN)
+      ev |= LOOP_READ;
+    if (events[i].events & EPOLLOUT)
+      ev |= LOOP_WRITE;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      ev |= LOOP_ERROR;
+    watchers[fd].cb(fd, ev, watchers[fd].data);
+  }
+  return 0;
+#else
+  fd_set readset, writeset, errorset;
+  struct timeval tv;
+  int fd;
+  FD_ZERO(&readset);
+  FD_ZERO(&writeset);
+  FD_ZERO(&errorset);
+  for (fd = 0; fd <= max_fd; fd++) {
+    if (watchers[fd].cb == NULL)
+      continue;
+    if (watchers[fd].events & LOOP_READ)
+      FD_SET(fd, &readset);
+    if (watchers[fd].events & LOOP_WRITE)
+      FD_SET(fd, &writeset);
+    FD_SET(fd, &errorset);
+  }
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  if (-1 == select(max_fd + 1, &readset, &writeset, &errorset,
+                   timeout == -1 ? NULL : &tv))
+    return errno == EINTR ? 0 : -1;
+  for (fd = 0; fd <= max_fd; fd++) {
+    int ev = 0;
+    if (watchers[fd].cb == NULL)
+      continue;
+    if (FD_ISSET(fd, &readset))
+      ev |= LOOP_READ;
+    if (FD_ISSET(fd, &writeset))
+      ev |= LOOP_WRITE;
+    if (FD_ISSET(fd, &errorset))
+      ev |= LOOP_ERROR;
+    if (ev)
+      watchers[fd].cb(fd, ev, watchers[fd].data);
+  }
+  return 0;
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#define LOOP_READ 1
+#define LOOP_WRITE 2
+#define LOOP_ERROR 4
+
+typedef void (*loop_cb)(int fd, int events, void *data);
+
+int loop_init();
+
+/* watch fd for events, LOOP_ERROR is always reported */
+int loop_add(int fd, int events, loop_cb cb, void *data);
+
+int loop_mod(int fd, int events);
+
+void loop_del(int fd);
+
+/* wait at most timeout milliseconds, -1 for no limit, and dispatch */
+int loop_run_once(int timeout);
+
+#endif
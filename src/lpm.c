@@ -0,0 +1,311 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "lpm.h"
+
+// blocks are allocated in powers of two, so grow when len is one
+#define NEEDS_GROW(len) (((len) & ((len) - 1)) == 0)
+#define GROWN(len) ((len) ? (len) * 2 : 1)
+
+static int cmp_range(const void *a, const void *b);
+static int fill_l1(lpm_t *lpm, uint32_t a, uint32_t b);
+static int fill_block(lpm_t *lpm, uint32_t a, uint32_t b);
+static int fill_leaf(lpm_t *lpm, lpm_block_t *block, uint32_t a, uint32_t b);
+static int cmp_range6(const void *a, const void *b);
+static int fill_node6(lpm6_t *lpm, int node, int shift, uint64_t lo,
+                      const lpm6_range_t *ranges, int n);
+
+void lpm_init(lpm_t *lpm) {
+  memset(lpm, 0, sizeof(lpm_t));
+}
+
+int lpm_add(lpm_t *lpm, uint32_t net, int prefixlen) {
+  uint32_t mask;
+  if (prefixlen < 0 || prefixlen > 32)
+    return -1;
+  if (lpm->entries == lpm->cap) {
+    int new_cap = lpm->cap ? lpm->cap * 2 : 1024;
+    lpm_range_t *new_ranges = realloc(lpm->ranges,
+                                      new_cap * sizeof(lpm_range_t));
+    if (new_ranges == NULL)
+      return -1;
+    lpm->ranges = new_ranges;
+    lpm->cap = new_cap;
+  }
+  mask = prefixlen ? UINT32_MAX << (32 - prefixlen) : 0;
+  lpm->ranges[lpm->entries].start = net & mask;
+  lpm->ranges[lpm->entries].end = net | ~mask;
+  lpm->entries++;
+  return 0;
+}
+
+int lpm_build(lpm_t *lpm) {
+  int i, n = 0;
+
+  if (lpm->entries)
+    qsort(lpm->ranges, lpm->entries, sizeof(lpm_range_t), cmp_range);
+  // merge overlapping and adjacent ranges, so every node that could be
+  // answered as a whole is
+  for (i = 0; i < lpm->entries; i++) {
+    lpm_range_t *r = &lpm->ranges[i];
+    if (n > 0 && (lpm->ranges[n - 1].end == UINT32_MAX ||
+                  r->start <= lpm->ranges[n - 1].end + 1)) {
+      if (r->end > lpm->ranges[n - 1].end)
+        lpm->ranges[n - 1].end = r->end;
+    } else {
+      lpm->ranges[n++] = *r;
+    }
+  }
+  lpm->entries = n;
+
+  free(lpm->l1);
+  free(lpm->blocks);
+  free(lpm->leaves);
+  lpm->blocks = NULL;
+  lpm->blocks_len = 0;
+  lpm->leaves = NULL;
+  lpm->leaves_len = 0;
+  lpm->l1 = calloc(1 << 16, sizeof(uint32_t));
+  if (lpm->l1 == NULL)
+    return -1;
+  // in ascending order, so the leaves of each block end up contiguous
+  for (i = 0; i < n; i++) {
+    if (0 != fill_l1(lpm, lpm->ranges[i].start, lpm->ranges[i].end))
+      return -1;
+  }
+  for (i = 0; i < lpm->blocks_len; i++) {
+    lpm_block_t *block = &lpm->blocks[i];
+    int w;
+    for (w = 1; w < 4; w++)
+      block->base[w] = block->base[w - 1] +
+                       __builtin_popcountll(block->leaf[w - 1]);
+  }
+  return 0;
+}
+
+void lpm_free(lpm_t *lpm) {
+  free(lpm->l1);
+  free(lpm->blocks);
+  free(lpm->leaves);
+  free(lpm->ranges);
+  lpm_init(lpm);
+}
+
+static int cmp_range(const void *a, const void *b) {
+  const lpm_range_t *ra = a;
+  const lpm_range_t *rb = b;
+  if (ra->start == rb->start)
+    return 0;
+  return ra->start > rb->start ? 1 : -1;
+}
+
+static int fill_l1(lpm_t *lpm, uint32_t a, uint32_t b) {
+  while (1) {
+    uint32_t block_end = a | 0xffff;
+    if ((a & 0xffff) == 0 && b >= block_end) {
+      lpm->l1[a >> 16] = 1;
+    } else if (0 != fill_block(lpm, a, MIN(b, block_end))) {
+      return -1;
+    }
+    if (block_end >= b)
+      return 0;
+    a = block_end + 1;
+  }
+}
+
+// [a, b] lies within one /16
+static int fill_block(lpm_t *lpm, uint32_t a, uint32_t b) {
+  uint32_t *node = &lpm->l1[a >> 16];
+  lpm_block_t *block;
+  if (*node == 0) {
+    if (NEEDS_GROW(lpm->blocks_len)) {
+      lpm_block_t *new_blocks = realloc(lpm->blocks, GROWN(lpm->blocks_len) *
+                                                     sizeof(lpm_block_t));
+      if (new_blocks == NULL)
+        return -1;
+      lpm->blocks = new_blocks;
+    }
+    block = &lpm->blocks[lpm->blocks_len];
+    memset(block, 0, sizeof(lpm_block_t));
+    block->base[0] = lpm->leaves_len;
+    *node = 2 + lpm->blocks_len++;
+  }
+  block = &lpm->blocks[*node - 2];
+  while (1) {
+    uint32_t block_end = a | 0xff;
+    uint32_t i = (a >> 8) & 0xff;
+    if ((a & 0xff) == 0 && b >= block_end) {
+      block->full[i >> 6] |= (uint64_t)1 << (i & 63);
+    } else if (0 != fill_leaf(lpm, block, a, MIN(b, block_end))) {
+      return -1;
+    }
+    if (block_end >= b)
+      return 0;
+    a = block_end + 1;
+  }
+}
+
+// [a, b] lies within one /24
+static int fill_leaf(lpm_t *lpm, lpm_block_t *block, uint32_t a, uint32_t b) {
+  uint32_t i = (a >> 8) & 0xff;
+  uint64_t *leaf;
+  if (!(block->leaf[i >> 6] & ((uint64_t)1 << (i & 63)))) {
+    if (NEEDS_GROW(lpm->leaves_len)) {
+      uint64_t *new_leaves = realloc(lpm->leaves, GROWN(lpm->leaves_len) * 4 *
+                                                  sizeof(uint64_t));
+      if (new_leaves == NULL)
+        return -1;
+      lpm->leaves = new_leaves;
+    }
+    memset(lpm->leaves + lpm->leaves_len * 4, 0, 4 * sizeof(uint64_t));
+    lpm->leaves_len++;
+    block->leaf[i >> 6] |= (uint64_t)1 << (i & 63);
+  }
+  // ranges come in ascending order, so it's always the newest leaf
+  leaf = lpm->leaves + (lpm->leaves_len - 1) * 4;
+  for (i = a & 0xff; i <= (b & 0xff); i++)
+    leaf[i >> 6] |= (uint64_t)1 << (i & 63);
+  return 0;
+}
+
+void lpm6_init(lpm6_t *lpm) {
+  memset(lpm, 0, sizeof(lpm6_t));
+}
+
+int lpm6_add(lpm6_t *lpm, uint64_t net, int prefixlen) {
+  uint64_t mask;
+  if (prefixlen < 0 || prefixlen > 128)
+    return -1;
+  if (prefixlen > 64)
+    prefixlen = 64;
+  if (lpm->entries == lpm->cap) {
+    int new_cap = lpm->cap ? lpm->cap * 2 : 1024;
+    lpm6_range_t *new_ranges = realloc(lpm->ranges,
+                                       new_cap * sizeof(lpm6_range_t));
+    if (new_ranges == NULL)
+      return -1;
+    lpm->ranges = new_ranges;
+    lpm->cap = new_cap;
+  }
+  mask = prefixlen ? UINT64_MAX << (64 - prefixlen) : 0;
+  lpm->ranges[lpm->entries].start = net & mask;
+  lpm->ranges[lpm->entries].end = net | ~mask;
+  lpm->entries++;
+  return 0;
+}
+
+int lpm6_build(lpm6_t *lpm) {
+  int i, n = 0;
+
+  if (lpm->entries)
+    qsort(lpm->ranges, lpm->entries, sizeof(lpm6_range_t), cmp_range6);
+  for (i = 0; i < lpm->entries; i++) {
+    lpm6_range_t *r = &lpm->ranges[i];
+    if (n > 0 && (lpm->ranges[n - 1].end == UINT64_MAX ||
+                  r->start <= lpm->ranges[n - 1].end + 1)) {
+      if (r->end > lpm->ranges[n - 1].end)
+        lpm->ranges[n - 1].end = r->end;
+    } else {
+      lpm->ranges[n++] = *r;
+    }
+  }
+  lpm->entries = n;
+
+  free(lpm->nodes);
+  lpm->nodes = malloc(sizeof(lpm6_node_t));
+  if (lpm->nodes == NULL) {
+    lpm->nodes_len = 0;
+    return -1;
+  }
+  memset(lpm->nodes, 0, sizeof(lpm6_node_t));
+  lpm->nodes_len = 1;
+  return fill_node6(lpm, 0, LPM6_ROOT_SHIFT, 0, lpm->ranges, n);
+}
+
+void lpm6_free(lpm6_t *lpm) {
+  free(lpm->nodes);
+  free(lpm->ranges);
+  lpm6_init(lpm);
+}
+
+static int cmp_range6(const void *a, const void *b) {
+  const lpm6_range_t *ra = a;
+  const lpm6_range_t *rb = b;
+  if (ra->start == rb->start)
+    return 0;
+  return ra->start > rb->start ? 1 : -1;
+}
+
+// the node starts at lo and its slots span 1 << shift addresses. ranges
+// are sorted, disjoint and overlap the node
+static int fill_node6(lpm6_t *lpm, int node, int shift, uint64_t lo,
+                      const lpm6_range_t *ranges, int n) {
+  int first[64], count[64];
+  int slots = shift == LPM6_ROOT_SHIFT ? 16 : 64;
+  int slot, i = 0, k = 0;
+  uint64_t full = 0, child = 0;
+  uint64_t span = ((uint64_t)1 << shift) - 1;
+  uint32_t base;
+
+  for (slot = 0; slot < slots && i < n; slot++) {
+    uint64_t a = lo + ((uint64_t)slot << shift);
+    uint64_t b = a + span;
+    int j;
+    while (i < n && ranges[i].end < a)
+      i++;
+    if (i == n || ranges[i].start > b)
+      continue;
+    if (ranges[i].start <= a && ranges[i].end >= b) {
+      full |= (uint64_t)1 << slot;
+      continue;
+    }
+    // partially covered, which can't happen to a single address
+    for (j = i; j < n && ranges[j].start <= b; j++);
+    first[slot] = i;
+    count[slot] = j - i;
+    child |= (uint64_t)1 << slot;
+  }
+
+  // children are allocated together before filling any of them
+  base = lpm->nodes_len;
+  if (child) {
+    int len = __builtin_popcountll(child);
+    lpm6_node_t *new_nodes = realloc(lpm->nodes, (lpm->nodes_len + len) *
+                                                 sizeof(lpm6_node_t));
+    if (new_nodes == NULL)
+      return -1;
+    memset(new_nodes + lpm->nodes_len, 0, len * sizeof(lpm6_node_t));
+    lpm->nodes = new_nodes;
+    lpm->nodes_len += len;
+  }
+  lpm->nodes[node].full = full;
+  lpm->nodes[node].child = child;
+  lpm->nodes[node].base = base;
+  for (slot = 0; slot < slots; slot++) {
+    if (!(child & ((uint64_t)1 << slot)))
+      continue;
+    if (0 != fill_node6(lpm, base + k++, shift - 6,
+                        lo + ((uint64_t)slot << shift),
+                        ranges + first[slot], count[slot]))
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef LPM_H
+#define LPM_H
+
+#include <stdint.h>
+
+// the root of the IPv6 trie looks at the top 4 bits, so the remaining 60
+// split evenly into 6-bit strides
+#define LPM6_ROOT_SHIFT 60
+
+typedef struct {
+  // host order, inclusive
+  uint32_t start;
+  uint32_t end;
+} lpm_range_t;
+
+/* a /16 that is partially covered. a /24 in it is either fully inside,
+   partially inside with its own 256-bit leaf, or outside. leaves of a
+   block are stored contiguously, so a leaf is found by counting the leaf
+   bits before it, as in poptrie */
+typedef struct {
+  uint64_t full[4];
+  uint64_t leaf[4];
+  // index of the first leaf of each 64 /24s
+  uint32_t base[4];
+} lpm_block_t;
+
+/* IPv4 prefix set compiled into a 16-8-8 multibit trie.
+   a lookup touches the first level, at most one block and at most one
+   leaf */
+typedef struct {
+  // 65536 entries indexed by the top 16 bits; 0 or 1 is the answer for
+  // the whole /16, otherwise the block index + 2
+  uint32_t *l1;
+  lpm_block_t *blocks;
+  int blocks_len;
+  // bitmaps of 4 words indexed by the last 8 bits
+  uint64_t *leaves;
+  int leaves_len;
+
+  // sorted and merged by lpm_build()
+  lpm_range_t *ranges;
+  int entries;
+  int cap;
+} lpm_t;
+
+void lpm_init(lpm_t *lpm);
+
+/* net in host order */
+int lpm_add(lpm_t *lpm, uint32_t net, int prefixlen);
+
+/* merge overlapping and adjacent prefixes and compile the trie */
+int lpm_build(lpm_t *lpm);
+
+void lpm_free(lpm_t *lpm);
+
+/* ip in host order */
+static inline int lpm_lookup(const lpm_t *lpm, uint32_t ip) {
+  const lpm_block_t *block;
+  uint32_t n, w;
+  uint64_t bit;
+  if (lpm->l1 == NULL)
+    return 0;
+  n = lpm->l1[ip >> 16];
+  if (n < 2)
+    return n;
+  block = &lpm->blocks[n - 2];
+  w = (ip >> 14) & 3;
+  bit = (uint64_t)1 << ((ip >> 8) & 63);
+  if (block->full[w] & bit)
+    return 1;
+  if (!(block->leaf[w] & bit))
+    return 0;
+  n = block->base[w] + __builtin_popcountll(block->leaf[w] & (bit - 1));
+  return (lpm->leaves[(n << 2) | ((ip & 0xff) >> 6)] >> (ip & 63)) & 1;
+}
+
+typedef struct {
+  // inclusive, over the top 64 bits of the address
+  uint64_t start;
+  uint64_t end;
+} lpm6_range_t;
+
+/* 64 slots of 1 << shift addresses each. a slot is either fully inside,
+   has a child node, or is outside. children of a node are stored
+   contiguously from base, as in poptrie */
+typedef struct {
+  uint64_t full;
+  uint64_t child;
+  uint32_t base;
+} lpm6_node_t;
+
+/* IPv6 prefix set compiled into a 4-6-6-...-6 multibit trie over the top
+   64 bits of the address; longer prefixes are widened to /64, which no
+   routing table goes below anyway. a /32 is answered by the 6th node and
+   a /48 by the 8th, and nodes near the root stay in cache */
+typedef struct {
+  // node 0 is the root, NULL until lpm6_build()
+  lpm6_node_t *nodes;
+  int nodes_len;
+
+  // sorted and merged by lpm6_build()
+  lpm6_range_t *ranges;
+  int entries;
+  int cap;
+} lpm6_t;
+
+void lpm6_init(lpm6_t *lpm);
+
+/* net is the top 64 bits of the address, prefixlen up to 128 */
+int lpm6_add(lpm6_t *lpm, uint64_t net, int prefixlen);
+
+/* merge overlapping and adjacent prefixes and compile the trie */
+int lpm6_build(lpm6_t *lpm);
+
+void lpm6_free(lpm6_t *lpm);
+
+/* ip is the top 64 bits of the address */
+static inline int lpm6_lookup(const lpm6_t *lpm, uint64_t ip) {
+  const lpm6_node_t *node = lpm->nodes;
+  int shift = LPM6_ROOT_SHIFT;
+  uint64_t bit;
+  if (node == NULL)
+    return 0;
+  while (1) {
+    bit = (uint64_t)1 << ((ip >> shift) & 63);
+    if (node->full & bit)
+      return 1;
+    if (!(node->child & bit))
+      return 0;
+    node = &lpm->nodes[node->base + __builtin_popcountll(node->child &
+                                                         (bit - 1))];
+    shift -= 6;
+  }
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "loop.h"
+#include "metrics.h"
+#include "timeout.h"
+
+// scrapes served at once; more are turned away
+#define MAX_CONNS 8
+// milliseconds a scrape may take
+#define CONN_TIMEOUT 5000
+#define REQUEST_SIZE 1024
+
+const uint32_t metrics_rtt_bounds[METRICS_RTT_BUCKETS] = {
+  1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+static const char *verdicts[] = {"pass", "delay", "filter", "skip"};
+
+typedef struct {
+  int fd;
+  char request[REQUEST_SIZE];
+  size_t request_len;
+  // the response, once the request is in
+  char *response;
+  size_t response_len;
+  size_t response_off;
+  timeout_t timeout;
+} conn_t;
+
+metrics_t *metrics = NULL;
+
+static char *slots = NULL;
+static size_t slot_size;
+static int slots_len;
+static const upstream_t *names;
+static int names_len;
+static time_t started;
+
+static int listen_sock = -1;
+static conn_t conns[MAX_CONNS];
+
+static metrics_t *slot(int worker_id);
+static void accept_cb(int fd, int events, void *data);
+static void conn_cb(int fd, int events, void *data);
+static void conn_expire(void *data);
+static void conn_close(conn_t *conn);
+
+int metrics_init(int workers, const upstream_t *upstreams, int upstreams_len) {
+  int i;
+  slot_size = sizeof(metrics_t) + upstreams_len * sizeof(metrics_upstream_t);
+  // a cache line each, so workers don't write to each other's lines
+  slot_size = (slot_size + 63) & ~(size_t)63;
+  slots = mmap(NULL, slot_size * workers, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) {
+    slots = NULL;
+    return -1;
+  }
+  slots_len = workers;
+  names = upstreams;
+  names_len = upstreams_len;
+  started = time(NULL);
+  for (i = 0; i < MAX_CONNS; i++)
+    conns[i].fd = -1;
+  metrics = slot(0);
+  return 0;
+}
+
+void metrics_select(int worker_id) {
+  metrics = slot(worker_id);
+}
+
+int metrics_listen(const struct sockaddr *addr, socklen_t addrlen) {
+  int on = 1;
+  listen_sock = socket(addr->sa_family, SOCK_STREAM, 0);
+  if (listen_sock == -1)
+    return -1;
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (-1 == fcntl(listen_sock, F_SETFL,
+                  fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK) ||
+      0 != bind(listen_sock, addr, addrlen) ||
+      0 != listen(listen_sock, MAX_CONNS) ||
+      0 != loop_add(listen_sock, LOOP_READ, accept_cb, NULL)) {
+    close(listen_sock);
+    listen_sock = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void metrics_write(FILE *f) {
+  int w, i, b;
+
+#define COUNTER(name, help, field) do {                                 \
+    fprintf(f, "# HELP chinadns_" name " " help "\n"                    \
+               "# TYPE chinadns_" name " counter\n");                   \
+    for (w = 0; w < slots_len; w++)                                     \
+      fprintf(f, "chinadns_" name "{worker=\"%d\"} %llu\n", w,          \
+              (unsigned long long)slot(w)->field);                      \
+  } while (0)
+#define GAUGE(name, help, field) do {                                   \
+    fprintf(f, "# HELP chinadns_" name " " help "\n"                    \
+               "# TYPE chinadns_" name " gauge\n");                     \
+    for (w = 0; w < slots_len; w++)                                     \
+      fprintf(f, "chinadns_" name "{worker=\"%d\"} %llu\n", w,          \
+              (unsigned long long)slot(w)->field);                      \
+  } while (0)
+
+  fprintf(f, "# HELP chinadns_start_time_seconds Start time since the epoch.\n"
+             "# TYPE chinadns_start_time_seconds gauge\n"
+             "chinadns_start_time_seconds %lld\n", (long long)started);
+  COUNTER("queries_total", "Queries from clients.", queries);
+  COUNTER("malformed_total", "Messages that failed to parse.", malformed);
+  COUNTER("cache_hits_total", "Queries answered from the cache.",
+          cache_hits);
+  COUNTER("prefetches_total",
+          "Queries sent to refresh cache entries asked for often.", prefetches);
+  COUNTER("stale_answers_total",
+          "Expired answers sent because no usable one came in time.",
+          stale_answers);
+  fprintf(f, "# HELP chinadns_responses_total Upstream responses by "
+             "verdict.\n# TYPE chinadns_responses_total counter\n");
+  for (w = 0; w < slots_len; w++) {
+    for (i = 0; i < 4; i++)
+      fprintf(f, "chinadns_responses_total{worker=\"%d\",verdict=\"%s\"} "
+                 "%llu\n", w, verdicts[i],
+              (unsigned long long)slot(w)->verdicts[i]);
+  }
+  COUNTER("hedges_total", "Queries sent on to the remaining upstreams.",
+          hedges);
+  COUNTER("coalesced_total",
+          "Queries that waited on an identical one already sent.", coalesced);
+  COUNTER("routed_chn_total",
+          "Queries sent only to Chinese DNS, by the domain lists.",
+          routed_chn);
+  COUNTER("routed_foreign_total",
+          "Queries sent only to foreign DNS, by the domain lists.",
+          routed_foreign);
+  GAUGE("held_answers", "Suspect answers being held.", held);
+  GAUGE("pending_queries", "Queries waiting for upstreams.", pending);
+  GAUGE("pending_size", "Preallocated pending queries.", pending_size);
+  COUNTER("pending_dropped_total",
+          "Queries dropped because all pending queries were in use.",
+          pending_dropped);
+  COUNTER("pool_exhausted_total",
+          "Times no buffer was left for a held answer or hedged query.",
+          pool_exhausted);
+  COUNTER("cache_evicted_total", "Cache entries evicted to make room.",
+          cache_evicted);
+  COUNTER("cache_skipped_total", "Responses the cache found no room for.",
+          cache_skipped);
+  COUNTER("log_dropped_total", "Log records dropped on a full queue.",
+          log_dropped);
+  COUNTER("log_limited_total", "Log records dropped over the rate.",
+          log_limited);
+  COUNTER("truncated_total",
+          "Answers cut to the question for clients that can't take them.",
+          truncated);
+  COUNTER("tcp_queries_total", "Queries from TCP clients.", tcp_queries);
+  GAUGE("tcp_connections", "Open TCP client connections.", tcp_connections);
+  COUNTER("tcp_rejected_total",
+          "TCP connections turned away over the limit.", tcp_rejected);
+  COUNTER("tcp_dropped_total",
+          "Answers there was no memory for, closing their TCP client.",
+          tcp_dropped);
+  COUNTER("tls_handshakes_total", "TLS connections opened to upstreams.",
+          tls_handshakes);
+  COUNTER("tls_resumed_total",
+          "TLS connections that resumed an earlier session.", tls_resumed);
+  COUNTER("reloads_total", "Reloads of chnroute, the ip list and the "
+          "domain lists.", reloads);
+  COUNTER("reload_failures_total",
+          "Reloads that failed and kept the previous lists.",
+          reload_failures);
+  GAUGE("chnroute_entries", "Merged chnroute networks, IPv4 and IPv6.",
+        chnroute_entries);
+  GAUGE("iplist_entries", "Addresses in the ip blacklist.", iplist_entries);
+  GAUGE("domains_entries", "Suffixes in the domain lists.", domains_entries);
+
+#undef COUNTER
+#undef GAUGE
+
+#define UPSTREAM_LABELS "worker=\"%d\",upstream=\"%s\""
+  fprintf(f, "# HELP chinadns_upstream_answers_total Answers by upstream.\n"
+             "# TYPE chinadns_upstream_answers_total counter\n");
+  for (w = 0; w < slots_len; w++)
+    for (i = 0; i < names_len; i++)
+      fprintf(f, "chinadns_upstream_answers_total{" UPSTREAM_LABELS "} %llu\n",
+              w, names[i].name,
+              (unsigned long long)slot(w)->upstreams[i].answers);
+  fprintf(f, "# HELP chinadns_upstream_losses_total Queries an upstream "
+             "never answered.\n"
+             "# TYPE chinadns_upstream_losses_total counter\n");
+  for (w = 0; w < slots_len; w++)
+    for (i = 0; i < names_len; i++)
+      fprintf(f, "chinadns_upstream_losses_total{" UPSTREAM_LABELS "} %llu\n",
+              w, names[i].name,
+              (unsigned long long)slot(w)->upstreams[i].losses);
+  fprintf(f, "# HELP chinadns_upstream_errors_total Socket errors by "
+             "upstream.\n"
+             "# TYPE chinadns_upstream_errors_total counter\n");
+  for (w = 0; w < slots_len; w++)
+    for (i = 0; i < names_len; i++)
+      fprintf(f, "chinadns_upstream_errors_total{" UPSTREAM_LABELS "} %llu\n",
+              w, names[i].name,
+              (unsigned long long)slot(w)->upstreams[i].errors);
+  fprintf(f, "# HELP chinadns_upstream_up Whether the circuit breaker of "
+             "an upstream is closed.\n"
+             "# TYPE chinadns_upstream_up gauge\n");
+  for (w = 0; w < slots_len; w++)
+    for (i = 0; i < names_len; i++)
+      fprintf(f, "chinadns_upstream_up{" UPSTREAM_LABELS "} %d\n", w,
+              names[i].name, slot(w)->upstreams[i].state == UPSTREAM_UP);
+  fprintf(f, "# HELP chinadns_upstream_srtt_milliseconds Smoothed round "
+             "trip time.\n"
+             "# TYPE chinadns_upstream_srtt_milliseconds gauge\n");
+  for (w = 0; w < slots_len; w++)
+    for (i = 0; i < names_len; i++)
+      fprintf(f, "chinadns_upstream_srtt_milliseconds{" UPSTREAM_LABELS "} "
+                 "%.1f\n", w, names[i].name, slot(w)->upstreams[i].srtt);
+  fprintf(f, "# HELP chinadns_upstream_rtt_milliseconds Round trip time of "
+             "answers.\n"
+             "# TYPE chinadns_upstream_rtt_milliseconds histogram\n");
+  for (w = 0; w < slots_len; w++) {
+    for (i = 0; i < names_len; i++) {
+      const metrics_upstream_t *m = &slot(w)->upstreams[i];
+      uint64_t count = 0;
+      for (b = 0; b <= METRICS_RTT_BUCKETS; b++) {
+        count += m->rtt[b];
+        if (b < METRICS_RTT_BUCKETS)
+          fprintf(f, "chinadns_upstream_rtt_milliseconds_bucket{"
+                     UPSTREAM_LABELS ",le=\"%u\"} %llu\n", w, names[i].name,
+                  metrics_rtt_bounds[b], (unsigned long long)count);
+        else
+          fprintf(f, "chinadns_upstream_rtt_milliseconds_bucket{"
+                     UPSTREAM_LABELS ",le=\"+Inf\"} %llu\n", w, names[i].name,
+                  (unsigned long long)count);
+      }
+      fprintf(f, "chinadns_upstream_rtt_milliseconds_sum{" UPSTREAM_LABELS
+                 "} %llu\n", w, names[i].name,
+              (unsigned long long)m->rtt_sum);
+      fprintf(f, "chinadns_upstream_rtt_milliseconds_count{" UPSTREAM_LABELS
+                 "} %llu\n", w, names[i].name, (unsigned long long)count);
+    }
+  }
+#undef UPSTREAM_LABELS
+}
+
+static metrics_t *slot(int worker_id) {
+  return (metrics_t *)(slots + slot_size * worker_id);
+}
+
+static void accept_cb(int fd, int events, void *data) {
+  conn_t *conn = NULL;
+  int sock, i;
+  while (-1 != (sock = accept(fd, NULL, NULL))) {
+    for (i = 0; i < MAX_CONNS; i++) {
+      if (conns[i].fd == -1) {
+        conn = &conns[i];
+        break;
+      }
+    }
+    if (conn == NULL ||
+        -1 == fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) ||
+        0 != loop_add(sock, LOOP_READ, conn_cb, conn)) {
+      close(sock);
+      continue;
+    }
+    conn->fd = sock;
+    conn->request_len = 0;
+    conn->response = NULL;
+    timeout_init(&conn->timeout, conn_expire, conn);
+    timeout_add(&conn->timeout, timeout_now() + CONN_TIMEOUT);
+    conn = NULL;
+  }
+}
+
+static void conn_cb(int fd, int events, void *data) {
+  conn_t *conn = data;
+  ssize_t n;
+
+  if (conn->response == NULL) {
+    FILE *f;
+    size_t size;
+    char *body;
+    n = read(fd, conn->request + conn->request_len,
+             REQUEST_SIZE - 1 - conn->request_len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n <= 0) {
+      conn_close(conn);
+      return;
+    }
+    conn->request_len += n;
+    conn->request[conn->request_len] = '\0';
+    // whatever is asked for, once the headers are in
+    if (!strstr(conn->request, "\r\n\r\n") && !strstr(conn->request, "\n\n") &&
+        conn->request_len < REQUEST_SIZE - 1)
+      return;
+    f = open_memstream(&body, &size);
+    if (f == NULL) {
+      conn_close(conn);
+      return;
+    }
+    metrics_write(f);
+    fclose(f);
+    f = open_memstream(&conn->response, &conn->response_len);
+    if (f == NULL) {
+      free(body);
+      conn_close(conn);
+      return;
+    }
+    fprintf(f, "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %lu\r\n"
+               "Connection: close\r\n\r\n", (unsigned long)size);
+    fwrite(body, 1, size, f);
+    fclose(f);
+    free(body);
+    conn->response_off = 0;
+    loop_mod(fd, LOOP_WRITE);
+  }
+  n = write(fd, conn->response + conn->response_off,
+            conn->response_len - conn->response_off);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n == -1) {
+    conn_close(conn);
+    return;
+  }
+  conn->response_off += n;
+  if (conn->response_off == conn->response_len)
+    conn_close(conn);
+}
+
+static void conn_expire(void *data) {
+  conn_close(data);
+}
+
+static void conn_close(conn_t *conn) {
+  loop_del(conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  free(conn->response);
+  conn->response = NULL;
+  timeout_del(&conn->timeout);
+}
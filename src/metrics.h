@@ -0,0 +1,97 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+
+// upper bounds in milliseconds, and one more bucket for the rest
+#define METRICS_RTT_BUCKETS 12
+extern const uint32_t metrics_rtt_bounds[METRICS_RTT_BUCKETS];
+
+typedef struct {
+  uint64_t answers;
+  // queries that got no answer, and socket errors
+  uint64_t losses;
+  uint64_t errors;
+  uint64_t rtt_sum;
+  uint64_t rtt[METRICS_RTT_BUCKETS + 1];
+  // copied from the upstream_t by the worker
+  int state;
+  float srtt;
+} metrics_upstream_t;
+
+/* the counters of one worker, in memory shared by all of them. only the
+   worker writes its own */
+typedef struct {
+  uint64_t queries;
+  uint64_t malformed;
+  uint64_t cache_hits;
+  uint64_t prefetches;
+  uint64_t stale_answers;
+  // responses by verdict, indexed by LOG_PASS and so on
+  uint64_t verdicts[4];
+  uint64_t hedges;
+  uint64_t coalesced;
+  uint64_t routed_chn;
+  uint64_t routed_foreign;
+  uint64_t tcp_queries;
+  // suspect answers held now
+  uint64_t held;
+
+  // copied from the other modules by the worker
+  uint64_t pending;
+  uint64_t pending_size;
+  uint64_t pending_dropped;
+  uint64_t pool_exhausted;
+  uint64_t cache_evicted;
+  uint64_t cache_skipped;
+  uint64_t log_dropped;
+  uint64_t log_limited;
+  uint64_t truncated;
+  uint64_t tcp_connections;
+  uint64_t tcp_rejected;
+  uint64_t tcp_dropped;
+  uint64_t tls_handshakes;
+  uint64_t tls_resumed;
+
+  // written by the worker on reload
+  uint64_t reloads;
+  uint64_t reload_failures;
+  uint64_t chnroute_entries;
+  uint64_t iplist_entries;
+  uint64_t domains_entries;
+
+  metrics_upstream_t upstreams[];
+} metrics_t;
+
+/* the calling worker's counters */
+extern metrics_t *metrics;
+
+/* allocate counters for every worker before forking. upstreams are
+   labeled by name */
+int metrics_init(int workers, const upstream_t *upstreams, int upstreams_len);
+
+/* use the counters of worker_id from now on */
+void metrics_select(int worker_id);
+
+static inline void metrics_on_answer(int upstream, uint64_t rtt_ms) {
+  metrics_upstream_t *m = &metrics->upstreams[upstream];
+  int i = 0;
+  while (i < METRICS_RTT_BUCKETS && rtt_ms > metrics_rtt_bounds[i])
+    i++;
+  m->rtt[i]++;
+  m->rtt_sum += rtt_ms;
+  m->answers++;
+}
+
+/* serve the counters of all workers as Prometheus text over HTTP on a
+   stream socket bound to addr */
+int metrics_listen(const struct sockaddr *addr, socklen_t addrlen);
+
+/* write the counters of all workers in Prometheus text format */
+void metrics_write(FILE *f);
+
+#endif
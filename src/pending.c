@@ -0,0 +1,294 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "pending.h"
+
+// the whole 16-bit id space
+#define PENDING_MAX 65536
+
+// preallocated, so forwarding never allocates
+static pending_t *entries = NULL;
+static int capacity = 0;
+static int count = 0;
+static int free_list = -1;
+static unsigned long exhausted = 0;
+static pool_t *buf_pool;
+
+// open addressing index over ids, linear probing, at least twice the
+// number of entries
+static int *slots = NULL;
+static uint32_t slot_mask;
+
+// chained index over keys, as many buckets as id slots
+static int *key_buckets = NULL;
+
+static waiter_t *waiters = NULL;
+static waiter_t *free_waiters = NULL;
+
+static uint32_t rand_state;
+
+static uint16_t next_id();
+static int find_slot(uint16_t id);
+static uint32_t hash_key(const unsigned char *key, size_t keylen);
+static void drop_key(pending_t *p);
+
+int pending_init(int size, pool_t *bufs, timeout_cb on_delay,
+                 timeout_cb on_expire, timeout_cb on_hedge,
+                 timeout_cb on_stale) {
+  int fd, i;
+  uint32_t nslots = 2;
+  struct timeval tv;
+  if (size < 1)
+    size = 1;
+  if (size > PENDING_MAX)
+    size = PENDING_MAX;
+  while (nslots < (uint32_t)size * 2)
+    nslots <<= 1;
+  entries = calloc(size, sizeof(pending_t));
+  slots = malloc(nslots * sizeof(int));
+  key_buckets = malloc(nslots * sizeof(int));
+  waiters = calloc(size, sizeof(waiter_t));
+  if (entries == NULL || slots == NULL || key_buckets == NULL ||
+      waiters == NULL)
+    return -1;
+  memset(slots, 0xff, nslots * sizeof(int));
+  memset(key_buckets, 0xff, nslots * sizeof(int));
+  slot_mask = nslots - 1;
+  capacity = size;
+  buf_pool = bufs;
+  for (i = capacity - 1; i >= 0; i--) {
+    timeout_init(&entries[i].delay_timeout, on_delay, &entries[i]);
+    timeout_init(&entries[i].expire_timeout, on_expire, &entries[i]);
+    timeout_init(&entries[i].hedge_timeout, on_hedge, &entries[i]);
+    timeout_init(&entries[i].stale_timeout, on_stale, &entries[i]);
+    entries[i].next = free_list;
+    free_list = i;
+    waiters[i].next = free_waiters;
+    free_waiters = &waiters[i];
+  }
+
+  rand_state = 0;
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1) {
+    if (sizeof(rand_state) != read(fd, &rand_state, sizeof(rand_state)))
+      rand_state = 0;
+    close(fd);
+  }
+  if (rand_state == 0) {
+    gettimeofday(&tv, 0);
+    rand_state = (tv.tv_sec << 8) ^ tv.tv_usec ^ (getpid() << 16);
+  }
+  if (rand_state == 0)
+    rand_state = 1;
+  return 0;
+}
+
+pending_t *pending_add(uint16_t old_id, const struct sockaddr *addr,
+                       socklen_t addrlen, int remaining) {
+  pending_t *p;
+  uint16_t id;
+  int i, slot;
+
+  if (free_list == -1) {
+    exhausted++;
+    return NULL;
+  }
+  do {
+    id = next_id();
+  } while (find_slot(id) != -1);
+
+  i = free_list;
+  p = &entries[i];
+  free_list = p->next;
+
+  p->id = id;
+  p->old_id = old_id;
+  p->remaining = remaining;
+  memcpy(&p->addr, addr, addrlen);
+  p->addrlen = addrlen;
+  p->conn = 0;
+  p->replied = 0;
+  p->edns = 0;
+  p->group = 0;
+  p->cache_bits = 0;
+  p->delay_buf = NULL;
+  p->delay_buflen = 0;
+  p->sent_mask = 0;
+  p->answered_mask = 0;
+  p->suspect_mask = 0;
+  p->hedge_mask = 0;
+  p->sent_at = 0;
+  p->hedged_at = 0;
+  p->query_buf = NULL;
+  p->query_buflen = 0;
+  p->stale_buf = NULL;
+  p->stale_buflen = 0;
+  p->waiters = NULL;
+  p->keylen = 0;
+
+  slot = id & slot_mask;
+  while (slots[slot] != -1)
+    slot = (slot + 1) & slot_mask;
+  slots[slot] = i;
+  count++;
+  return p;
+}
+
+pending_t *pending_lookup(uint16_t id) {
+  int slot = find_slot(id);
+  if (slot == -1)
+    return NULL;
+  return &entries[slots[slot]];
+}
+
+void pending_set_key(pending_t *p, const unsigned char *key, size_t keylen) {
+  uint32_t bucket;
+  if (keylen > PENDING_KEY_LEN)
+    return;
+  memcpy(p->key, key, keylen);
+  p->keylen = keylen;
+  p->key_hash = hash_key(key, keylen);
+  bucket = p->key_hash & slot_mask;
+  p->key_next = key_buckets[bucket];
+  key_buckets[bucket] = p - entries;
+}
+
+pending_t *pending_find(const unsigned char *key, size_t keylen) {
+  uint32_t hash = hash_key(key, keylen);
+  int i;
+  for (i = key_buckets[hash & slot_mask]; i != -1; i = entries[i].key_next) {
+    pending_t *p = &entries[i];
+    // one that has replied may wait on, but its waiters never would
+    if (p->key_hash == hash && p->keylen == keylen && !p->replied &&
+        0 == memcmp(p->key, key, keylen))
+      return p;
+  }
+  return NULL;
+}
+
+waiter_t *pending_add_waiter(pending_t *p, uint16_t old_id,
+                             const struct sockaddr *addr, socklen_t addrlen) {
+  waiter_t *w = free_waiters;
+  if (w == NULL)
+    return NULL;
+  free_waiters = w->next;
+  w->old_id = old_id;
+  memcpy(&w->addr, addr, addrlen);
+  w->addrlen = addrlen;
+  w->conn = 0;
+  w->edns = 0;
+  w->next = p->waiters;
+  p->waiters = w;
+  return w;
+}
+
+void pending_remove(pending_t *p) {
+  int hole, j;
+
+  timeout_del(&p->delay_timeout);
+  timeout_del(&p->expire_timeout);
+  timeout_del(&p->hedge_timeout);
+  timeout_del(&p->stale_timeout);
+  if (p->delay_buf)
+    pool_put(buf_pool, p->delay_buf);
+  p->delay_buf = NULL;
+  if (p->query_buf)
+    pool_put(buf_pool, p->query_buf);
+  p->query_buf = NULL;
+  if (p->stale_buf)
+    pool_put(buf_pool, p->stale_buf);
+  p->stale_buf = NULL;
+  while (p->waiters) {
+    waiter_t *w = p->waiters;
+    p->waiters = w->next;
+    w->next = free_waiters;
+    free_waiters = w;
+  }
+  if (p->keylen)
+    drop_key(p);
+
+  // backward shift deletion, so no tombstones are needed
+  hole = find_slot(p->id);
+  p->next = free_list;
+  free_list = slots[hole];
+  j = hole;
+  while (1) {
+    int home;
+    j = (j + 1) & slot_mask;
+    if (slots[j] == -1)
+      break;
+    home = entries[slots[j]].id & slot_mask;
+    // skip entries whose home lies cyclically in (hole, j]
+    if (hole <= j ? (hole < home && home <= j) : (hole < home || home <= j))
+      continue;
+    slots[hole] = slots[j];
+    hole = j;
+  }
+  slots[hole] = -1;
+  count--;
+}
+
+int pending_count() {
+  return count;
+}
+
+unsigned long pending_exhausted() {
+  return exhausted;
+}
+
+static uint16_t next_id() {
+  // xorshift32
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state >> 16;
+}
+
+static uint32_t hash_key(const unsigned char *key, size_t keylen) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < keylen; i++) {
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void drop_key(pending_t *p) {
+  int *pi = &key_buckets[p->key_hash & slot_mask];
+  while (&entries[*pi] != p)
+    pi = &entries[*pi].key_next;
+  *pi = p->key_next;
+  p->keylen = 0;
+}
+
+static int find_slot(uint16_t id) {
+  int slot = id & slot_mask;
+  while (slots[slot] != -1) {
+    if (entries[slots[slot]].id == id)
+      return slot;
+    slot = (slot + 1) & slot_mask;
+  }
+  return -1;
+}
@@ -0,0 +1,119 @@
+#ifndef PENDING_H
+#define PENDING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "timeout.h"
+
+// wire name, type, class and flags
+#define PENDING_KEY_LEN (NS_MAXCDNAME + 6)
+
+/* a client that asked the same question while it was pending, and gets
+   the same answer */
+typedef struct waiter_s {
+  uint16_t old_id;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint32_t conn;
+  int edns;
+  struct waiter_s *next;
+} waiter_t;
+
+/* a query forwarded to upstreams and waiting for their answers */
+typedef struct {
+  // id sent to upstreams
+  uint16_t id;
+  // id from the client
+  uint16_t old_id;
+  // upstreams that haven't answered yet
+  int remaining;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  // the client's TCP connection, 0 for UDP
+  uint32_t conn;
+  // an answer went out to the client
+  int replied;
+  // the payload size the client advertised, 0 without EDNS0
+  int edns;
+  // the domain list the name is in, which decides who is asked
+  int group;
+  // what its answer is cached under, from cache_query_bits()
+  int cache_bits;
+  // suspect answer held back for empty_result_delay, from the buffer
+  // pool
+  char *delay_buf;
+  size_t delay_buflen;
+  timeout_t delay_timeout;
+  timeout_t expire_timeout;
+  // bits are upstream indexes
+  uint64_t sent_mask;
+  uint64_t answered_mask;
+  // answered with something filtered or suspect so far
+  uint64_t suspect_mask;
+  uint64_t hedge_mask;
+  // milliseconds on the timeout clock
+  uint64_t sent_at;
+  uint64_t hedged_at;
+  // the query, kept while it may still be sent to more upstreams, from
+  // the buffer pool
+  char *query_buf;
+  size_t query_buflen;
+  timeout_t hedge_timeout;
+  // expired answer for the clients if no usable one comes in time, from
+  // the buffer pool
+  char *stale_buf;
+  size_t stale_buflen;
+  timeout_t stale_timeout;
+  // other clients that asked the same, from the waiter pool
+  waiter_t *waiters;
+  // the question, if identical ones may wait on this query
+  unsigned char key[PENDING_KEY_LEN];
+  uint16_t keylen;
+  uint32_t key_hash;
+  // hash chain of the key index
+  int key_next;
+  // free list, index into the entry pool
+  int next;
+} pending_t;
+
+/* preallocate size entries, and as many waiters. delay_buf, query_buf
+   and stale_buf are returned to bufs on removal. on_delay, on_expire,
+   on_hedge and on_stale get the pending_t when its delay_timeout,
+   expire_timeout, hedge_timeout or stale_timeout fires */
+int pending_init(int size, pool_t *bufs, timeout_cb on_delay,
+                 timeout_cb on_expire, timeout_cb on_hedge,
+                 timeout_cb on_stale);
+
+/* assign a new random id that isn't in use and track the query.
+   return NULL when all entries are in use.
+   entries never move, so pointers stay valid until pending_remove() */
+pending_t *pending_add(uint16_t old_id, const struct sockaddr *addr,
+                       socklen_t addrlen, int remaining);
+
+pending_t *pending_lookup(uint16_t id);
+
+/* let queries with the same key wait on p, until it's removed */
+void pending_set_key(pending_t *p, const unsigned char *key, size_t keylen);
+
+/* the query with this key that hasn't replied yet, or NULL */
+pending_t *pending_find(const unsigned char *key, size_t keylen);
+
+/* another client waiting on p. return NULL when all waiters are in use */
+waiter_t *pending_add_waiter(pending_t *p, uint16_t old_id,
+                             const struct sockaddr *addr, socklen_t addrlen);
+
+/* cancel the timeouts of p, release its buffers and waiters and forget
+   it */
+void pending_remove(pending_t *p);
+
+int pending_count();
+
+/* pending_add() calls that found every entry in use */
+unsigned long pending_exhausted();
+
+#endif
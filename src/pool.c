@@ -0,0 +1,58 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+int pool_init(pool_t *pool, size_t size, int count) {
+  int i;
+  // free objects hold the free list link
+  if (size < sizeof(void *))
+    size = sizeof(void *);
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  pool->mem = malloc(size * count);
+  if (pool->mem == NULL && count > 0)
+    return -1;
+  pool->size = size;
+  pool->count = count;
+  pool->free_list = NULL;
+  pool->used = 0;
+  pool->exhausted = 0;
+  for (i = count - 1; i >= 0; i--) {
+    *(void **)(pool->mem + size * i) = pool->free_list;
+    pool->free_list = pool->mem + size * i;
+  }
+  return 0;
+}
+
+void *pool_get(pool_t *pool) {
+  void *obj = pool->free_list;
+  if (obj == NULL) {
+    pool->exhausted++;
+    return NULL;
+  }
+  pool->free_list = *(void **)obj;
+  pool->used++;
+  return obj;
+}
+
+void pool_put(pool_t *pool, void *obj) {
+  *(void **)obj = pool->free_list;
+  pool->free_list = obj;
+  pool->used--;
+}
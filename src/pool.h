@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* fixed-size objects preallocated in one block */
+typedef struct {
+  char *mem;
+  size_t size;
+  int count;
+  void *free_list;
+  int used;
+  // pool_get() calls that found the pool empty
+  unsigned long exhausted;
+} pool_t;
+
+/* count objects of size bytes each */
+int pool_init(pool_t *pool, size_t size, int count);
+
+/* NULL when every object is in use */
+void *pool_get(pool_t *pool);
+
+void pool_put(pool_t *pool, void *obj);
+
+#endif
@@ -0,0 +1,688 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "routes.h"
+
+#define IMAGE_MAGIC "ChinaDNS"
+#define IMAGE_VERSION 2
+#define IMAGE_BYTE_ORDER 0x01020304
+// sections start on cache lines
+#define IMAGE_ALIGN 64
+#define ALIGNED(n) (((n) + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1))
+// the domain slots are a power of two, probed with a mask
+#define IS_SLOTS_LEN(len) ((len) % sizeof(uint64_t) == 0 && \
+                           (((len) / sizeof(uint64_t)) & \
+                            ((len) / sizeof(uint64_t) - 1)) == 0)
+
+enum {
+  SECT_L1,
+  SECT_BLOCKS,
+  SECT_LEAVES,
+  SECT_NODES6,
+  SECT_IPS,
+  SECT_DOMAINS,
+  SECT_MAX
+};
+
+/* the lookup structures exactly as they are in memory, each in its own
+   section after the header */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // as the writer stored it
+  uint32_t byte_order;
+  // sizes of the structs that differ between word sizes
+  uint32_t layout;
+  // CRC-32 of everything after the header
+  uint32_t checksum;
+  // merged networks and addresses
+  uint32_t chnroute_entries;
+  uint32_t chnroute6_entries;
+  uint32_t ip_list_entries;
+  uint32_t domains_entries;
+  uint32_t domains_depth;
+  uint32_t unused;
+  uint64_t size;
+  struct {
+    uint64_t offset;
+    uint64_t len;
+  } sections[SECT_MAX];
+} image_header_t;
+
+#define IMAGE_LAYOUT ((uint32_t)sizeof(lpm_block_t) << 16 | \
+                      (uint32_t)sizeof(lpm6_node_t))
+
+/* an image whose checksum was verified, as it was then. chinadns-compile
+   renames a new one over, which changes the inode, and one rewritten in
+   place changes its times, which are compared to the nanosecond so that
+   a rewrite within the same second is noticed too */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+} verified_t;
+
+// as many as a load maps, so a reload finds them all
+#define VERIFIED_MAX ROUTES_MAPS
+static verified_t verified[VERIFIED_MAX];
+static int verified_next = 0;
+
+static int load_chnroute(routes_t *r, const char *path);
+static int load_ip_list(routes_t *r, const char *path);
+static int load_domains(routes_t *r, const char *chn_path,
+                        const char *foreign_path);
+static int parse_chnroute(lpm_t *list, lpm6_t *list6, const char *path);
+static int parse_ip_list(ip_list_t *list, const char *path);
+static int parse_domains(domains_t *d, const char *path, int group);
+static int is_image(const char *path);
+static const image_header_t *map_image(routes_t *r, const char *path);
+static int is_verified(const struct stat *st);
+static void set_verified(const struct stat *st);
+static int same_time(const struct timespec *a, const struct timespec *b);
+static int check_indices(const image_header_t *h);
+static const void *section(const image_header_t *h, int sect);
+static uint32_t crc32(const unsigned char *buf, size_t len);
+
+routes_t *routes_load(const char *chnroute_file, const char *ip_list_file,
+                      const char *chn_domains_file,
+                      const char *foreign_domains_file) {
+  routes_t *r = calloc(1, sizeof(routes_t));
+  if (r == NULL)
+    return NULL;
+  lpm_init(&r->chnroute);
+  lpm6_init(&r->chnroute6);
+  domains_init(&r->domains);
+  if (0 != load_ip_list(r, ip_list_file) ||
+      0 != load_chnroute(r, chnroute_file) ||
+      0 != load_domains(r, chn_domains_file, foreign_domains_file)) {
+    routes_free(r);
+    return NULL;
+  }
+  return r;
+}
+
+void routes_free(routes_t *r) {
+  int i;
+  if (!r->chnroute_mapped) {
+    lpm_free(&r->chnroute);
+    lpm6_free(&r->chnroute6);
+  }
+  if (!r->ip_list_mapped)
+    free(r->ip_list.ips);
+  if (!r->domains_mapped)
+    domains_free(&r->domains);
+  for (i = 0; i < r->maps_len; i++)
+    munmap(r->maps[i].addr, r->maps[i].len);
+  free(r);
+}
+
+int cmp_in_addr(const void *a, const void *b) {
+  struct in_addr *ina = (struct in_addr *)a;
+  struct in_addr *inb = (struct in_addr *)b;
+  if (ina->s_addr == inb->s_addr)
+    return 0;
+  if (ina->s_addr > inb->s_addr)
+    return 1;
+  return -1;
+}
+
+int routes_write_image(const routes_t *r, const char *path) {
+  image_header_t *h;
+  const void *data[SECT_MAX];
+  size_t lens[SECT_MAX];
+  size_t size, off;
+  unsigned char *image;
+  char *tmp_path;
+  FILE *fp;
+  int i, ok;
+
+  data[SECT_L1] = r->chnroute.l1;
+  lens[SECT_L1] = r->chnroute.l1 ? (1 << 16) * sizeof(uint32_t) : 0;
+  data[SECT_BLOCKS] = r->chnroute.blocks;
+  lens[SECT_BLOCKS] = r->chnroute.blocks_len * sizeof(lpm_block_t);
+  data[SECT_LEAVES] = r->chnroute.leaves;
+  lens[SECT_LEAVES] = r->chnroute.leaves_len * 4 * sizeof(uint64_t);
+  data[SECT_NODES6] = r->chnroute6.nodes;
+  lens[SECT_NODES6] = r->chnroute6.nodes_len * sizeof(lpm6_node_t);
+  data[SECT_IPS] = r->ip_list.ips;
+  lens[SECT_IPS] = r->ip_list.entries * sizeof(struct in_addr);
+  data[SECT_DOMAINS] = r->domains.slots;
+  lens[SECT_DOMAINS] = r->domains.slots ?
+                       ((size_t)r->domains.mask + 1) * sizeof(uint64_t) : 0;
+
+  size = ALIGNED(sizeof(image_header_t));
+  for (i = 0; i < SECT_MAX; i++)
+    size += ALIGNED(lens[i]);
+  // built whole in memory, so the padding is zeroed and checksummed too
+  image = calloc(1, size);
+  if (image == NULL)
+    return -1;
+  h = (image_header_t *)image;
+  memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+  h->version = IMAGE_VERSION;
+  h->byte_order = IMAGE_BYTE_ORDER;
+  h->layout = IMAGE_LAYOUT;
+  h->chnroute_entries = r->chnroute.entries;
+  h->chnroute6_entries = r->chnroute6.entries;
+  h->ip_list_entries = r->ip_list.entries;
+  h->domains_entries = r->domains.entries;
+  h->domains_depth = r->domains.depth;
+  h->size = size;
+  off = ALIGNED(sizeof(image_header_t));
+  for (i = 0; i < SECT_MAX; i++) {
+    h->sections[i].offset = off;
+    h->sections[i].len = lens[i];
+    if (lens[i])
+      memcpy(image + off, data[i], lens[i]);
+    off += ALIGNED(lens[i]);
+  }
+  h->checksum = crc32(image + ALIGNED(sizeof(image_header_t)),
+                      size - ALIGNED(sizeof(image_header_t)));
+
+  tmp_path = malloc(strlen(path) + 5);
+  if (tmp_path == NULL) {
+    free(image);
+    return -1;
+  }
+  sprintf(tmp_path, "%s.tmp", path);
+  fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    ERR("fopen");
+    free(tmp_path);
+    free(image);
+    return -1;
+  }
+  ok = size == fwrite(image, 1, size, fp);
+  ok = (0 == fclose(fp)) && ok;
+  if (!ok || 0 != rename(tmp_path, path)) {
+    ERR("write image");
+    unlink(tmp_path);
+    ok = 0;
+  }
+  free(tmp_path);
+  free(image);
+  return ok ? 0 : -1;
+}
+
+static int load_chnroute(routes_t *r, const char *path) {
+  const image_header_t *h;
+  if (path == NULL)
+    return 0;
+  if (!is_image(path))
+    return parse_chnroute(&r->chnroute, &r->chnroute6, path);
+  if (NULL == (h = map_image(r, path)))
+    return -1;
+  r->chnroute_mapped = 1;
+  // the lookups only read these, and nothing in a mapped lpm is freed
+  r->chnroute.l1 = (uint32_t *)section(h, SECT_L1);
+  r->chnroute.blocks = (lpm_block_t *)section(h, SECT_BLOCKS);
+  r->chnroute.blocks_len = h->sections[SECT_BLOCKS].len /
+                           sizeof(lpm_block_t);
+  r->chnroute.leaves = (uint64_t *)section(h, SECT_LEAVES);
+  r->chnroute.leaves_len = h->sections[SECT_LEAVES].len /
+                           (4 * sizeof(uint64_t));
+  r->chnroute.entries = h->chnroute_entries;
+  r->chnroute6.nodes = (lpm6_node_t *)section(h, SECT_NODES6);
+  r->chnroute6.nodes_len = h->sections[SECT_NODES6].len /
+                           sizeof(lpm6_node_t);
+  r->chnroute6.entries = h->chnroute6_entries;
+  return 0;
+}
+
+static int load_ip_list(routes_t *r, const char *path) {
+  const image_header_t *h;
+  if (path == NULL)
+    return 0;
+  if (!is_image(path))
+    return parse_ip_list(&r->ip_list, path);
+  if (NULL == (h = map_image(r, path)))
+    return -1;
+  r->ip_list_mapped = 1;
+  r->ip_list.ips = (struct in_addr *)section(h, SECT_IPS);
+  r->ip_list.entries = h->ip_list_entries;
+  return 0;
+}
+
+static int load_domains(routes_t *r, const char *chn_path,
+                        const char *foreign_path) {
+  const image_header_t *h;
+  const char *image = NULL;
+  if (chn_path && is_image(chn_path))
+    image = chn_path;
+  else if (foreign_path && is_image(foreign_path))
+    image = foreign_path;
+  if (image == NULL) {
+    if ((chn_path && 0 != parse_domains(&r->domains, chn_path,
+                                        DOMAINS_CHN)) ||
+        (foreign_path && 0 != parse_domains(&r->domains, foreign_path,
+                                            DOMAINS_FOREIGN)))
+      return -1;
+    if (0 != domains_build(&r->domains)) {
+      VERR("Can't allocate domain lists\n");
+      return -1;
+    }
+    return 0;
+  }
+  // the image has both lists merged, and can't be added to
+  if ((chn_path && 0 != strcmp(chn_path, image)) ||
+      (foreign_path && 0 != strcmp(foreign_path, image))) {
+    VERR("%s is an image, the other domain list must be the same one\n",
+         image);
+    return -1;
+  }
+  if (NULL == (h = map_image(r, image)))
+    return -1;
+  r->domains_mapped = 1;
+  r->domains.slots = (uint64_t *)section(h, SECT_DOMAINS);
+  if (r->domains.slots)
+    r->domains.mask = h->sections[SECT_DOMAINS].len / sizeof(uint64_t) - 1;
+  r->domains.depth = h->domains_depth;
+  r->domains.entries = h->domains_entries;
+  return 0;
+}
+
+static int parse_ip_list(ip_list_t *list, const char *path) {
+  FILE *fp;
+  char line_buf[32];
+  char *line = NULL;
+  size_t len = sizeof(line_buf);
+  int i = 0;
+  list->entries = 0;
+  list->ips = NULL;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    ERR("fopen");
+    VERR("Can't open ip list: %s\n", path);
+    return -1;
+  }
+  while ((line = fgets(line_buf, len, fp))) {
+    list->entries++;
+  }
+
+  list->ips = calloc(list->entries, sizeof(struct in_addr));
+  if (list->ips == NULL && list->entries) {
+    VERR("Can't allocate ip list\n");
+    fclose(fp);
+    return -1;
+  }
+  if (0 != fseek(fp, 0, SEEK_SET)) {
+    VERR("fseek");
+    fclose(fp);
+    return -1;
+  }
+  while ((line = fgets(line_buf, len, fp))) {
+    char *sp_pos;
+    // the file may have grown since it was counted
+    if (i == list->entries)
+      break;
+    sp_pos = strchr(line, '\r');
+    if (sp_pos) *sp_pos = 0;
+    sp_pos = strchr(line, '\n');
+    if (sp_pos) *sp_pos = 0;
+    inet_aton(line, &list->ips[i]);
+    i++;
+  }
+
+  list->entries = i;
+  qsort(list->ips, list->entries, sizeof(struct in_addr), cmp_in_addr);
+  fclose(fp);
+  return 0;
+}
+
+static int parse_chnroute(lpm_t *list, lpm6_t *list6, const char *path) {
+  FILE *fp;
+  char line_buf[64];
+  char *line;
+  size_t len = sizeof(line_buf);
+  struct in_addr net;
+  struct in6_addr net6;
+  int prefixlen;
+  int i = 0;
+  int r;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    ERR("fopen");
+    VERR("Can't open chnroute: %s\n", path);
+    return -1;
+  }
+  while ((line = fgets(line_buf, len, fp))) {
+    char *sp_pos;
+    i++;
+    sp_pos = strchr(line, '\r');
+    if (sp_pos) *sp_pos = 0;
+    sp_pos = strchr(line, '\n');
+    if (sp_pos) *sp_pos = 0;
+    sp_pos = strchr(line, '/');
+    if (sp_pos)
+      *sp_pos = 0;
+    // IPv4 and IPv6 networks may be mixed in one file
+    if (strchr(line, ':')) {
+      prefixlen = sp_pos ? atoi(sp_pos + 1) : 128;
+      r = 1 == inet_pton(AF_INET6, line, &net6) &&
+          0 == lpm6_add(list6, addr6_key(&net6), prefixlen);
+    } else {
+      prefixlen = sp_pos ? atoi(sp_pos + 1) : 32;
+      r = 0 != inet_aton(line, &net) &&
+          0 == lpm_add(list, ntohl(net.s_addr), prefixlen);
+    }
+    if (!r) {
+      VERR("invalid addr %s in %s:%d\n", line, path, i);
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+
+  // compile into a trie, overlapping and adjacent networks are merged
+  if (0 != lpm_build(list) ||
+      (list6->entries && 0 != lpm6_build(list6))) {
+    VERR("Can't allocate chnroute\n");
+    return -1;
+  }
+  return 0;
+}
+
+// a name per line, or dnsmasq's server=/name/.../address lines, which is
+// how lists of Chinese domains usually come. a name after @@ is excepted
+// and asked of every upstream, as in gfwlist
+static int parse_domains(domains_t *d, const char *path, int group) {
+  FILE *fp;
+  char line_buf[1024];
+  char *line;
+  int i = 0;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    ERR("fopen");
+    VERR("Can't open domain list: %s\n", path);
+    return -1;
+  }
+  while ((line = fgets(line_buf, sizeof(line_buf), fp))) {
+    char *end = line + strlen(line);
+    char *name, *slash;
+    int g = group;
+    i++;
+    while (end > line && isspace((unsigned char)end[-1]))
+      *--end = 0;
+    while (isspace((unsigned char)*line))
+      line++;
+    if (*line == 0 || *line == '#')
+      continue;
+    if (0 == strncmp(line, "@@", 2)) {
+      g = DOMAINS_ALL;
+      line += 2;
+    }
+    // every name between the first slash and the last
+    if ((slash = strchr(line, '/'))) {
+      line = slash + 1;
+      if (NULL == (slash = strrchr(line, '/'))) {
+        VERR("invalid line in %s:%d\n", path, i);
+        fclose(fp);
+        return -1;
+      }
+      *slash = 0;
+    }
+    while ((name = strsep(&line, "/"))) {
+      // a suffix is matched at label boundaries anyway
+      while (*name == '.' || *name == '*')
+        name++;
+      if (0 != domains_add(d, name, g)) {
+        VERR("invalid domain %s in %s:%d\n", name, path, i);
+        fclose(fp);
+        return -1;
+      }
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int is_image(const char *path) {
+  char magic[sizeof(IMAGE_MAGIC) - 1];
+  int fd = open(path, O_RDONLY);
+  int r;
+  if (fd == -1)
+    return 0;
+  r = sizeof(magic) == read(fd, magic, sizeof(magic)) &&
+      0 == memcmp(magic, IMAGE_MAGIC, sizeof(magic));
+  close(fd);
+  return r;
+}
+
+// an image already mapped for another list of r is used again
+static const image_header_t *map_image(routes_t *r, const char *path) {
+  const image_header_t *h;
+  struct stat st;
+  void *p;
+  int fd, i;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || 0 != fstat(fd, &st)) {
+    ERR("open");
+    VERR("Can't open image: %s\n", path);
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  for (i = 0; i < r->maps_len; i++) {
+    if (r->maps[i].dev == st.st_dev && r->maps[i].ino == st.st_ino) {
+      close(fd);
+      return r->maps[i].addr;
+    }
+  }
+  if ((size_t)st.st_size < sizeof(image_header_t)) {
+    VERR("truncated image: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    ERR("mmap");
+    return NULL;
+  }
+  h = p;
+  if (h->version != IMAGE_VERSION) {
+    VERR("image version %u of %s is not %d\n", (unsigned)h->version, path,
+         IMAGE_VERSION);
+    goto bad;
+  }
+  if (h->byte_order != IMAGE_BYTE_ORDER || h->layout != IMAGE_LAYOUT) {
+    VERR("image %s was written on a different kind of machine\n", path);
+    goto bad;
+  }
+  if (h->size != (uint64_t)st.st_size) {
+    VERR("truncated image: %s\n", path);
+    goto bad;
+  }
+  for (i = 0; i < SECT_MAX; i++) {
+    if (h->sections[i].offset % IMAGE_ALIGN ||
+        h->sections[i].offset > h->size ||
+        h->sections[i].len > h->size - h->sections[i].offset) {
+      VERR("corrupt image: %s\n", path);
+      goto bad;
+    }
+  }
+  // a reader follows indices from the trie without checking them, so
+  // neither a flipped bit nor an index out of its section, as one written
+  // to fool the checksum may have, must get that far
+  if ((h->sections[SECT_L1].len &&
+       h->sections[SECT_L1].len != (1 << 16) * sizeof(uint32_t)) ||
+      h->ip_list_entries > INT_MAX ||
+      h->ip_list_entries * sizeof(struct in_addr) !=
+      h->sections[SECT_IPS].len ||
+      !IS_SLOTS_LEN(h->sections[SECT_DOMAINS].len) ||
+      (!is_verified(&st) &&
+       (h->checksum != crc32((const unsigned char *)p +
+                             ALIGNED(sizeof(image_header_t)),
+                             h->size - ALIGNED(sizeof(image_header_t))) ||
+        0 != check_indices(h)))) {
+    VERR("corrupt image: %s\n", path);
+    goto bad;
+  }
+  set_verified(&st);
+  r->maps[r->maps_len].addr = p;
+  r->maps[r->maps_len].len = st.st_size;
+  r->maps[r->maps_len].dev = st.st_dev;
+  r->maps[r->maps_len].ino = st.st_ino;
+  r->maps_len++;
+  return h;
+
+bad:
+  munmap(p, st.st_size);
+  return NULL;
+}
+
+static int is_verified(const struct stat *st) {
+  int i;
+  for (i = 0; i < VERIFIED_MAX; i++) {
+    if (verified[i].dev == st->st_dev && verified[i].ino == st->st_ino &&
+        verified[i].size == st->st_size &&
+        same_time(&verified[i].mtime, &st->st_mtim) &&
+        same_time(&verified[i].ctime, &st->st_ctim))
+      return 1;
+  }
+  return 0;
+}
+
+// the oldest is forgotten
+static void set_verified(const struct stat *st) {
+  verified_t *v;
+  if (is_verified(st))
+    return;
+  v = &verified[verified_next];
+  verified_next = (verified_next + 1) % VERIFIED_MAX;
+  v->dev = st->st_dev;
+  v->ino = st->st_ino;
+  v->size = st->st_size;
+  v->mtime = st->st_mtim;
+  v->ctime = st->st_ctim;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// every index a lookup follows is inside its section, and an IPv6 lookup
+// ends by the last stride. sections are in bounds of the image already
+static int check_indices(const image_header_t *h) {
+  const uint32_t *l1 = section(h, SECT_L1);
+  const lpm_block_t *blocks = section(h, SECT_BLOCKS);
+  const lpm6_node_t *nodes = section(h, SECT_NODES6);
+  const uint64_t *slots = section(h, SECT_DOMAINS);
+  uint64_t blocks_len = h->sections[SECT_BLOCKS].len / sizeof(lpm_block_t);
+  uint64_t leaves_len = h->sections[SECT_LEAVES].len /
+                        (4 * sizeof(uint64_t));
+  uint64_t nodes_len = h->sections[SECT_NODES6].len / sizeof(lpm6_node_t);
+  uint64_t slots_len = h->sections[SECT_DOMAINS].len / sizeof(uint64_t);
+  // the level of each node below the root, once its parent is seen
+  unsigned char *levels;
+  uint64_t i, j;
+  int w, ok = 1;
+
+  if (h->sections[SECT_BLOCKS].len % sizeof(lpm_block_t) ||
+      h->sections[SECT_LEAVES].len % (4 * sizeof(uint64_t)) ||
+      h->sections[SECT_NODES6].len % sizeof(lpm6_node_t) ||
+      blocks_len > INT_MAX || leaves_len > INT_MAX || nodes_len > INT_MAX ||
+      slots_len > (uint64_t)UINT32_MAX + 1)
+    return -1;
+  for (i = 0; l1 && i < (1 << 16); i++) {
+    if (l1[i] >= 2 && l1[i] - 2 >= blocks_len)
+      return -1;
+  }
+  for (i = 0; i < blocks_len; i++) {
+    for (w = 0; w < 4; w++) {
+      if (blocks[i].leaf[w] &&
+          (uint64_t)blocks[i].base[w] +
+          __builtin_popcountll(blocks[i].leaf[w]) > leaves_len)
+        return -1;
+    }
+  }
+  // a probe stops at an empty slot
+  for (i = 0; i < slots_len && slots[i]; i++);
+  if (slots && i == slots_len)
+    return -1;
+
+  if (nodes_len == 0)
+    return 0;
+  levels = malloc(nodes_len);
+  if (levels == NULL) {
+    ERR("malloc");
+    return -1;
+  }
+  memset(levels, 0xff, nodes_len);
+  levels[0] = 0;
+  // children come after their parent, as lpm6_build() allocates them
+  for (i = 0; i < nodes_len && ok; i++) {
+    int children = __builtin_popcountll(nodes[i].child);
+    if (children == 0 || levels[i] == 0xff)
+      continue;
+    if (levels[i] == LPM6_ROOT_SHIFT / 6 || nodes[i].base <= i ||
+        nodes[i].base + children > nodes_len) {
+      ok = 0;
+      break;
+    }
+    for (j = nodes[i].base; j < nodes[i].base + children; j++) {
+      if (levels[j] != 0xff && levels[j] != levels[i] + 1)
+        ok = 0;
+      levels[j] = levels[i] + 1;
+    }
+  }
+  free(levels);
+  return ok ? 0 : -1;
+}
+
+static const void *section(const image_header_t *h, int sect) {
+  if (h->sections[sect].len == 0)
+    return NULL;
+  return (const char *)h + h->sections[sect].offset;
+}
+
+static uint32_t crc32(const unsigned char *buf, size_t len) {
+  static uint32_t table[256];
+  uint32_t crc = 0xffffffff;
+  size_t i;
+  if (table[1] == 0) {
+    for (i = 0; i < 256; i++) {
+      uint32_t c = i;
+      int k;
+      for (k = 0; k < 8; k++)
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  for (i = 0; i < len; i++)
+    crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffff;
+}
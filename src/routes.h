@@ -0,0 +1,87 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "domains.h"
+#include "lpm.h"
+
+typedef struct {
+  int entries;
+  struct in_addr *ips;
+} ip_list_t;
+
+// one image for each list at most
+#define ROUTES_MAPS 3
+
+/* an image from chinadns-compile, mapped once however many of the lists
+   it is given as */
+typedef struct {
+  void *addr;
+  size_t len;
+  dev_t dev;
+  ino_t ino;
+} routes_map_t;
+
+/* what queries are routed and answers are judged by, loaded and
+   replaced as a whole */
+typedef struct {
+  ip_list_t ip_list;
+  lpm_t chnroute;
+  // IPv6 lines of the chnroute file
+  lpm6_t chnroute6;
+  // both domain lists
+  domains_t domains;
+
+  // images the lists point into, when loaded from chinadns-compile output.
+  // a list that does isn't freed on its own
+  routes_map_t maps[ROUTES_MAPS];
+  int maps_len;
+  int chnroute_mapped;
+  int ip_list_mapped;
+  int domains_mapped;
+} routes_t;
+
+/* load every list, NULL for a file leaves it empty. each file is either
+   text, or an image that is mapped read-only as it is, once for all the
+   lists it's given as. its checksum is only verified again once the
+   file changes. an image holds both domain lists, so if one is an image
+   the other is the same one or NULL. one load at a time, in any
+   thread */
+routes_t *routes_load(const char *chnroute_file, const char *ip_list_file,
+                      const char *chn_domains_file,
+                      const char *foreign_domains_file);
+
+void routes_free(routes_t *r);
+
+/* write every list as one image, which can be given as any file. it's
+   written aside and renamed over path, since a running process may have
+   the old one mapped. images are for the byte order and word size of the
+   machine that wrote them */
+int routes_write_image(const routes_t *r, const char *path);
+
+/* for bsearch() over the ip list */
+int cmp_in_addr(const void *a, const void *b);
+
+/* the top 64 bits, which is all the IPv6 chnroute looks at */
+static inline uint64_t addr6_key(const struct in6_addr *ip) {
+  uint64_t key = 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    key = (key << 8) | ip->s6_addr[i];
+  return key;
+}
+
+static inline int test_ip_in_list(struct in_addr ip, const lpm_t *netlist) {
+  return lpm_lookup(netlist, ntohl(ip.s_addr));
+}
+
+static inline int test_ip6_in_list(const struct in6_addr *ip,
+                                   const lpm6_t *netlist) {
+  return lpm6_lookup(netlist, addr6_key(ip));
+}
+
+#endif
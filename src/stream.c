@@ -0,0 +1,661 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "config.h"
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "log.h"
+#include "loop.h"
+#include "stream.h"
+#include "timeout.h"
+
+// an answer of any size and its length prefix
+#define IN_SIZE (2 + 65535)
+// queries on a connection that aren't answered yet, written or not
+#define OUT_SIZE 16384
+// queries from failed connections waiting to be sent once more
+#define RETRY_SIZE OUT_SIZE
+// of those sent once more and not answered yet; a query takes at least a
+// header and its length prefix
+#define RETRIED_MAX (RETRY_SIZE / 14)
+// a query is marked answered in the queue by setting QR, which no query
+// has, in the flags that follow its length prefix and id
+#define FRAME_LEN(p) ((size_t)(unsigned char)(p)[0] << 8 | \
+                      (unsigned char)(p)[1])
+#define FRAME_QR(p) ((p)[4])
+// milliseconds, for the TLS handshake too
+#define CONNECT_TIMEOUT 5000
+// closed after this long without a query, or considered dead after this
+// long without an answer while queries are out
+#define IDLE_TIMEOUT 10000
+// between reconnects after failures, doubled on every one
+#define MIN_BACKOFF 100
+#define MAX_BACKOFF 10000
+
+#define CONN_CLOSED 0
+#define CONN_CONNECTING 1
+#define CONN_HANDSHAKE 2
+#define CONN_OPEN 3
+
+struct ssl_st;
+struct ssl_session_st;
+
+typedef struct {
+  stream_t *stream;
+  int fd;
+  int state;
+  char *in;
+  size_t in_len;
+  // queries from held_off on, written up to out_off. those before
+  // out_off are kept until answered, so they can be sent again if the
+  // connection fails
+  char *out;
+  size_t held_off;
+  size_t out_off;
+  size_t out_len;
+  // what the loop watches for now
+  int events;
+  // queries sent or queued and not answered yet
+  int inflight;
+  // connecting, idle or stalled
+  timeout_t timeout;
+  // NULL for plain TCP
+  struct ssl_st *ssl;
+  // the last TLS call has to write before it can go on
+  int want_write;
+} conn_t;
+
+struct stream_s {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  // NULL for plain TCP
+  char *tls_name;
+  // tls_name is an address rather than a host name
+  int tls_ip;
+  // the latest session the server gave out, to resume
+  struct ssl_session_st *session;
+  conn_t *conns;
+  int conns_len;
+  int next;
+  int backoff;
+  uint64_t retry_at;
+  // queries from failed connections, sent again once backing off is over
+  char *retry;
+  size_t retry_len;
+  timeout_t retry_timeout;
+  // ids of queries that have been sent again, which aren't a second time
+  uint16_t *retried;
+  int retried_len;
+  stream_answer_cb on_answer;
+  stream_error_cb on_error;
+  stream_lost_cb on_lost;
+  void *data;
+};
+
+#ifdef HAVE_TLS
+// shared by every stream
+static SSL_CTX *tls_ctx = NULL;
+#endif
+static unsigned long handshakes = 0;
+static unsigned long resumed = 0;
+
+static conn_t *pick_conn(stream_t *s, size_t len);
+static int queue_query(stream_t *s, const char *buf, size_t len);
+static void retry_frames(void *data);
+static int forget_retried(stream_t *s, uint16_t id);
+static void conn_answered(conn_t *conn, const char *buf, size_t len);
+static int conn_open(conn_t *conn);
+static void conn_cb(int fd, int events, void *data);
+static int conn_read(conn_t *conn);
+static int conn_write(conn_t *conn);
+static ssize_t conn_recv(conn_t *conn, char *buf, size_t len);
+static ssize_t conn_send(conn_t *conn, const char *buf, size_t len);
+static void conn_watch(conn_t *conn);
+static void conn_expire(void *data);
+static void conn_fail(conn_t *conn);
+static void conn_close(conn_t *conn);
+static int tls_start(conn_t *conn);
+static int tls_handshake(conn_t *conn);
+#ifdef HAVE_TLS
+static int tls_retry(conn_t *conn, int r);
+static int tls_new_session(SSL *ssl, SSL_SESSION *session);
+#endif
+
+int stream_tls_init(const char *ca_file) {
+#ifdef HAVE_TLS
+  tls_ctx = SSL_CTX_new(TLS_client_method());
+  if (tls_ctx == NULL)
+    return -1;
+  // RFC 8310 recommends nothing older
+  SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+  if (1 != (ca_file ? SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL) :
+                      SSL_CTX_set_default_verify_paths(tls_ctx))) {
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+    return -1;
+  }
+  // writes are retried with the queue grown, and maybe moved
+  SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // sessions are kept per stream rather than in OpenSSL's cache, which
+  // finds them by server session id
+  SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+stream_t *stream_new(const struct sockaddr *addr, socklen_t addrlen,
+                     const char *tls_name, int conns,
+                     stream_answer_cb on_answer, stream_error_cb on_error,
+                     stream_lost_cb on_lost, void *data) {
+  stream_t *s = calloc(1, sizeof(stream_t));
+  struct in6_addr ip;
+  int i;
+  if (s == NULL)
+    return NULL;
+  s->conns = calloc(conns, sizeof(conn_t));
+  if (s->conns == NULL) {
+    free(s);
+    return NULL;
+  }
+  memcpy(&s->addr, addr, addrlen);
+  s->addrlen = addrlen;
+  if (tls_name) {
+    s->tls_name = strdup(tls_name);
+    if (s->tls_name == NULL)
+      return NULL;
+    s->tls_ip = 1 == inet_pton(AF_INET, tls_name, &ip) ||
+                1 == inet_pton(AF_INET6, tls_name, &ip);
+  }
+  s->conns_len = conns;
+  s->on_answer = on_answer;
+  s->on_error = on_error;
+  s->on_lost = on_lost;
+  s->data = data;
+  s->retry = malloc(RETRY_SIZE);
+  s->retried = malloc(RETRIED_MAX * sizeof(uint16_t));
+  if (s->retry == NULL || s->retried == NULL)
+    return NULL;
+  timeout_init(&s->retry_timeout, retry_frames, s);
+  // buffers live as long as the stream, so reconnects allocate nothing
+  for (i = 0; i < conns; i++) {
+    conn_t *conn = &s->conns[i];
+    conn->stream = s;
+    conn->fd = -1;
+    conn->in = malloc(IN_SIZE);
+    conn->out = malloc(OUT_SIZE);
+    if (conn->in == NULL || conn->out == NULL)
+      return NULL;
+    timeout_init(&conn->timeout, conn_expire, conn);
+  }
+  return s;
+}
+
+int stream_send(stream_t *s, const char *buf, size_t len) {
+  return queue_query(s, buf, len);
+}
+
+unsigned long stream_handshakes() {
+  return handshakes;
+}
+
+unsigned long stream_resumed() {
+  return resumed;
+}
+
+static int queue_query(stream_t *s, const char *buf, size_t len) {
+  conn_t *conn = pick_conn(s, 2 + len);
+  if (conn == NULL)
+    return -1;
+  // answered queries are only dropped from the front, so make room once
+  // little is left
+  if (conn->held_off && conn->out_len + 2 + len > OUT_SIZE) {
+    memmove(conn->out, conn->out + conn->held_off,
+            conn->out_len - conn->held_off);
+    conn->out_off -= conn->held_off;
+    conn->out_len -= conn->held_off;
+    conn->held_off = 0;
+  }
+  conn->out[conn->out_len] = len >> 8;
+  conn->out[conn->out_len + 1] = len & 0xff;
+  memcpy(conn->out + conn->out_len + 2, buf, len);
+  conn->out_len += 2 + len;
+  if (conn->inflight++ == 0 && conn->state == CONN_OPEN)
+    timeout_add(&conn->timeout, timeout_now() + IDLE_TIMEOUT);
+  // written on the next loop turn, along with the rest of the batch
+  if (conn->state == CONN_OPEN)
+    conn_watch(conn);
+  return 0;
+}
+
+// the queries of a failed connection, once reconnecting may be tried.
+// those that can't be sent now are given up on, as they'd be retried a
+// second time
+static void retry_frames(void *data) {
+  stream_t *s = data;
+  size_t off, len;
+  for (off = 0; off < s->retry_len; off += 2 + len) {
+    const char *frame = s->retry + off;
+    len = FRAME_LEN(frame);
+    if (0 != queue_query(s, frame + 2, len)) {
+      uint16_t id = (unsigned char)frame[2] << 8 | (unsigned char)frame[3];
+      forget_retried(s, id);
+      s->on_lost(id, s->data);
+    }
+  }
+  s->retry_len = 0;
+}
+
+// 1 if id was sent again, which it no longer is
+static int forget_retried(stream_t *s, uint16_t id) {
+  int i;
+  for (i = 0; i < s->retried_len; i++) {
+    if (s->retried[i] == id) {
+      s->retried[i] = s->retried[--s->retried_len];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// an open connection with room, taking turns; else one being opened;
+// else a new one, unless backing off
+static conn_t *pick_conn(stream_t *s, size_t len) {
+  conn_t *closed = NULL;
+  conn_t *connecting = NULL;
+  int i;
+  for (i = 0; i < s->conns_len; i++) {
+    conn_t *conn = &s->conns[(s->next + i) % s->conns_len];
+    int room = conn->out_len - conn->held_off + len <= OUT_SIZE;
+    if (conn->state == CONN_OPEN && room) {
+      s->next = (s->next + i + 1) % s->conns_len;
+      return conn;
+    }
+    if ((conn->state == CONN_CONNECTING || conn->state == CONN_HANDSHAKE) &&
+        room && connecting == NULL)
+      connecting = conn;
+    if (conn->state == CONN_CLOSED && closed == NULL)
+      closed = conn;
+  }
+  if (connecting)
+    return connecting;
+  if (closed == NULL || timeout_now() < s->retry_at)
+    return NULL;
+  if (0 != conn_open(closed)) {
+    conn_fail(closed);
+    return NULL;
+  }
+  return closed;
+}
+
+static int conn_open(conn_t *conn) {
+  stream_t *s = conn->stream;
+  int on = 1;
+  conn->fd = socket(s->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (conn->fd == -1)
+    return -1;
+  if (-1 == fcntl(conn->fd, F_SETFL,
+                  fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK) ||
+      0 != loop_add(conn->fd, LOOP_WRITE, conn_cb, conn)) {
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  // writable once connected
+  conn->state = CONN_CONNECTING;
+  conn->events = LOOP_WRITE;
+  // queries are small and written whole, don't hold them back
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (0 != connect(conn->fd, (struct sockaddr *)&s->addr, s->addrlen) &&
+      errno != EINPROGRESS)
+    return -1;
+  timeout_add(&conn->timeout, timeout_now() + CONNECT_TIMEOUT);
+  return 0;
+}
+
+static void conn_cb(int fd, int events, void *data) {
+  conn_t *conn = data;
+  conn->want_write = 0;
+  if (conn->state == CONN_CONNECTING) {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+      conn_fail(conn);
+      return;
+    }
+    if (conn->stream->tls_name) {
+      if (0 != tls_start(conn)) {
+        conn_fail(conn);
+        return;
+      }
+      conn->state = CONN_HANDSHAKE;
+    } else {
+      conn->state = CONN_OPEN;
+      timeout_add(&conn->timeout, timeout_now() + IDLE_TIMEOUT);
+    }
+  } else if (events & LOOP_ERROR) {
+    conn_fail(conn);
+    return;
+  }
+  if (conn->state == CONN_HANDSHAKE) {
+    int r = tls_handshake(conn);
+    if (r == -1) {
+      conn_fail(conn);
+      return;
+    }
+    if (r == 0) {
+      conn_watch(conn);
+      return;
+    }
+    conn->state = CONN_OPEN;
+    timeout_add(&conn->timeout, timeout_now() + IDLE_TIMEOUT);
+    // the queries queued meanwhile go out right away
+    events |= LOOP_WRITE;
+  }
+  if ((events & LOOP_WRITE) && 0 != conn_write(conn)) {
+    conn_fail(conn);
+    return;
+  }
+  // TLS may have read records the socket no longer tells about
+  if (((events & LOOP_READ) || conn->ssl) && 0 != conn_read(conn)) {
+    // a server may close a connection that has nothing out
+    if (conn->inflight)
+      conn_fail(conn);
+    else
+      conn_close(conn);
+    return;
+  }
+  conn_watch(conn);
+}
+
+static int conn_read(conn_t *conn) {
+  stream_t *s = conn->stream;
+  ssize_t n;
+  for (;;) {
+    size_t off = 0;
+    n = conn_recv(conn, conn->in + conn->in_len, IN_SIZE - conn->in_len);
+    if (n == -1)
+      return -1;
+    if (n == 0)
+      break;
+    conn->in_len += n;
+    while (conn->in_len - off >= 2) {
+      size_t len = (unsigned char)conn->in[off] << 8 |
+                   (unsigned char)conn->in[off + 1];
+      if (conn->in_len - off < 2 + len)
+        break;
+      conn_answered(conn, conn->in + off + 2, len);
+      // it works, whatever failed before
+      s->backoff = 0;
+      s->on_answer(conn->in + off + 2, len, s->data);
+      off += 2 + len;
+    }
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+    timeout_add(&conn->timeout, timeout_now() + IDLE_TIMEOUT);
+    // the loop tells when there's more to read from a plain socket
+    if (conn->ssl == NULL)
+      break;
+  }
+  return 0;
+}
+
+static int conn_write(conn_t *conn) {
+  ssize_t n;
+  if (conn->out_off == conn->out_len)
+    return 0;
+  n = conn_send(conn, conn->out + conn->out_off,
+                conn->out_len - conn->out_off);
+  if (n == -1)
+    return -1;
+  conn->out_off += n;
+  return 0;
+}
+
+// mark the query buf answers, and drop those answered from the front
+static void conn_answered(conn_t *conn, const char *buf, size_t len) {
+  size_t off;
+  if (len < 2)
+    return;
+  for (off = conn->held_off; off < conn->out_off;
+       off += 2 + FRAME_LEN(conn->out + off)) {
+    char *frame = conn->out + off;
+    if (!(FRAME_QR(frame) & 0x80) && frame[2] == buf[0] &&
+        frame[3] == buf[1]) {
+      FRAME_QR(frame) |= 0x80;
+      conn->inflight--;
+      if (conn->stream->retried_len)
+        forget_retried(conn->stream, (unsigned char)buf[0] << 8 |
+                                     (unsigned char)buf[1]);
+      break;
+    }
+  }
+  while (conn->held_off < conn->out_off &&
+         (FRAME_QR(conn->out + conn->held_off) & 0x80))
+    conn->held_off += 2 + FRAME_LEN(conn->out + conn->held_off);
+  if (conn->held_off == conn->out_len)
+    conn->held_off = conn->out_off = conn->out_len = 0;
+}
+
+// bytes read, 0 if there's nothing yet, -1 on errors and EOF
+static ssize_t conn_recv(conn_t *conn, char *buf, size_t len) {
+  ssize_t n;
+#ifdef HAVE_TLS
+  if (conn->ssl) {
+    int r = SSL_read(conn->ssl, buf, len);
+    return r > 0 ? r : tls_retry(conn, r);
+  }
+#endif
+  n = read(conn->fd, buf, len);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  return n <= 0 ? -1 : n;
+}
+
+// bytes written, 0 if none can be yet, -1 on errors
+static ssize_t conn_send(conn_t *conn, const char *buf, size_t len) {
+  ssize_t n;
+#ifdef HAVE_TLS
+  if (conn->ssl) {
+    int r = SSL_write(conn->ssl, buf, len);
+    return r > 0 ? r : tls_retry(conn, r);
+  }
+#endif
+  n = write(conn->fd, buf, len);
+  if (n == -1)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  return n;
+}
+
+static void conn_watch(conn_t *conn) {
+  int events = LOOP_READ;
+  if ((conn->out_len > conn->out_off && conn->state == CONN_OPEN) ||
+      conn->want_write)
+    events |= LOOP_WRITE;
+  if (events != conn->events && 0 == loop_mod(conn->fd, events))
+    conn->events = events;
+}
+
+static void conn_expire(void *data) {
+  conn_t *conn = data;
+  // connecting, or queries out and nothing heard
+  if (conn->state != CONN_OPEN || conn->inflight)
+    conn_fail(conn);
+  else
+    conn_close(conn);
+}
+
+// the queries not answered on conn are sent once more after backing off,
+// on whichever connection can take them. those already sent twice, or
+// with no room left, are given up on
+static void conn_fail(conn_t *conn) {
+  static uint16_t lost[OUT_SIZE / 14];
+  stream_t *s = conn->stream;
+  int lost_len = 0;
+  size_t off, len;
+  int i;
+  for (off = conn->held_off; off < conn->out_len; off += 2 + len) {
+    const char *frame = conn->out + off;
+    uint16_t id = (unsigned char)frame[2] << 8 | (unsigned char)frame[3];
+    len = FRAME_LEN(frame);
+    if (FRAME_QR(frame) & 0x80)
+      continue;
+    if (forget_retried(s, id) || s->retry_len + 2 + len > RETRY_SIZE ||
+        s->retried_len == RETRIED_MAX) {
+      lost[lost_len++] = id;
+      continue;
+    }
+    memcpy(s->retry + s->retry_len, frame, 2 + len);
+    s->retry_len += 2 + len;
+    s->retried[s->retried_len++] = id;
+  }
+  if (conn->fd != -1)
+    conn_close(conn);
+  s->backoff = s->backoff ? s->backoff * 2 : MIN_BACKOFF;
+  if (s->backoff > MAX_BACKOFF)
+    s->backoff = MAX_BACKOFF;
+  s->retry_at = timeout_now() + s->backoff;
+  if (s->retry_len)
+    timeout_add(&s->retry_timeout, s->retry_at);
+  s->on_error(s->data);
+  // last, as the callbacks may send more
+  for (i = 0; i < lost_len; i++)
+    s->on_lost(lost[i], s->data);
+}
+
+static void conn_close(conn_t *conn) {
+#ifdef HAVE_TLS
+  if (conn->ssl) {
+    // without a close_notify sent, OpenSSL would no longer resume the
+    // session; there's no waiting for the alert to go out, though
+    SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+  }
+#endif
+  loop_del(conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->state = CONN_CLOSED;
+  conn->in_len = 0;
+  conn->held_off = 0;
+  conn->out_off = 0;
+  conn->out_len = 0;
+  conn->inflight = 0;
+  timeout_del(&conn->timeout);
+}
+
+static int tls_start(conn_t *conn) {
+#ifdef HAVE_TLS
+  stream_t *s = conn->stream;
+  conn->ssl = SSL_new(tls_ctx);
+  if (conn->ssl == NULL || 1 != SSL_set_fd(conn->ssl, conn->fd))
+    return -1;
+  SSL_set_app_data(conn->ssl, conn);
+  // an address is checked against the certificate's addresses; a name
+  // against its names, and sent in SNI
+  if (s->tls_ip) {
+    if (1 != X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl),
+                                           s->tls_name))
+      return -1;
+  } else if (1 != SSL_set1_host(conn->ssl, s->tls_name) ||
+             1 != SSL_set_tlsext_host_name(conn->ssl, s->tls_name)) {
+    return -1;
+  }
+  // an abbreviated handshake if the server still knows it
+  if (s->session)
+    SSL_set_session(conn->ssl, s->session);
+  SSL_set_connect_state(conn->ssl);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// 1 once done, 0 while it goes on, -1 if it failed
+static int tls_handshake(conn_t *conn) {
+#ifdef HAVE_TLS
+  int r = SSL_do_handshake(conn->ssl);
+  long verify;
+  if (r == 1) {
+    handshakes++;
+    if (SSL_session_reused(conn->ssl))
+      resumed++;
+    return 1;
+  }
+  if (0 == tls_retry(conn, r))
+    return 0;
+  verify = SSL_get_verify_result(conn->ssl);
+  if (verify != X509_V_OK)
+    LOG("%s: %s\n", conn->stream->tls_name,
+        X509_verify_cert_error_string(verify));
+  return -1;
+#else
+  return -1;
+#endif
+}
+
+#ifdef HAVE_TLS
+// after an SSL call returned r: 0 if it has to wait for the socket, -1
+// on errors and EOF
+static int tls_retry(conn_t *conn, int r) {
+  switch (SSL_get_error(conn->ssl, r)) {
+  case SSL_ERROR_WANT_READ:
+    return 0;
+  case SSL_ERROR_WANT_WRITE:
+    conn->want_write = 1;
+    return 0;
+  default:
+    // nothing to do with the next connection's errors
+    ERR_clear_error();
+    return -1;
+  }
+}
+
+// TLS 1.3 tickets arrive after the handshake, any time
+static int tls_new_session(SSL *ssl, SSL_SESSION *session) {
+  conn_t *conn = SSL_get_app_data(ssl);
+  stream_t *s = conn->stream;
+  SSL_SESSION *copy = SSL_SESSION_dup(session);
+  if (copy == NULL)
+    return 0;
+  if (s->session)
+    SSL_SESSION_free(s->session);
+  // a copy, as the connection's own is no longer resumable once it
+  // fails or is cut off
+  s->session = copy;
+  return 0;
+}
+#endif
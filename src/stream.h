@@ -0,0 +1,46 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* persistent connections to an upstream over TCP, RFC 7766. queries are
+   pipelined with the ids of their pending queries, which are unique among
+   those in flight, and answers are matched by id in whatever order they
+   come */
+
+typedef struct stream_s stream_t;
+
+/* buf is valid only during the call */
+typedef void (*stream_answer_cb)(char *buf, size_t len, void *data);
+
+/* a connection failed while connecting or with queries on it. those are
+   sent once more on another connection */
+typedef void (*stream_error_cb)(void *data);
+
+/* the query with id won't be answered, as it was lost with its
+   connection a second time, or couldn't be sent again */
+typedef void (*stream_lost_cb)(uint16_t id, void *data);
+
+/* set up TLS for the streams that use it, trusting the certificates in
+   ca_file, or the system's if NULL. -1 if built without TLS support */
+int stream_tls_init(const char *ca_file);
+
+/* up to conns connections to addr, opened as queries need them. with
+   tls_name, connections speak TLS, RFC 7858, to a server with a
+   certificate for that name or address, and resume earlier sessions */
+stream_t *stream_new(const struct sockaddr *addr, socklen_t addrlen,
+                     const char *tls_name, int conns,
+                     stream_answer_cb on_answer, stream_error_cb on_error,
+                     stream_lost_cb on_lost, void *data);
+
+/* queue a query on an open connection, or one being opened. -1 if none
+   can take it, as while reconnecting backs off */
+int stream_send(stream_t *s, const char *buf, size_t len);
+
+/* TLS handshakes completed, and those that resumed a session */
+unsigned long stream_handshakes();
+unsigned long stream_resumed();
+
+#endif
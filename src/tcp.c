@@ -0,0 +1,328 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "loop.h"
+#include "tcp.h"
+#include "timeout.h"
+
+// a query and its length prefix; clients don't send anything longer
+#define IN_SIZE 4096
+// answers queued on a connection to start with. past half of this, no
+// more queries are read from it until the client catches up, but the
+// answers to those already read are queued however long they are
+#define OUT_SIZE 16384
+#define CONN_INDEX(id) ((id) & 0xffff)
+
+typedef struct {
+  int fd;
+  uint32_t id;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  char *in;
+  size_t in_len;
+  char *out;
+  size_t out_off;
+  size_t out_len;
+  size_t out_size;
+  // what the loop watches for now
+  int events;
+  // queries handed over and neither answered nor dropped yet. the
+  // connection is only idle while there are none, RFC 7766 6.2.3
+  int outstanding;
+  // the client is done sending, and is only owed its answers, RFC 7766
+  // 6.2.4
+  int eof;
+  timeout_t idle;
+} conn_t;
+
+static conn_t *conns;
+static int conns_len;
+static int conns_used = 0;
+static int idle_timeout;
+static tcp_handler on_query;
+// the upper 16 bits of ids, bumped on every accept
+static uint16_t serial = 0;
+static unsigned long rejected = 0;
+static unsigned long dropped = 0;
+
+static void accept_cb(int fd, int events, void *data);
+static void conn_cb(int fd, int events, void *data);
+static int conn_read(conn_t *conn);
+static int conn_write(conn_t *conn);
+static void conn_watch(conn_t *conn);
+static void conn_idle(conn_t *conn);
+static void conn_expire(void *data);
+static void conn_close(conn_t *conn);
+static int out_reserve(conn_t *conn, size_t len);
+
+int tcp_init(int sock, int max_conns, int idle_ms, tcp_handler handler) {
+  int i;
+  if (max_conns > 0x10000)
+    max_conns = 0x10000;
+  conns = calloc(max_conns, sizeof(conn_t));
+  if (conns == NULL)
+    return -1;
+  for (i = 0; i < max_conns; i++)
+    conns[i].fd = -1;
+  conns_len = max_conns;
+  idle_timeout = idle_ms;
+  on_query = handler;
+  return loop_add(sock, LOOP_READ, accept_cb, NULL);
+}
+
+void tcp_send(uint32_t id, const char *buf, size_t len) {
+  conn_t *conn = &conns[CONN_INDEX(id)];
+  if (conn->fd == -1 || conn->id != id)
+    return;
+  // the client can't be told an answer is missing, so it's better off
+  // reconnecting and asking again. the loop closes it, since queries may
+  // still be being read from it
+  if (0 != out_reserve(conn, 2 + len)) {
+    dropped++;
+    shutdown(conn->fd, SHUT_RDWR);
+    return;
+  }
+  // the prefix and the answer go out together
+  conn->out[conn->out_len] = len >> 8;
+  conn->out[conn->out_len + 1] = len & 0xff;
+  memcpy(conn->out + conn->out_len + 2, buf, len);
+  conn->out_len += 2 + len;
+  if (conn->outstanding > 0)
+    conn->outstanding--;
+  conn_idle(conn);
+  // written on the next loop turn, along with whatever else is ready
+  conn_watch(conn);
+}
+
+void tcp_drop(uint32_t id) {
+  conn_t *conn = &conns[CONN_INDEX(id)];
+  if (conn->fd == -1 || conn->id != id || conn->outstanding == 0)
+    return;
+  conn->outstanding--;
+  conn_idle(conn);
+}
+
+int tcp_count() {
+  return conns_used;
+}
+
+unsigned long tcp_rejected() {
+  return rejected;
+}
+
+unsigned long tcp_dropped() {
+  return dropped;
+}
+
+static void accept_cb(int fd, int events, void *data) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  conn_t *conn = NULL;
+  int sock, i;
+  while (-1 != (sock = accept(fd, (struct sockaddr *)&addr, &addrlen))) {
+    for (i = 0; conns_used < conns_len && i < conns_len; i++) {
+      if (conns[i].fd == -1) {
+        conn = &conns[i];
+        break;
+      }
+    }
+    if (conn == NULL) {
+      rejected++;
+      close(sock);
+      addrlen = sizeof(addr);
+      continue;
+    }
+    conn->in = malloc(IN_SIZE);
+    conn->out = malloc(OUT_SIZE);
+    if (conn->in == NULL || conn->out == NULL ||
+        -1 == fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) ||
+        0 != loop_add(sock, LOOP_READ, conn_cb, conn)) {
+      free(conn->in);
+      free(conn->out);
+      close(sock);
+      conn = NULL;
+      addrlen = sizeof(addr);
+      continue;
+    }
+    if (++serial == 0)
+      serial = 1;
+    conn->fd = sock;
+    conn->id = (uint32_t)serial << 16 | i;
+    memcpy(&conn->addr, &addr, addrlen);
+    conn->addrlen = addrlen;
+    conn->in_len = 0;
+    conn->out_off = 0;
+    conn->out_len = 0;
+    conn->out_size = OUT_SIZE;
+    conn->events = LOOP_READ;
+    conn->outstanding = 0;
+    conn->eof = 0;
+    timeout_init(&conn->idle, conn_expire, conn);
+    conn_idle(conn);
+    conns_used++;
+    conn = NULL;
+    addrlen = sizeof(addr);
+  }
+}
+
+static void conn_cb(int fd, int events, void *data) {
+  conn_t *conn = data;
+  if (events & LOOP_ERROR) {
+    conn_close(conn);
+    return;
+  }
+  if ((events & LOOP_WRITE) && 0 != conn_write(conn)) {
+    conn_close(conn);
+    return;
+  }
+  if ((events & LOOP_READ) && 0 != conn_read(conn)) {
+    conn_close(conn);
+    return;
+  }
+  conn_watch(conn);
+}
+
+// queries are handed over as soon as each is complete, the rest is kept
+// for the next read. -1 once the connection is done with; one the client
+// has shut down is kept for the answers it's still owed
+static int conn_read(conn_t *conn) {
+  size_t off = 0;
+  ssize_t n;
+  n = read(conn->fd, conn->in + conn->in_len, IN_SIZE - conn->in_len);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if (n == 0) {
+    conn->eof = 1;
+    conn_idle(conn);
+    return 0;
+  }
+  if (n == -1)
+    return -1;
+  conn->in_len += n;
+  while (conn->in_len - off >= 2) {
+    size_t len = (unsigned char)conn->in[off] << 8 |
+                 (unsigned char)conn->in[off + 1];
+    if (len == 0 || len > IN_SIZE - 2)
+      return -1;
+    if (conn->in_len - off < 2 + len)
+      break;
+    // before the call, which may answer right away
+    conn->outstanding++;
+    on_query(conn->in + off + 2, len, (struct sockaddr *)&conn->addr,
+             conn->addrlen, conn->id);
+    off += 2 + len;
+  }
+  memmove(conn->in, conn->in + off, conn->in_len - off);
+  conn->in_len -= off;
+  conn_idle(conn);
+  return 0;
+}
+
+static int conn_write(conn_t *conn) {
+  ssize_t n;
+  if (conn->out_off == conn->out_len)
+    return 0;
+  n = write(conn->fd, conn->out + conn->out_off,
+            conn->out_len - conn->out_off);
+  if (n == -1)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  conn->out_off += n;
+  if (conn->out_off == conn->out_len) {
+    conn->out_off = conn->out_len = 0;
+    // back to the usual size once a long answer is out
+    if (conn->out_size > OUT_SIZE) {
+      char *out = realloc(conn->out, OUT_SIZE);
+      if (out) {
+        conn->out = out;
+        conn->out_size = OUT_SIZE;
+      }
+    }
+  }
+  conn_idle(conn);
+  return 0;
+}
+
+// read while the client keeps up with its answers and may send more,
+// write while any are queued
+static void conn_watch(conn_t *conn) {
+  int events = 0;
+  if (!conn->eof && conn->out_len - conn->out_off < OUT_SIZE / 2)
+    events |= LOOP_READ;
+  if (conn->out_len > conn->out_off)
+    events |= LOOP_WRITE;
+  if (events != conn->events && 0 == loop_mod(conn->fd, events))
+    conn->events = events;
+}
+
+// the idle time starts over from now, or waits for the last answer. a
+// client that is done sending is closed on as soon as that is written
+static void conn_idle(conn_t *conn) {
+  if (conn->outstanding)
+    timeout_del(&conn->idle);
+  else if (conn->eof && conn->out_off == conn->out_len)
+    timeout_add(&conn->idle, timeout_now());
+  else
+    timeout_add(&conn->idle, timeout_now() + idle_timeout);
+}
+
+static void conn_expire(void *data) {
+  conn_close(data);
+}
+
+static void conn_close(conn_t *conn) {
+  loop_del(conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  free(conn->in);
+  free(conn->out);
+  conn->in = NULL;
+  conn->out = NULL;
+  timeout_del(&conn->idle);
+  conns_used--;
+}
+
+// room for len more bytes at the end of the queue. -1 if there's no
+// memory for it
+static int out_reserve(conn_t *conn, size_t len) {
+  size_t size = conn->out_size;
+  char *out;
+  if (conn->out_len + len <= size)
+    return 0;
+  // answers are appended at the end, so make room once little is left
+  if (conn->out_off) {
+    memmove(conn->out, conn->out + conn->out_off,
+            conn->out_len - conn->out_off);
+    conn->out_len -= conn->out_off;
+    conn->out_off = 0;
+  }
+  while (conn->out_len + len > size)
+    size *= 2;
+  if (size == conn->out_size)
+    return 0;
+  if (NULL == (out = realloc(conn->out, size)))
+    return -1;
+  conn->out = out;
+  conn->out_size = size;
+  return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* DNS over TCP for clients, RFC 7766. a connection may carry many
+   queries at once, and each is answered when its answer is ready, in any
+   order. connections are known by an id that is never 0, and isn't
+   reused soon after one is closed */
+
+/* buf is valid only during the call. every query is to be either
+   answered with tcp_send() or given up on with tcp_drop() */
+typedef void (*tcp_handler)(char *buf, size_t len, struct sockaddr *addr,
+                            socklen_t addrlen, uint32_t conn);
+
+/* serve at most max_conns connections accepted on the listening socket
+   sock, closing each after idle_ms with every query answered and
+   nothing read or written, or once every query is answered if the client
+   has shut down its side */
+int tcp_init(int sock, int max_conns, int idle_ms, tcp_handler handler);
+
+/* queue an answer on conn, to be written once the socket is writable.
+   dropped if conn has been closed since the query */
+void tcp_send(uint32_t conn, const char *buf, size_t len);
+
+/* a query from conn that won't be answered, so it's no longer kept open
+   for it */
+void tcp_drop(uint32_t conn);
+
+int tcp_count();
+
+/* connections turned away over max_conns */
+unsigned long tcp_rejected();
+
+/* answers there was no memory to queue, each closing its connection */
+unsigned long tcp_dropped();
+
+#endif
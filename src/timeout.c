@@ -0,0 +1,133 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timeout.h"
+
+// binary min-heap ordered by deadline
+static timeout_t **heap = NULL;
+static int heap_len = 0;
+static int heap_cap = 0;
+
+static void sift_up(int i);
+static void sift_down(int i);
+
+uint64_t timeout_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timeout_init(timeout_t *t, timeout_cb cb, void *data) {
+  t->deadline = 0;
+  t->index = -1;
+  t->cb = cb;
+  t->data = data;
+}
+
+int timeout_add(timeout_t *t, uint64_t deadline) {
+  if (t->index != -1) {
+    uint64_t old = t->deadline;
+    t->deadline = deadline;
+    if (deadline < old)
+      sift_up(t->index);
+    else
+      sift_down(t->index);
+    return 0;
+  }
+  if (heap_len == heap_cap) {
+    int new_cap = heap_cap ? heap_cap * 2 : 256;
+    timeout_t **new_heap = realloc(heap, new_cap * sizeof(timeout_t *));
+    if (new_heap == NULL)
+      return -1;
+    heap = new_heap;
+    heap_cap = new_cap;
+  }
+  t->deadline = deadline;
+  t->index = heap_len;
+  heap[heap_len++] = t;
+  sift_up(t->index);
+  return 0;
+}
+
+void timeout_del(timeout_t *t) {
+  int i = t->index;
+  if (i == -1)
+    return;
+  t->index = -1;
+  heap_len--;
+  if (i == heap_len)
+    return;
+  heap[i] = heap[heap_len];
+  heap[i]->index = i;
+  sift_up(i);
+  sift_down(heap[i]->index);
+}
+
+int timeout_next(uint64_t now) {
+  uint64_t diff;
+  if (heap_len == 0)
+    return -1;
+  if (heap[0]->deadline <= now)
+    return 0;
+  diff = heap[0]->deadline - now;
+  return diff > INT_MAX ? INT_MAX : (int)diff;
+}
+
+void timeout_run(uint64_t now) {
+  while (heap_len && heap[0]->deadline <= now) {
+    timeout_t *t = heap[0];
+    timeout_del(t);
+    t->cb(t->data);
+  }
+}
+
+static void sift_up(int i) {
+  timeout_t *t = heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap[parent]->deadline <= t->deadline)
+      break;
+    heap[i] = heap[parent];
+    heap[i]->index = i;
+    i = parent;
+  }
+  heap[i] = t;
+  t->index = i;
+}
+
+static void sift_down(int i) {
+  timeout_t *t = heap[i];
+  while (1) {
+    int child = i * 2 + 1;
+    if (child >= heap_len)
+      break;
+    if (child + 1 < heap_len &&
+        heap[child + 1]->deadline < heap[child]->deadline)
+      child++;
+    if (t->deadline <= heap[child]->deadline)
+      break;
+    heap[i] = heap[child];
+    heap[i]->index = i;
+    i = child;
+  }
+  heap[i] = t;
+  t->index = i;
+}
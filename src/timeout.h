@@ -0,0 +1,34 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include <stdint.h>
+
+typedef void (*timeout_cb)(void *data);
+
+typedef struct {
+  // milliseconds on the monotonic clock
+  uint64_t deadline;
+  // position in the heap, -1 if not scheduled
+  int index;
+  timeout_cb cb;
+  void *data;
+} timeout_t;
+
+uint64_t timeout_now();
+
+void timeout_init(timeout_t *t, timeout_cb cb, void *data);
+
+/* schedule t, or move it if it's already scheduled */
+int timeout_add(timeout_t *t, uint64_t deadline);
+
+void timeout_del(timeout_t *t);
+
+#define timeout_pending(t) ((t)->index != -1)
+
+/* milliseconds until the next deadline, -1 if nothing is scheduled */
+int timeout_next(uint64_t now);
+
+/* fire everything due by now */
+void timeout_run(uint64_t now);
+
+#endif
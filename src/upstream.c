@@ -0,0 +1,189 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "upstream.h"
+
+// consecutive losses before an upstream is considered down
+#define MAX_FAILURES 5
+// milliseconds before probing a down upstream, doubled on every failed
+// probe
+#define MIN_BACKOFF 1000
+#define MAX_BACKOFF 60000
+// counts are halved when the histogram gets this full, so old samples
+// fade out
+#define HIST_DECAY 2048
+// an answer that never comes costs about this many milliseconds
+#define LOSS_PENALTY 1000
+
+static int hist_bucket(int ms);
+static int bucket_max(int bucket);
+
+void upstream_init(upstream_t *up, const struct sockaddr *addr,
+                   socklen_t addrlen, int chn, int transport) {
+  static const char *schemes[] = {"", "tcp://", "tls://"};
+  char ip[INET6_ADDRSTRLEN];
+  memset(up, 0, sizeof(upstream_t));
+  memcpy(&up->addr, addr, addrlen);
+  up->addrlen = addrlen;
+  up->chn = chn;
+  up->transport = transport;
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+    snprintf(up->name, sizeof(up->name), "%s[%s]:%d", schemes[transport], ip,
+             ntohs(sin6->sin6_port));
+  } else {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+    snprintf(up->name, sizeof(up->name), "%s%s:%d", schemes[transport], ip,
+             ntohs(sin->sin_port));
+  }
+  up->state = UPSTREAM_UP;
+}
+
+int upstream_open(upstream_t *up, int socks_len) {
+  int i;
+  up->socks = malloc(socks_len * sizeof(int));
+  if (up->socks == NULL)
+    return -1;
+  up->socks_len = 0;
+  up->next_sock = 0;
+  for (i = 0; i < socks_len; i++) {
+    // each socket is bound to its own ephemeral port by connect()
+    int sock = socket(up->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    int flags;
+    if (sock == -1)
+      return -1;
+    up->socks[up->socks_len++] = sock;
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || -1 == fcntl(sock, F_SETFL, flags | O_NONBLOCK))
+      return -1;
+    if (0 != connect(sock, (struct sockaddr *)&up->addr, up->addrlen))
+      return -1;
+  }
+  return 0;
+}
+
+void upstream_close(upstream_t *up) {
+  int i;
+  for (i = 0; i < up->socks_len; i++)
+    close(up->socks[i]);
+  free(up->socks);
+  up->socks = NULL;
+  up->socks_len = 0;
+}
+
+void upstream_on_answer(upstream_t *up, int rtt) {
+  int i;
+  if (rtt < 0)
+    rtt = 0;
+  if (up->hist_total == 0) {
+    up->srtt = rtt;
+    up->rttvar = rtt / 2.0f;
+  } else {
+    float err = rtt - up->srtt;
+    up->srtt += err / 8;
+    up->rttvar += ((err < 0 ? -err : err) - up->rttvar) / 4;
+  }
+  up->loss -= up->loss / 16;
+  if (up->hist_total >= HIST_DECAY) {
+    up->hist_total = 0;
+    for (i = 0; i < UPSTREAM_HIST_LEN; i++) {
+      up->hist[i] /= 2;
+      up->hist_total += up->hist[i];
+    }
+  }
+  up->hist[hist_bucket(rtt)]++;
+  up->hist_total++;
+  up->failures = 0;
+  if (up->state != UPSTREAM_UP) {
+    VERR("upstream %s is back\n", up->name);
+    up->state = UPSTREAM_UP;
+    up->backoff = 0;
+  }
+}
+
+void upstream_on_loss(upstream_t *up, uint64_t now) {
+  up->loss += (1 - up->loss) / 16;
+  up->failures++;
+  if (up->state == UPSTREAM_PROBING) {
+    up->backoff = up->backoff * 2 > MAX_BACKOFF ? MAX_BACKOFF :
+                                                  up->backoff * 2;
+    up->retry_at = now + up->backoff;
+    up->state = UPSTREAM_DOWN;
+  } else if (up->state == UPSTREAM_UP && up->failures >= MAX_FAILURES) {
+    VERR("upstream %s is down\n", up->name);
+    up->backoff = MIN_BACKOFF;
+    up->retry_at = now + up->backoff;
+    up->state = UPSTREAM_DOWN;
+  }
+}
+
+int upstream_check(upstream_t *up, uint64_t now) {
+  if (up->state == UPSTREAM_DOWN && now >= up->retry_at) {
+    up->state = UPSTREAM_PROBING;
+    return UPSTREAM_PROBING;
+  }
+  return up->state == UPSTREAM_UP ? UPSTREAM_UP : UPSTREAM_DOWN;
+}
+
+float upstream_score(const upstream_t *up) {
+  // untried upstreams score 0, so they get tried
+  return up->srtt + 4 * up->rttvar + up->loss * LOSS_PENALTY;
+}
+
+int upstream_percentile(const upstream_t *up, int percent, int min_samples) {
+  uint32_t seen = 0, want;
+  int i;
+  if (up->hist_total == 0 || up->hist_total < min_samples)
+    return -1;
+  want = (up->hist_total * percent + 99) / 100;
+  for (i = 0; i < UPSTREAM_HIST_LEN; i++) {
+    seen += up->hist[i];
+    if (seen >= want)
+      return bucket_max(i);
+  }
+  return bucket_max(UPSTREAM_HIST_LEN - 1);
+}
+
+static int hist_bucket(int ms) {
+  int log2;
+  if (ms < 16)
+    return ms;
+  if (ms > 32767)
+    ms = 32767;
+  log2 = 31 - __builtin_clz(ms);
+  // the 3 bits below the leading one pick the bucket within the doubling
+  return 16 + (log2 - 4) * 8 + ((ms >> (log2 - 3)) & 7);
+}
+
+// the largest value that falls into bucket
+static int bucket_max(int bucket) {
+  int log2, sub;
+  if (bucket < 16)
+    return bucket;
+  log2 = (bucket - 16) / 8 + 4;
+  sub = (bucket - 16) % 8;
+  return ((8 + sub + 1) << (log2 - 3)) - 1;
+}
@@ -0,0 +1,93 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// latency histogram: 1 ms buckets below 16 ms, then 8 per doubling up
+// to 32 s
+#define UPSTREAM_HIST_LEN 104
+
+#define UPSTREAM_UP 0
+#define UPSTREAM_DOWN 1
+// down, with a single query out to see whether it's back
+#define UPSTREAM_PROBING 2
+
+#define UPSTREAM_UDP 0
+// persistent pipelined connections, tcp:// in -s
+#define UPSTREAM_TCP 1
+// the same over TLS, tls:// in -s; answers are trusted
+#define UPSTREAM_TLS 2
+
+struct stream_s;
+
+/* a DNS server queries are forwarded to */
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  // with the scheme, for all but UDP
+  char name[INET6_ADDRSTRLEN + 16];
+  // inside chnroute
+  int chn;
+  int transport;
+  // connected to addr, each from its own source port
+  int *socks;
+  int socks_len;
+  int next_sock;
+  // connections to addr, for all but UDP
+  struct stream_s *stream;
+  // the name or address the certificate is checked against, for TLS
+  char *tls_name;
+
+  // milliseconds, smoothed as in TCP
+  float srtt;
+  float rttvar;
+  // moving average of queries that got no answer
+  float loss;
+  uint32_t hist[UPSTREAM_HIST_LEN];
+  uint32_t hist_total;
+
+  // circuit breaker
+  int state;
+  int failures;
+  int backoff;
+  uint64_t retry_at;
+} upstream_t;
+
+void upstream_init(upstream_t *up, const struct sockaddr *addr,
+                   socklen_t addrlen, int chn, int transport);
+
+/* open socks_len non-blocking sockets connected to up->addr */
+int upstream_open(upstream_t *up, int socks_len);
+
+void upstream_close(upstream_t *up);
+
+/* the socket to send the next query from, rotating through the pool */
+static inline int upstream_sock(upstream_t *up) {
+  int sock = up->socks[up->next_sock];
+  if (++up->next_sock == up->socks_len)
+    up->next_sock = 0;
+  return sock;
+}
+
+/* an answer arrived rtt milliseconds after the query was sent */
+void upstream_on_answer(upstream_t *up, int rtt);
+
+/* a query got no answer, or the upstream reported an error */
+void upstream_on_loss(upstream_t *up, uint64_t now);
+
+/* UPSTREAM_UP if queries may be sent to up. a down upstream turns
+   UPSTREAM_PROBING once its backoff has passed, and the caller should
+   send it the next query */
+int upstream_check(upstream_t *up, uint64_t now);
+
+/* expected milliseconds until a usable answer, lower is better */
+float upstream_score(const upstream_t *up);
+
+/* milliseconds within which percent of answers arrived, -1 if there are
+   fewer than min_samples samples */
+int upstream_percentile(const upstream_t *up, int percent, int min_samples);
+
+#endif
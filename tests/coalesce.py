@@ -0,0 +1,63 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# identical queries that come while the first is still waiting for the
+# upstreams are sent on once, and every client gets the answer with its
+# own ID
+
+import time
+
+import dnstest
+from dnstest import chinadns, metric, recv, send, stub, tmpfile
+
+CLIENTS = 20
+CHN = '127.0.0.1:%d' % dnstest.STUB_PORT
+FOREIGN = '127.0.0.2:%d' % dnstest.STUB_PORT
+
+
+def asked(upstream):
+    """queries an upstream got, which the stubs answer every one of"""
+    return metric('upstream_answers_total', upstream=upstream) or 0
+
+
+def test(checks):
+    chnroute = tmpfile('10.0.0.0/8\n127.0.0.1/32\n')
+    # slow enough that every client asks before the first answer, and the
+    # chinese answer comes first
+    stub('127.0.0.1', 'chn', ['-d', '300'])
+    stub('127.0.0.2', 'foreign', ['-d', '600'])
+    chinadns(['-c', chnroute, '-l', dnstest.IPLIST, '-C', '0',
+              '-e', '127.0.0.1:%d' % dnstest.METRICS_PORT,
+              '-s', '%s,%s' % (CHN, FOREIGN)])
+
+    # each from its own port, with its own ID
+    socks = [send('c1.bench', 100 + i) for i in range(CLIENTS)]
+    other = send('c2.bench', 999)
+    answered = 0
+    for i, s in enumerate(socks):
+        qid, ips = recv(s)
+        answered += qid == 100 + i and ips == ['10.0.0.1', '10.0.0.2']
+    checks.check('every client answered with its own ID',
+                 answered == CLIENTS, '%d of %d' % (answered, CLIENTS))
+    qid, ips = recv(other)
+    checks.check('another name answered apart',
+                 qid == 999 and ips == ['10.0.0.2', '10.0.0.3'], ips)
+
+    # for the foreign answers, which come after the chinese ones are taken
+    time.sleep(0.5)
+    checks.check('the chinese upstream asked once per name',
+                 asked(CHN) == 2, asked(CHN))
+    checks.check('the foreign upstream asked once per name',
+                 asked(FOREIGN) == 2, asked(FOREIGN))
+    coalesced = metric('coalesced_total')
+    checks.check('the others waited', coalesced == CLIENTS - 1, coalesced)
+    queries = metric('queries_total')
+    checks.check('every query counted', queries == CLIENTS + 1, queries)
+
+    # once answered, the next one is sent on again
+    qid, ips = recv(send('c1.bench', 500))
+    checks.check('asked again after the answer',
+                 qid == 500 and asked(CHN) == 3, (qid, asked(CHN)))
+
+
+dnstest.run(test)
@@ -0,0 +1,175 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# what the tests that run ChinaDNS between local bench stubs share. run
+# them from the top of the tree after make and make -C bench bench-stub
+
+import os
+import random
+import signal
+import socket
+import struct
+import sys
+import tempfile
+import time
+import traceback
+from subprocess import Popen
+
+CHINADNS = os.environ.get('CHINADNS', 'src/chinadns')
+BENCH_STUB = os.environ.get('BENCH_STUB', 'bench/bench-stub')
+IPLIST = os.environ.get('IPLIST', 'iplist.txt')
+
+PORT = 15353
+STUB_PORT = 25353
+METRICS_PORT = 19153
+
+processes = []
+tmpfiles = []
+
+
+def tmpfile(content):
+    fd, path = tempfile.mkstemp(prefix='chinadns-test-')
+    os.write(fd, content.encode())
+    os.close(fd)
+    tmpfiles.append(path)
+    return path
+
+
+def start(cmd):
+    print(' '.join(cmd))
+    p = Popen(cmd, shell=False, bufsize=0, close_fds=True)
+    processes.append(p)
+    return p
+
+
+def stop(p, sig=signal.SIGTERM):
+    try:
+        os.kill(p.pid, sig)
+        p.wait()
+    except OSError:
+        pass
+    if p in processes:
+        processes.remove(p)
+
+
+def stop_all():
+    for p in list(processes):
+        stop(p)
+
+
+def stub(addr, kind='chn', args=()):
+    return start([BENCH_STUB, '-b', addr, '-p', str(STUB_PORT), '-k', kind,
+                  '-l', IPLIST] + list(args))
+
+
+def chinadns(args):
+    p = start([CHINADNS, '-p', str(PORT), '-b', '127.0.0.1', '-v'] +
+              list(args))
+    time.sleep(1)
+    return p
+
+
+def build_query(name, qid):
+    q = struct.pack('!HHHHHH', qid, 0x0100, 1, 0, 0, 0)
+    for label in name.split('.'):
+        q += struct.pack('!B', len(label)) + label.encode()
+    return q + struct.pack('!BHH', 0, 1, 1)
+
+
+def parse_reply(data):
+    """the id and the A records of a reply, as dotted strings"""
+    qid, flags, qdcount, ancount = struct.unpack('!HHHH', data[:8])
+    off = 12
+    for i in range(qdcount + ancount):
+        while True:
+            n = struct.unpack('!B', data[off:off + 1])[0]
+            if n >= 0xc0:
+                off += 2
+                break
+            off += 1 + n
+            if n == 0:
+                break
+        if i < qdcount:
+            off += 4
+            continue
+        rtype, rclass, ttl, rdlen = struct.unpack('!HHIH',
+                                                  data[off:off + 10])
+        off += 10
+        if rtype == 1 and rdlen == 4:
+            yield qid, socket.inet_ntoa(data[off:off + 4])
+        off += rdlen
+
+
+def send(name, qid=None, port=PORT):
+    """send a query without waiting, for the socket recv() gets it on"""
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(3)
+    s.sendto(build_query(name, qid if qid is not None else
+                         random.randint(0, 65535)), ('127.0.0.1', port))
+    return s
+
+
+def recv(s):
+    """(id, addresses) of the reply, (None, []) if none came"""
+    try:
+        data = s.recv(4096)
+    except socket.timeout:
+        return None, []
+    finally:
+        s.close()
+    records = list(parse_reply(data))
+    qid = struct.unpack('!H', data[:2])[0]
+    return qid, [ip for _, ip in records]
+
+
+def query(name, qid=None, port=PORT):
+    return recv(send(name, qid, port))
+
+
+def metric(name, worker=0, upstream=None):
+    """a counter chinadns serves on METRICS_PORT, run with -e, of upstream
+    as given in -s for the per upstream ones"""
+    s = socket.create_connection(('127.0.0.1', METRICS_PORT), 3)
+    s.sendall(b'GET /metrics HTTP/1.0\r\n\r\n')
+    data = b''
+    while True:
+        d = s.recv(65536)
+        if not d:
+            break
+        data += d
+    s.close()
+    key = 'chinadns_%s{worker="%d"' % (name, worker)
+    if upstream:
+        key += ',upstream="%s"' % upstream
+    key += '} '
+    for line in data.decode().splitlines():
+        if line.startswith(key):
+            return int(float(line[len(key):]))
+    return None
+
+
+class Checks(object):
+    def __init__(self):
+        self.failed = 0
+
+    def check(self, what, good, detail=''):
+        print('%-50s %s %s' % (what, 'OK' if good else 'FAIL', detail))
+        if not good:
+            self.failed += 1
+
+
+def run(test):
+    """run test(checks), stop whatever it started and exit with the result"""
+    checks = Checks()
+    try:
+        test(checks)
+    except Exception:
+        traceback.print_exc()
+        checks.failed += 1
+    finally:
+        stop_all()
+        for path in tmpfiles:
+            os.unlink(path)
+    if checks.failed == 0:
+        print('test passed')
+    sys.exit(1 if checks.failed else 0)
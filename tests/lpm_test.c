@@ -0,0 +1,299 @@
+/*  ChinaDNS
+    Copyright (C) 2015 clowwindy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+
+/* every table is compiled into a trie and looked up around the edges of
+   each prefix and at random, against a scan of the prefixes as added */
+
+// and a NULL after them
+#define MAX_PREFIXES 12
+// prefixes of random tables, and random lookups of every table
+#define RANDOM_PREFIXES 2000
+#define RANDOM_LOOKUPS 100000
+
+typedef struct {
+  const char *name;
+  const char *prefixes[MAX_PREFIXES];
+} table_t;
+
+static const table_t tables[] = {
+  {"empty", {NULL}},
+  {"/0", {"0.0.0.0/0"}},
+  {"/8 in /16 in /24 in /32",
+   {"10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.1.2.3/32"}},
+  {"/32 in /24 in /16", {"10.1.2.3/32", "10.1.2.0/24", "10.1.0.0/16"}},
+  // a whole /16, whole /24s of a block, and a leaf
+  {"levels", {"10.1.0.0/16", "10.2.3.0/24", "10.2.4.128/25", "10.2.5.7/32"}},
+  {"/32s", {"0.0.0.0/32", "1.2.3.4/32", "1.2.3.5/32", "1.2.3.255/32",
+            "1.2.4.0/32", "255.255.255.255/32"}},
+  // merged into one range over two /16s
+  {"adjacent", {"10.0.255.0/24", "10.1.0.0/24", "10.1.1.0/25"}},
+  {"odd lengths", {"2.0.0.0/7", "5.128.0.0/9", "6.2.0.0/15", "6.5.128.0/17",
+                   "6.7.2.0/23", "6.7.9.128/25", "6.7.10.6/31"}},
+  {"top and bottom", {"128.0.0.0/1", "0.0.0.0/24", "127.255.255.0/24"}},
+};
+
+static const table_t tables6[] = {
+  {"empty", {NULL}},
+  {"/0", {"::/0"}},
+  {"nested", {"2000::/3", "2001:db8::/32", "2001:db8:1::/48",
+              "2001:db8:1:2::/64", "2001:db8:1:3::1/128"}},
+  // either side of the 4-bit root and the 6-bit strides after it
+  {"strides", {"2400::/3", "2400::/4", "3000::/5", "2400:c000::/10",
+               "2400:cb00::/22", "2400:cb00:2000::/34",
+               "2400:cb00:2049::/46", "2400:cb00:2049:1::/63"}},
+  {"strides 2", {"4000::/9", "4040::/11", "4410:1000::/27", "4410:2000::/28",
+                 "4410:3000::/29", "4410:3000:5000::/40",
+                 "4410:3000:6100::/41", "4410:3000:6100:4000::/52"}},
+  // beyond /64 only the top 64 bits count
+  {"longer than /64", {"2001:db8::1/128", "2001:db8:0:5::/96",
+                       "2001:db8:0:7::/65"}},
+  {"top and bottom", {"8000::/1", "::/64", "7fff:ffff:ffff:ffff::/64"}},
+};
+
+// a prefix as added, and the addresses it covers
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  int len;
+} range_t;
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  int len;
+} range6_t;
+
+static int failed = 0;
+static unsigned long lookups = 0;
+
+static uint32_t rnd() {
+  static uint64_t x = 0x9e3779b97f4a7c15ULL;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (uint32_t)(x >> 32);
+}
+
+static uint64_t rnd64() {
+  return (uint64_t)rnd() << 32 | rnd();
+}
+
+static int scan(const range_t *ranges, int n, uint32_t ip) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (ip >= ranges[i].start && ip <= ranges[i].end)
+      return 1;
+  }
+  return 0;
+}
+
+static int scan6(const range6_t *ranges, int n, uint64_t ip) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (ip >= ranges[i].start && ip <= ranges[i].end)
+      return 1;
+  }
+  return 0;
+}
+
+static void check(const char *name, const lpm_t *lpm, const range_t *ranges,
+                  int n, uint32_t ip) {
+  int want = scan(ranges, n, ip);
+  int got = lpm_lookup(lpm, ip);
+  lookups++;
+  if (got != want) {
+    struct in_addr addr;
+    addr.s_addr = htonl(ip);
+    printf("%s: %s is %d, should be %d\n", name, inet_ntoa(addr), got, want);
+    failed++;
+  }
+}
+
+static void check6(const char *name, const lpm6_t *lpm,
+                   const range6_t *ranges, int n, uint64_t ip) {
+  int want = scan6(ranges, n, ip);
+  int got = lpm6_lookup(lpm, ip);
+  lookups++;
+  if (got != want) {
+    printf("%s: %016llx is %d, should be %d\n", name, (unsigned long long)ip,
+           got, want);
+    failed++;
+  }
+}
+
+// every range is looked up at its edges and either side of them
+static void test(const char *name, const range_t *ranges, int n) {
+  lpm_t lpm;
+  int i;
+  lpm_init(&lpm);
+  for (i = 0; i < n; i++) {
+    if (0 != lpm_add(&lpm, ranges[i].start, ranges[i].len)) {
+      printf("%s: lpm_add failed\n", name);
+      exit(1);
+    }
+  }
+  if (0 != lpm_build(&lpm)) {
+    printf("%s: lpm_build failed\n", name);
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    uint32_t a = ranges[i].start, b = ranges[i].end;
+    check(name, &lpm, ranges, n, a - 1);
+    check(name, &lpm, ranges, n, a);
+    check(name, &lpm, ranges, n, a + 1);
+    check(name, &lpm, ranges, n, a + (b - a) / 2);
+    check(name, &lpm, ranges, n, b - 1);
+    check(name, &lpm, ranges, n, b);
+    check(name, &lpm, ranges, n, b + 1);
+  }
+  for (i = 0; i < RANDOM_LOOKUPS; i++)
+    check(name, &lpm, ranges, n, rnd());
+  lpm_free(&lpm);
+}
+
+static void test6(const char *name, const range6_t *ranges, int n) {
+  lpm6_t lpm;
+  int i;
+  lpm6_init(&lpm);
+  for (i = 0; i < n; i++) {
+    if (0 != lpm6_add(&lpm, ranges[i].start, ranges[i].len)) {
+      printf("%s: lpm6_add failed\n", name);
+      exit(1);
+    }
+  }
+  if (0 != lpm6_build(&lpm)) {
+    printf("%s: lpm6_build failed\n", name);
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    uint64_t a = ranges[i].start, b = ranges[i].end;
+    check6(name, &lpm, ranges, n, a - 1);
+    check6(name, &lpm, ranges, n, a);
+    check6(name, &lpm, ranges, n, a + 1);
+    check6(name, &lpm, ranges, n, a + (b - a) / 2);
+    check6(name, &lpm, ranges, n, b - 1);
+    check6(name, &lpm, ranges, n, b);
+    check6(name, &lpm, ranges, n, b + 1);
+  }
+  for (i = 0; i < RANDOM_LOOKUPS; i++) {
+    // near the prefixes as well as anywhere
+    uint64_t ip = rnd64();
+    if (n && i % 2)
+      ip = ranges[rnd() % n].start ^ (ip >> (rnd() % 64));
+    check6(name, &lpm, ranges, n, ip);
+  }
+  lpm6_free(&lpm);
+}
+
+static range_t parse(const char *name, const char *s) {
+  char buf[64];
+  char *slash;
+  struct in_addr addr;
+  range_t r;
+  int len;
+  uint32_t mask;
+  strcpy(buf, s);
+  slash = strchr(buf, '/');
+  *slash = 0;
+  len = atoi(slash + 1);
+  if (1 != inet_pton(AF_INET, buf, &addr)) {
+    printf("%s: bad prefix %s\n", name, s);
+    exit(1);
+  }
+  mask = len ? UINT32_MAX << (32 - len) : 0;
+  r.start = ntohl(addr.s_addr) & mask;
+  r.end = r.start | ~mask;
+  r.len = len;
+  return r;
+}
+
+static range6_t parse6(const char *name, const char *s) {
+  char buf[64];
+  char *slash;
+  struct in6_addr addr;
+  range6_t r;
+  int len, i;
+  uint64_t mask;
+  strcpy(buf, s);
+  slash = strchr(buf, '/');
+  *slash = 0;
+  len = atoi(slash + 1);
+  if (1 != inet_pton(AF_INET6, buf, &addr)) {
+    printf("%s: bad prefix %s\n", name, s);
+    exit(1);
+  }
+  r.start = 0;
+  for (i = 0; i < 8; i++)
+    r.start = (r.start << 8) | addr.s6_addr[i];
+  r.len = len;
+  if (len > 64)
+    len = 64;
+  mask = len ? UINT64_MAX << (64 - len) : 0;
+  r.start &= mask;
+  r.end = r.start | ~mask;
+  return r;
+}
+
+int main() {
+  static range_t ranges[RANDOM_PREFIXES];
+  static range6_t ranges6[RANDOM_PREFIXES];
+  unsigned i;
+  int n, len;
+
+  for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    for (n = 0; tables[i].prefixes[n]; n++)
+      ranges[n] = parse(tables[i].name, tables[i].prefixes[n]);
+    test(tables[i].name, ranges, n);
+  }
+  for (i = 0; i < sizeof(tables6) / sizeof(tables6[0]); i++) {
+    for (n = 0; tables6[i].prefixes[n]; n++)
+      ranges6[n] = parse6(tables6[i].name, tables6[i].prefixes[n]);
+    test6(tables6[i].name, ranges6, n);
+  }
+
+  // mostly long prefixes, as in chnroute, which nest and overlap at random
+  for (n = 0; n < RANDOM_PREFIXES; n++) {
+    uint32_t mask;
+    len = n % 50 ? 8 + rnd() % 25 : 1 + rnd() % 32;
+    mask = UINT32_MAX << (32 - len);
+    ranges[n].start = rnd() & mask;
+    ranges[n].end = ranges[n].start | ~mask;
+    ranges[n].len = len;
+  }
+  test("random", ranges, n);
+  // every length, most under a few shared /16s so that they nest
+  for (n = 0; n < RANDOM_PREFIXES; n++) {
+    uint64_t mask;
+    len = n % 50 ? 16 + rnd() % 49 : 1 + rnd() % 64;
+    mask = UINT64_MAX << (64 - len);
+    ranges6[n].start = ((uint64_t)(0x2400 + rnd() % 4) << 48 |
+                        (rnd64() >> 16)) & mask;
+    ranges6[n].end = ranges6[n].start | ~mask;
+    ranges6[n].len = len;
+  }
+  test6("random IPv6", ranges6, n);
+
+  printf("%lu lookups, %d wrong\n", lookups, failed);
+  return failed ? 1 : 0;
+}
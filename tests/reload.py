@@ -0,0 +1,122 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# SIGHUP swaps chnroute and the ip list while queries keep coming, and
+# every one of them is answered, by the old lists or the new ones
+
+import os
+import random
+import signal
+import threading
+import time
+
+import dnstest
+from dnstest import chinadns, metric, query, recv, send, stub, tmpfile
+
+# long enough to load that a reload on the loop would hold queries up
+BIG = ''.join('%d.%d.%d.0/24\n' % (random.randint(12, 126),
+                                   random.randint(0, 255),
+                                   random.randint(0, 255))
+              for i in range(200000))
+
+
+def replace(path, content):
+    """as the lists are updated, written aside and renamed over"""
+    with open(path + '.new', 'w') as f:
+        f.write(content)
+    os.rename(path + '.new', path)
+
+
+def reload(p, checks, what):
+    """SIGHUP, and wait for it to be counted"""
+    reloads = metric('reloads_total')
+    failures = metric('reload_failures_total')
+    started = time.time()
+    os.kill(p.pid, signal.SIGHUP)
+    while time.time() - started < 10:
+        if (metric('reloads_total') != reloads or
+                metric('reload_failures_total') != failures):
+            break
+        time.sleep(0.01)
+    checks.check(what, metric('reloads_total') == reloads + 1,
+                 metric('reloads_total'))
+    return time.time() - started
+
+
+class Querier(threading.Thread):
+    """queries one after another until stopped"""
+
+    def __init__(self):
+        threading.Thread.__init__(self)
+        self.sent = self.answered = 0
+        self.slowest = 0
+        self.running = True
+
+    def run(self):
+        while self.running:
+            qid = self.sent % 65536
+            started = time.time()
+            got, ips = recv(send('c%d.bench' % (self.sent % 100), qid))
+            self.slowest = max(self.slowest, time.time() - started)
+            self.sent += 1
+            self.answered += got == qid and len(ips) == 2
+
+
+def test(checks):
+    chnroute = tmpfile(BIG + '10.0.0.0/8\n127.0.0.1/32\n')
+    iplist = tmpfile('1.2.3.4\n')
+    stub('127.0.0.1')
+    # the chinese answer comes first, when there is one to take
+    stub('127.0.0.2', 'foreign', ['-d', '20'])
+    p = chinadns(['-c', chnroute, '-l', iplist, '-C', '0',
+                  '-e', '127.0.0.1:%d' % dnstest.METRICS_PORT,
+                  '-s', '127.0.0.1:%d,127.0.0.2:%d' %
+                  (dnstest.STUB_PORT, dnstest.STUB_PORT)])
+    _, ips = query('c1.bench', 1)
+    checks.check('10/8 is chinese', ips == ['10.0.0.1', '10.0.0.2'], ips)
+    _, ips = query('f1.bench', 2)
+    checks.check('11/8 is not', ips == ['11.0.0.1', '11.0.0.2'], ips)
+
+    querier = Querier()
+    querier.start()
+    time.sleep(0.2)
+    replace(chnroute, BIG + '11.0.0.0/8\n127.0.0.1/32\n')
+    took = reload(p, checks, 'chnroute reloaded')
+    time.sleep(0.2)
+    querier.running = False
+    querier.join()
+    checks.check('every query answered while reloading',
+                 querier.answered == querier.sent,
+                 '%d of %d' % (querier.answered, querier.sent))
+    # the loop isn't held up while the lists are loaded aside
+    checks.check('none held up by the reload',
+                 querier.slowest < max(took / 2, 0.05),
+                 'slowest %.3fs, reload %.3fs' % (querier.slowest, took))
+
+    _, ips = query('c1.bench', 3)
+    checks.check('now 10/8 is not chinese',
+                 ips == ['11.0.0.1', '11.0.0.2'], ips)
+    _, ips = query('f1.bench', 4)
+    checks.check('and 11/8 is', ips == ['11.0.0.1', '11.0.0.2'], ips)
+
+    replace(iplist, '11.0.0.1\n')
+    reload(p, checks, 'ip list reloaded')
+    _, ips = query('f1.bench', 5)
+    checks.check('an answer with a listed ip is dropped', ips == [], ips)
+    _, ips = query('f5.bench', 6)
+    checks.check('others are not', ips == ['11.0.0.5', '11.0.0.6'], ips)
+
+    # a file that can't be loaded leaves the lists as they were
+    failures = metric('reload_failures_total')
+    replace(chnroute, 'not a network\n')
+    os.kill(p.pid, signal.SIGHUP)
+    time.sleep(1)
+    checks.check('a bad file fails to load',
+                 metric('reload_failures_total') == failures + 1,
+                 metric('reload_failures_total'))
+    _, ips = query('c5.bench', 7)
+    checks.check('the lists stay', ips == ['11.0.0.5', '11.0.0.6'], ips)
+    checks.check('the service is up', p.poll() is None)
+
+
+dnstest.run(test)
@@ -0,0 +1,55 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# ChinaDNS asks a bench stub over DNS over TLS, checked against the
+# certificate the stub made itself, and refuses it under another name
+
+import time
+
+import dnstest
+from dnstest import chinadns, metric, query, stop, stub, tmpfile
+
+STUB = '127.0.0.2:%d' % dnstest.STUB_PORT
+
+chnroute = tmpfile('10.0.0.0/8\n127.0.0.1/32\n')
+ca_file = tmpfile('')
+
+
+def test(checks):
+    stub('127.0.0.1')
+    # every connection is closed after 2 answers, so later ones resume
+    stub('127.0.0.2', 'foreign',
+               ['-T', 'dns.bench', '-A', ca_file, '-C', '2'])
+    time.sleep(0.5)
+
+    p = chinadns(['-c', chnroute, '-l', dnstest.IPLIST, '-C', '0',
+                  '-A', ca_file, '-e', '127.0.0.1:%d' % dnstest.METRICS_PORT,
+                  '-s', '127.0.0.1:%d,tls://%s#dns.bench' %
+                  (dnstest.STUB_PORT, STUB)])
+    qid, ips = query('c1.bench', 1)
+    checks.check('chn name from the chn stub', qid == 1 and
+                 ips == ['10.0.0.1', '10.0.0.2'], ips)
+    for i in range(6):
+        qid, ips = query('f%d.bench' % i, 10 + i)
+        checks.check('foreign name over TLS', qid == 10 + i and
+                     ips == ['11.0.0.%d' % i, '11.0.0.%d' % (i + 1)], ips)
+    handshakes = metric('tls_handshakes_total')
+    resumed = metric('tls_resumed_total')
+    checks.check('a connection for every 2 queries', handshakes >= 3,
+                 handshakes)
+    checks.check('later connections resumed', resumed >= 2, resumed)
+    stop(p)
+
+    # the stub's certificate isn't for the name asked for
+    p = chinadns(['-c', chnroute, '-l', dnstest.IPLIST, '-C', '0',
+                  '-A', ca_file, '-e', '127.0.0.1:%d' % dnstest.METRICS_PORT,
+                  '-s', '127.0.0.1:%d,tls://%s#other.bench' %
+                  (dnstest.STUB_PORT, STUB)])
+    _, ips = query('f1.bench', 20)
+    checks.check('no foreign answer under another name', ips == [], ips)
+    handshakes = metric('tls_handshakes_total')
+    checks.check('no handshake completed', handshakes == 0, handshakes)
+    stop(p)
+
+
+dnstest.run(test)
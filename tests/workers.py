@@ -0,0 +1,94 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# two workers share the port and both answer, and one that is killed is
+# restarted while the other keeps serving
+
+import os
+import signal
+import time
+
+import dnstest
+from dnstest import chinadns, metric, recv, send, stub, tmpfile
+
+
+def workers_of(pid):
+    children = []
+    for name in os.listdir('/proc'):
+        if not name.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % name) as f:
+                stat = f.read()
+        except IOError:
+            continue
+        # the parent pid follows the state, after the command in brackets
+        if int(stat[stat.rindex(')') + 2:].split()[1]) == pid:
+            children.append(int(name))
+    return sorted(children)
+
+
+def udp_sockets(port):
+    """sockets bound to port, which only SO_REUSEPORT lets be more than 1"""
+    with open('/proc/net/udp') as f:
+        lines = f.readlines()[1:]
+    return len([l for l in lines
+                if l.split()[1].endswith(':%04X' % port)])
+
+
+def ask_many(checks, what, n=200):
+    socks = [send('c%d.bench' % i, i) for i in range(n)]
+    answered = 0
+    for i, s in enumerate(socks):
+        qid, ips = recv(s)
+        answered += qid == i and ips == ['10.0.0.%d' % i,
+                                         '10.0.0.%d' % (i + 1)]
+    checks.check(what, answered == n, '%d of %d' % (answered, n))
+
+
+def test(checks):
+    chnroute = tmpfile('10.0.0.0/8\n127.0.0.1/32\n')
+    stub('127.0.0.1')
+    stub('127.0.0.2', 'foreign', ['-d', '20'])
+    p = chinadns(['-c', chnroute, '-l', dnstest.IPLIST, '-C', '0', '-w', '2',
+                  '-e', '127.0.0.1:%d' % dnstest.METRICS_PORT,
+                  '-s', '127.0.0.1:%d,127.0.0.2:%d' %
+                  (dnstest.STUB_PORT, dnstest.STUB_PORT)])
+    # past the uptime a worker needs to be restarted
+    time.sleep(1)
+
+    pids = workers_of(p.pid)
+    checks.check('2 workers', len(pids) == 2, pids)
+    checks.check('both bound to the port', udp_sockets(dnstest.PORT) == 2,
+                 udp_sockets(dnstest.PORT))
+    # every query from its own port, for the kernel to spread
+    ask_many(checks, 'all answered')
+    counts = [metric('queries_total', w) for w in range(2)]
+    checks.check('both workers answer', all(counts), counts)
+
+    os.kill(pids[1], signal.SIGKILL)
+    time.sleep(0.1)
+    ask_many(checks, 'all answered with a worker killed')
+    checks.check('the service is up', p.poll() is None)
+
+    time.sleep(1)
+    restarted = workers_of(p.pid)
+    checks.check('the worker is restarted',
+                 len(restarted) == 2 and pids[1] not in restarted, restarted)
+    checks.check('on the same port', udp_sockets(dnstest.PORT) == 2,
+                 udp_sockets(dnstest.PORT))
+    before = metric('queries_total', 1)
+    ask_many(checks, 'all answered after the restart')
+    after = metric('queries_total', 1)
+    checks.check('the restarted worker answers', after > before,
+                 '%d -> %d' % (before, after))
+    # the same for a worker that is just told to stop
+    os.kill(restarted[0], signal.SIGTERM)
+    time.sleep(1.5)
+    restarted = workers_of(p.pid)
+    checks.check('a stopped worker is restarted too', len(restarted) == 2,
+                 restarted)
+    ask_many(checks, 'all answered after that')
+
+
+dnstest.run(test)